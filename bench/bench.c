@@ -0,0 +1,297 @@
+// Benchmarks for the shell's hot paths.
+//
+// Each benchmark is a generated script that repeats one operation N times.
+// The script is run by every shell under test (bin/shell, dash and bash by
+// default) and timed from spawn to exit; the time of an empty script is
+// subtracted so the result is the cost of the operation itself, not of
+// starting the shell. Every measurement is the median of several runs.
+//
+// Usage: bench [-n N] [-r RUNS] [--json] [shell ...]
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define MAX_SHELLS 8
+#define MAX_RUNS 64
+#define PIPE_BYTES (64L * 1024 * 1024)
+#define PIPE_STAGES 4
+
+typedef enum {
+  PER_OP,   // microseconds per operation, lower is better
+  THROUGHPUT // MB/s, higher is better
+} BenchUnit;
+
+typedef struct {
+  const char *name;
+  const char *help;
+  BenchUnit unit;
+  void (*write)(FILE *script, int n);
+} Benchmark;
+
+void write_parse(FILE *script, int n) {
+  // Many words, quotes and operators per line, but only one cheap builtin
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "pwd a 'b c' \"d e\" f g h i j k l m n o p > /dev/null"
+                    " ; cd . && cd .\n");
+  }
+}
+
+void write_builtin(FILE *script, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "cd .\n");
+  }
+}
+
+void write_lookup(FILE *script, int n) {
+  // A miss scans every PATH directory and is never cached
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "bench_no_such_command_%d\n", i % 16);
+  }
+}
+
+void write_spawn(FILE *script, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "/bin/true\n");
+  }
+}
+
+void write_jobs(FILE *script, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "/bin/true &\n");
+  }
+  fprintf(script, "wait\n");
+}
+
+void write_subst(FILE *script, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "x=$(echo %d)\n", i);
+  }
+}
+
+void write_loop(FILE *script, int n) {
+  // One line: the cost is test, arithmetic and assignment per pass
+  fprintf(script, "i=0; while [ $i -lt %d ]; do i=$((i+1)); done\n", n);
+}
+
+void write_pipeline(FILE *script, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(script, "head -c %ld /dev/zero", PIPE_BYTES);
+    for (int stage = 1; stage < PIPE_STAGES; stage++) {
+      fprintf(script, " | cat");
+    }
+    fprintf(script, " > /dev/null\n");
+  }
+}
+
+Benchmark benchmarks[] = {
+    {"parse", "parse a 20-word line with lists and a redirect", PER_OP,
+     write_parse},
+    {"builtin", "run cd . (builtin dispatch)", PER_OP, write_builtin},
+    {"lookup", "PATH search for a missing command", PER_OP, write_lookup},
+    {"spawn", "run /bin/true and wait for it", PER_OP, write_spawn},
+    {"jobs", "start /bin/true & and reap it", PER_OP, write_jobs},
+    {"subst", "capture a builtin's output with $(echo N)", PER_OP,
+     write_subst},
+    {"loop", "one pass of while [ $i -lt N ]; do i=$((i+1)); done",
+     PER_OP, write_loop},
+    {"pipeline", "4-stage head | cat | cat | cat", THROUGHPUT,
+     write_pipeline},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+long long monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int compare_long_long(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Run shell on script with all output discarded; return the elapsed
+// nanoseconds, or -1 if the shell could not be started
+long long run_script(const char *shell, const char *script) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  char *argv[] = {(char *)shell, (char *)script, NULL};
+
+  long long start = monotonic_ns();
+  pid_t pid;
+  int err = posix_spawnp(&pid, shell, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    return -1;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return monotonic_ns() - start;
+}
+
+// Median time of runs executions of shell on script
+long long median_run(const char *shell, const char *script, int runs) {
+  long long times[MAX_RUNS];
+  for (int i = 0; i < runs; i++) {
+    times[i] = run_script(shell, script);
+    if (times[i] < 0) {
+      return -1;
+    }
+  }
+  qsort(times, runs, sizeof(times[0]), compare_long_long);
+  return times[runs / 2];
+}
+
+// Generate a benchmark script with n repetitions into a temp file
+int make_script(char *path, size_t size, Benchmark *b, int n) {
+  snprintf(path, size, "/tmp/shell-bench-XXXXXX");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return -1;
+  }
+  FILE *script = fdopen(fd, "w");
+  if (b != NULL) {
+    b->write(script, n);
+  }
+  fclose(script);
+  return 0;
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: bench [-n N] [-r RUNS] [--json] [shell ...]\n");
+  fprintf(stderr, "  default shells: bin/shell dash bash\n\n");
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    fprintf(stderr, "  %-9s %s\n", benchmarks[i].name, benchmarks[i].help);
+  }
+}
+
+int main(int argc, char **argv) {
+  int n = 1000;
+  int runs = 5;
+  int json = 0;
+  const char *shells[MAX_SHELLS];
+  int num_shells = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      n = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = 1;
+    } else if (argv[i][0] == '-') {
+      usage();
+      return 2;
+    } else if (num_shells < MAX_SHELLS) {
+      shells[num_shells++] = argv[i];
+    }
+  }
+  if (n < 1 || runs < 1 || runs > MAX_RUNS) {
+    usage();
+    return 2;
+  }
+  if (num_shells == 0) {
+    shells[num_shells++] = "bin/shell";
+    shells[num_shells++] = "dash";
+    shells[num_shells++] = "bash";
+  }
+
+  // Startup cost of each shell, subtracted from every benchmark
+  char empty[64];
+  long long baseline[MAX_SHELLS];
+  if (make_script(empty, sizeof(empty), NULL, 0) < 0) {
+    perror("bench: mkstemp");
+    return 1;
+  }
+  for (int s = 0; s < num_shells; s++) {
+    baseline[s] = median_run(shells[s], empty, runs);
+  }
+  unlink(empty);
+
+  if (json) {
+    printf("{\"n\":%d,\"runs\":%d,\"results\":[", n, runs);
+  } else {
+    printf("%-10s", "benchmark");
+    for (int s = 0; s < num_shells; s++) {
+      const char *slash = strrchr(shells[s], '/');
+      printf(" %14s", slash && slash[1] ? slash + 1 : shells[s]);
+    }
+    printf("\n");
+  }
+
+  int first = 1;
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    Benchmark *b = &benchmarks[i];
+    // Throughput benchmarks move a lot of data per line; a few lines do
+    int lines = b->unit == THROUGHPUT ? 2 : n;
+    char script[64];
+    if (make_script(script, sizeof(script), b, lines) < 0) {
+      perror("bench: mkstemp");
+      return 1;
+    }
+    if (!json) {
+      printf("%-10s", b->name);
+    }
+    for (int s = 0; s < num_shells; s++) {
+      long long total =
+          baseline[s] < 0 ? -1 : median_run(shells[s], script, runs);
+      double value = -1;
+      if (total >= 0) {
+        long long ns = total - baseline[s];
+        if (ns < 1) {
+          ns = 1;
+        }
+        if (b->unit == THROUGHPUT) {
+          value = (double)PIPE_BYTES * lines / (1024.0 * 1024.0) / (ns / 1e9);
+        } else {
+          value = ns / 1000.0 / lines;
+        }
+      }
+      if (json) {
+        printf("%s{\"benchmark\":\"%s\",\"shell\":\"%s\",\"unit\":\"%s\","
+               "\"value\":",
+               first ? "" : ",", b->name, shells[s],
+               b->unit == THROUGHPUT ? "MB/s" : "us/op");
+        if (value < 0) {
+          printf("null}");
+        } else {
+          printf("%.3f}", value);
+        }
+        first = 0;
+      } else if (value < 0) {
+        printf(" %14s", "-");
+      } else {
+        printf(" %9.2f %-4s", value, b->unit == THROUGHPUT ? "MB/s" : "us");
+      }
+    }
+    if (!json) {
+      printf("\n");
+    }
+    fflush(stdout);
+    unlink(script);
+  }
+  if (json) {
+    printf("]}\n");
+  }
+  return 0;
+}
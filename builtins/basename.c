@@ -0,0 +1,71 @@
+// basename and dirname as loadable builtins, for scripts that call them
+// once per file in a loop:
+//
+//   enable -f bin/basename.so basename dirname
+//
+// Only the common forms are handled: basename NAME [SUFFIX] and
+// dirname NAME.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "myshell_builtin.h"
+
+// Length of path without trailing slashes, keeping a lone "/"
+static size_t trim_slashes(const char *path, size_t len) {
+  while (len > 1 && path[len - 1] == '/') {
+    len--;
+  }
+  return len;
+}
+
+static int basename_run(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: basename NAME [SUFFIX]\n");
+    return 1;
+  }
+  const char *path = argv[1];
+  size_t len = trim_slashes(path, strlen(path));
+  size_t start = len;
+  while (start > 0 && path[start - 1] != '/') {
+    start--;
+  }
+  if (start == len && len > 0) {
+    // Nothing but slashes
+    start = len - 1;
+  }
+  const char *suffix = argc == 3 ? argv[2] : "";
+  size_t suffix_len = strlen(suffix);
+  if (suffix_len > 0 && suffix_len < len - start &&
+      memcmp(path + len - suffix_len, suffix, suffix_len) == 0) {
+    len -= suffix_len;
+  }
+  printf("%.*s\n", (int)(len - start), path + start);
+  return 0;
+}
+
+static int dirname_run(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: dirname NAME\n");
+    return 1;
+  }
+  const char *path = argv[1];
+  size_t len = trim_slashes(path, strlen(path));
+  while (len > 0 && path[len - 1] != '/') {
+    len--;
+  }
+  if (len == 0) {
+    printf(".\n");
+    return 0;
+  }
+  len = trim_slashes(path, len);
+  printf("%.*s\n", (int)len, path);
+  return 0;
+}
+
+MyshellBuiltin basename_builtin = {MYSHELL_BUILTIN_ABI, "basename",
+                                   basename_run,
+                                   "Strip directory and suffix from NAME"};
+
+MyshellBuiltin dirname_builtin = {MYSHELL_BUILTIN_ABI, "dirname", dirname_run,
+                                  "Strip the last component from NAME"};
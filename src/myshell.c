@@ -1,13 +1,44 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#endif
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
-#define MAX_INPUT 1024
-#define MAX_ARGS 64
+#include "myshell_builtin.h"
+#include "myshell_serve.h"
 
 // Color codes for terminal
 #define COLOR_GREEN "\033[1;32m"
@@ -16,765 +47,11066 @@
 #define COLOR_YELLOW "\033[1;33m"
 #define COLOR_RESET "\033[0m"
 
-// Background job tracking
-#define MAX_JOBS 100
+// Background job table (see job_create). Jobs are indexed by id in a
+// growable array and by pid in a hash table, so reaping a child is O(1) no
+// matter how many jobs a session has started. Freed ids are recycled
+// smallest-first. At most job_slots jobs run at once; the rest wait in a
+// FIFO queue and are started by jobs_dispatch as running ones finish.
+// Every job's processes share a process group of their own, so fg, bg and
+// kill %N act on a whole pipeline at once.
+typedef enum { JOB_QUEUED, JOB_RUNNING, JOB_STOPPED, JOB_DONE } JobState;
 
 typedef struct {
   pid_t pid;
-  int job_id;
-  char command[MAX_INPUT];
-  int completed;
+  int status; // raw wait status once exited
+  int exited;
+} JobProc;
+
+typedef struct Job {
+  int id;
+  JobState state;
+  char *command;
+  JobProc *procs;
+  int num_procs;
+  int live_procs;
+  int status;            // exit status of the last process, as for $?
+  pid_t pgid;            // process group, led by the first process
+  int gate;              // pipe that starts a job forked while queued, or 0
+  int stop_notice;       // stopped in the background, not announced yet
+  char **argv;           // expanded command while queued, NULL once started
+  char **env;            // its NAME=value assignments, if any
+  struct ProcLimits *limits; // pin, nice, limit and ionice settings, or NULL
+  struct Job *next_queued;
+  struct Job *next_done; // completion notice queue
+  struct Job *prev_done;
 } Job;
 
-Job jobs[MAX_JOBS];
-int job_count = 0;
+typedef struct PidSlot {
+  pid_t pid;
+  Job *job;
+  int proc; // index into job->procs
+  struct PidSlot *next;
+} PidSlot;
+
+typedef struct {
+  Job **by_id; // by_id[id], NULL when the id is free
+  int id_cap;
+  int next_id;   // one past the highest id handed out so far
+  int *free_ids; // min-heap of released ids
+  int num_free;
+  int free_cap;
+  PidSlot **buckets;
+  size_t num_buckets;
+  size_t num_pids;
+  int running; // stopped jobs do not hold a slot
+  int queued;
+  int stop_notices; // jobs with stop_notice set
+  Job *foreground;  // the job fg is waiting for
+  Job *queue_head; // jobs waiting for a free slot, oldest first
+  Job *queue_tail;
+  Job *done_head; // finished jobs waiting for their notice (or a wait)
+  Job *done_tail;
+  int num_done;
+} JobTable;
+
+JobTable job_table;
+
+// Finished jobs a script has not collected with wait yet are kept up to
+// this many, oldest dropped first
+#define JOB_REMEMBER_MAX 4096
+
+// Foreground children picked up by waitpid(-1) while the shell was busy
+// dispatching queued jobs; wait_for_child claims them from here
+typedef struct {
+  pid_t pid;
+  int status;
+} ReapedChild;
+
+ReapedChild *reaped_fg;
+int num_reaped_fg;
+int reaped_fg_cap;
+
+// Shell options, changed with `set name=value` (see builtin_set)
+long job_slots;  // background jobs allowed to run at once, 0 for no limit
+long pipe_size;  // capacity for pipeline pipes in bytes, 0 for the default
+long pipe_stats; // relay pipelines through the shell and report per pipe
+long glob_cache = 1; // reuse directory listings between globs (see glob_list)
+
+typedef enum {
+  OPT_NUMBER,
+  OPT_SIZE, // bytes, with an optional K, M or G suffix
+  OPT_BOOL, // on/off
+  OPT_TEXT  // a string; empty or "off" clears it
+} ShellOptionKind;
+
+typedef struct {
+  const char *name;
+  ShellOptionKind kind;
+  long *value;  // OPT_NUMBER, OPT_SIZE, OPT_BOOL
+  char **text;  // OPT_TEXT
+  void (*changed)(void); // called after a new value is stored
+  const char *help;
+} ShellOption;
+
+// Execution trace (see trace_emit): one JSON object per line, collected
+// in buf and written out when the shell is idle, the buffer fills up or
+// the shell exits
+#define TRACE_BUFFER 65536
+
+typedef struct {
+  int fd; // -1 when tracing is off
+  char *path;
+  char buf[TRACE_BUFFER];
+  size_t len;
+  int job; // job id for spawn events while a job is being started
+} TraceLog;
+
+TraceLog trace = {.fd = -1};
+
+typedef struct {
+  const char *event;
+  long long start_us; // monotonic
+  long long dur_us;
+  pid_t pid;         // omitted when 0
+  int job;           // omitted when 0
+  const char *name;  // command or path, omitted when NULL
+  const char *key;   // one event-specific number, omitted when NULL
+  long value;
+} TraceEvent;
+
+// Latency histogram over power-of-two microsecond buckets: bucket b holds
+// values below 2^b us
+#define HIST_BUCKETS 40
+
+typedef struct {
+  unsigned long count;
+  unsigned long long total_us;
+  unsigned long long max_us;
+  unsigned long buckets[HIST_BUCKETS];
+} Histogram;
+
+// Counters shown by the stats builtin
+typedef struct {
+  unsigned long lines;    // command lines parsed
+  unsigned long commands; // simple commands and pipeline stages run
+  unsigned long spawns;   // processes started, forked builtins included
+  unsigned long spawn_failures;
+  unsigned long lookup_hits;   // PATH cache
+  unsigned long lookup_misses; // directory scans, found or not
+  unsigned long jobs_started;
+  unsigned long jobs_reaped;
+  unsigned long env_builds; // environment arrays rebuilt for spawns
+  unsigned long substs;      // $(...) and `...` evaluated
+  unsigned long subst_forks; // of which needed a subshell
+  Histogram parse;
+  Histogram lookup;
+  Histogram spawn;
+  Histogram wait; // time blocked on foreground children
+} ShellStats;
+
+ShellStats stats;
+
+// Command history, shared by every shell through an append-only file of
+// one entry per line (see history_sync). The file is mapped rather than
+// read, and only indexed when history is first used, so startup does not
+// depend on its size. Each block of HISTORY_BLOCK entries has a bitmap of
+// the trigrams it contains, letting searches skip blocks that cannot match;
+// bitmaps are built the first time a search reaches their block.
+#define HISTORY_BLOCK 64
+#define HISTORY_SIG_WORDS 64 // 4096-bit trigram bitmap per block
+
+typedef struct {
+  int fd; // -1 until first use
+  int failed; // the file could not be opened; history is off
+  char *map;
+  size_t map_size;
+  size_t *offsets; // start of each complete entry
+  size_t count;
+  size_t cap;
+  size_t end; // end of the last indexed entry
+  uint64_t *sigs; // HISTORY_SIG_WORDS per block
+  unsigned char *sig_ready; // per block: bitmap built
+  size_t sig_blocks;
+} History;
+
+History history = {.fd = -1};
+
+// Descriptor that becomes readable when a child changes state: a signalfd
+// on Linux, the read end of a self-pipe elsewhere
+int child_event_fd = -1;
+
+int last_status = 0; // exit status of the most recent command
+int interactive = 0; // reading commands from a terminal
+int serving = 0;     // a --serve worker: exit ends the request, not the shell
+int pending_exit = -1; // status given to exit in a --serve request, or -1
+volatile sig_atomic_t interrupted = 0; // Ctrl+C seen since last cleared
+
+// Control flow being unwound: break N and continue N leave N loops (the
+// last continue goes on with the next iteration), return leaves the
+// innermost function
+int breaking = 0;
+int continuing = 0;
+int returning = 0;
+int loop_depth = 0;
+int func_depth = 0;
+#define FUNC_MAX_DEPTH 1000
+
+// Positional parameters $1... of the script or of the running function
+typedef struct {
+  char **argv; // heap copy (see argv_copy), or NULL
+  int argc;
+  int shift;   // $1 is argv[shift]
+} PosArgs;
+
+PosArgs pos_args = {0};
+
+// Prompt rendering (see prompt_render). The PS1 format is compiled once into
+// pieces; the rendered text is kept in two buffers so a signal handler can
+// always write() a complete prompt while the other one is being rebuilt.
+#define PROMPT_MAX 4096
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+#define DEFAULT_PS1 "\\e[1;32m\\u@\\H\\e[0m:\\e[1;34m\\w\\e[0m> "
+
+typedef enum {
+  PROMPT_TEXT,
+  PROMPT_USER,       // \u
+  PROMPT_HOST,       // \H
+  PROMPT_HOST_SHORT, // \h
+  PROMPT_CWD,        // \w
+  PROMPT_CWD_BASE,   // \W
+  PROMPT_DOLLAR      // \$
+} PromptPieceKind;
+
+typedef struct {
+  PromptPieceKind kind;
+  char *text; // literal bytes for PROMPT_TEXT
+  size_t len;
+} PromptPiece;
+
+typedef struct {
+  PromptPiece *pieces;
+  int num_pieces;
+  char user[256];
+  char host[256];
+  char home[PATH_MAX];
+  char cwd[PATH_MAX];
+  char dollar[2]; // "#" for root, "$" otherwise
+  // Each buffer holds "\n" + prompt; the newline is used after Ctrl+C
+  char buffers[2][PROMPT_MAX + 1];
+  size_t lengths[2];
+  volatile sig_atomic_t current;
+} Prompt;
+
+Prompt prompt;
+
+// Buffered command-line reader used for the terminal, scripts, stdin and -c
+#define INPUT_CHUNK 65536
+
+typedef struct {
+  int fd;     // descriptor to read from, or -1 when reading a -c string
+  int watch_children; // service job events while waiting (interactive)
+  int edit;   // lines come from the line editor (see edit_line)
+  char *buf;
+  size_t len; // bytes of valid data in buf
+  size_t pos; // start of the next unread line
+  size_t cap;
+  int eof;
+} InputSource;
+
+// PATH lookup cache (see search_in_path)
+#define PATH_CACHE_INITIAL_BUCKETS 64
+#define PATH_RECHECK_INTERVAL_MS 1000
+#define PATH_PINNED -1 // dir_index of entries added with hash -p
+
+#ifdef __APPLE__
+#define STAT_MTIME(st) ((st).st_mtimespec)
+#else
+#define STAT_MTIME(st) ((st).st_mtim)
+#endif
+
+typedef struct PathEntry {
+  char *name;
+  char *path;
+  int dir_index; // PATH directory the command was found in
+  unsigned int hits;
+  struct PathEntry *next;
+} PathEntry;
+
+typedef struct {
+  PathEntry **buckets;
+  size_t num_buckets;
+  size_t count;
+  char *path_value; // $PATH the directory list was built from
+  char **dirs;
+  struct timespec *dir_mtimes;
+  int num_dirs;
+  long long last_check_ms;
+} PathCache;
+
+PathCache path_cache;
+
+// Shell variables (see var_set): one hash table for shell-local and
+// exported variables. The environment handed to children is rebuilt from
+// the exported ones only when one of them has changed since the last spawn.
+#define VAR_INITIAL_BUCKETS 128
+#define VAR_EXPORT 1
+#define VAR_READONLY 2
+
+typedef struct Var {
+  char *name;
+  char *value; // NULL for a declared but unset variable (export NAME)
+  int flags;   // VAR_* bits
+  struct Var *next;
+} Var;
+
+typedef struct {
+  Var **buckets;
+  size_t num_buckets;
+  size_t count;
+  char **envp;    // exported NAME=value strings, NULL-terminated
+  int env_dirty;  // an exported variable changed since envp was built
+  unsigned long changes; // sets and unsets so far, for vars_reset
+} VarTable;
+
+VarTable vars;
+
+// Glob expansion (see glob_expand). A pattern is split at slashes and each
+// component compiled once into match ops; directories are read with
+// getdents64 and, with the globcache option, their listings kept while the
+// directory's mtime is unchanged, for at most GLOB_CACHE_TTL_MS.
+#define GLOB_CACHE_SLOTS 32
+#define GLOB_CACHE_TTL_MS 2000
+#define GLOB_DENTS_BUFFER 262144
+
+typedef enum { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS } GlobOpKind;
+
+typedef struct {
+  GlobOpKind kind;
+  unsigned char c;           // GLOB_CHAR
+  unsigned char set[32];     // GLOB_CLASS: bitmap of bytes that match
+} GlobOp;
+
+typedef struct {
+  int globstar;  // the component is exactly **
+  int literal;   // no wildcards: text is the name itself
+  char *text;    // unescaped name for literal components
+  GlobOp *ops;
+  int num_ops;
+  int match_dot; // starts with a literal '.', so hidden names may match
+} GlobPart;
+
+// One directory's entries: NUL-separated names with their d_type
+typedef struct {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  long long read_ms;
+  char *names;
+  size_t *offsets;
+  unsigned char *types;
+  size_t count;
+  int users; // walks currently iterating it; never evicted while > 0
+} GlobDir;
+
+GlobDir *glob_dirs[GLOB_CACHE_SLOTS];
+pid_t shell_pid;   // $$
+const char *shell_name = "myshell"; // $0: the shell or the script it runs
+pid_t last_bg_pid; // $!
+
+extern char **environ;
+
+// Process launch engine (see launch_command)
+#define LAUNCH_MAX_FDS 16
+
+// Scheduling and resource settings from the pin, nice, limit and ionice
+// prefixes (see command_prefix). They are applied in the child between
+// fork and exec (see limits_apply), to every stage of a pipeline.
+#define LIMITS_PIN 1    // pin CPUSET
+#define LIMITS_SPREAD 2 // pin -s CPUSET: stage i gets the i-th CPU of the set
+#define LIMITS_NICE 4   // nice N
+#define LIMITS_IONICE 8 // ionice CLASS[:LEVEL]
+#define LIMITS_MAX_CPUS 1024
+#define LIMITS_MAX_RLIMITS 8
+
+typedef struct {
+  int resource; // RLIMIT_*
+  rlim_t value; // soft and hard limit
+} RlimitSetting;
+
+typedef struct ProcLimits {
+  int flags; // LIMITS_* bits
+  unsigned char cpus[LIMITS_MAX_CPUS / 8];
+  int num_cpus;
+  int nice;       // added to the child's niceness
+  int io_class;   // 1 realtime, 2 best-effort, 3 idle
+  int io_level;   // 0 (highest) to 7
+  RlimitSetting rlimits[LIMITS_MAX_RLIMITS]; // limit key=value,...
+  int num_rlimits;
+} ProcLimits;
+
+typedef struct {
+  int from; // descriptor in the shell or already set up in the child; -1 closes
+  int to;   // descriptor number it becomes in the child
+} FdMapping;
+
+typedef struct {
+  char **argv;
+  char **env;       // NAME=value assignments for this command only
+  int num_env;
+  const char *path; // resolved executable, filled by launch_external
+  int builtin;      // run execute_builtin in a forked child instead
+  struct Node *subshell; // with builtin: run this command line instead
+  const ProcLimits *limits; // applied in the child before exec, or NULL
+  int stage;        // index in the pipeline, for pin -s
+  pid_t pgid;       // process group to join; -1 leads a new one, 0 the shell's
+  int gate;         // forked child waits for a byte on this pipe first, or 0
+  pid_t gate_owner; // with gate: the shell that will open it
+  FdMapping fds[LAUNCH_MAX_FDS];
+  int num_fds;
+  int opened[LAUNCH_MAX_FDS]; // shell descriptors to close once launched
+  int num_opened;
+} LaunchSpec;
+
+// Lexer and parser (see parse_input). Tokens and words are slices of the
+// input line; nothing is copied until expansion.
+typedef enum {
+  TOK_WORD,
+  TOK_IO_NUMBER, // digits directly before < or >, as in 2>file
+  TOK_NEWLINE,
+  TOK_SEMI,      // ;
+  TOK_AMP,       // &
+  TOK_AND_IF,    // &&
+  TOK_PIPE,      // |
+  TOK_OR_IF,     // ||
+  TOK_LESS,      // <
+  TOK_GREAT,     // >
+  TOK_DGREAT,    // >>
+  TOK_LESSAND,   // <&
+  TOK_GREATAND,  // >&
+  TOK_DLESS,     // <<
+  TOK_DLESSDASH, // <<-
+  TOK_TLESS,     // <<<
+  TOK_LPAREN,    // (
+  TOK_RPAREN,    // )
+  TOK_DSEMI,     // ;;
+  TOK_EOF,
+  TOK_ERROR
+} TokenKind;
+
+#define WORD_QUOTED 1 // contains quotes or backslashes to remove
+#define WORD_DOLLAR 2 // contains $ outside single quotes
+#define WORD_TILDE 4  // starts with an unquoted ~
+#define WORD_GLOB 8   // contains an unquoted * ? or [
+
+typedef struct {
+  const char *text;
+  size_t len;
+  int flags; // WORD_* bits
+} Word;
+
+typedef struct {
+  TokenKind kind;
+  const char *start;
+  size_t len;
+  int flags; // WORD_* bits for TOK_WORD
+} Token;
+
+typedef enum {
+  REDIR_IN,      // [n]<file
+  REDIR_OUT,     // [n]>file
+  REDIR_APPEND,  // [n]>>file
+  REDIR_DUP_IN,  // [n]<&m or [n]<&-
+  REDIR_DUP_OUT, // [n]>&m or [n]>&-
+  REDIR_HEREDOC, // [n]<<word or [n]<<-word, body in the following lines
+  REDIR_HERESTRING // [n]<<<word
+} RedirKind;
+
+typedef struct Redir {
+  RedirKind kind;
+  int fd; // descriptor being redirected
+  Word target;
+  struct Redir *next;
+  // REDIR_HEREDOC: the body, read after the command line (see
+  // heredoc_read); flags is WORD_DOLLAR unless the delimiter was quoted
+  Word body;
+  int strip_tabs;            // <<- drops leading tabs from each line
+  struct Redir *next_heredoc; // bodies still to be read, in source order
+} Redir;
+
+typedef enum {
+  NODE_COMMAND,  // words and redirections
+  NODE_PIPELINE, // children joined by |
+  NODE_AND,      // left && right
+  NODE_OR,       // left || right
+  NODE_SEQUENCE, // children run in order, separated by ; & or newlines
+  NODE_IF,       // children: condition and body pairs, then an else body
+  NODE_WHILE,    // while left; do right; done
+  NODE_UNTIL,    // until left; do right; done
+  NODE_FOR,      // for words[0] in words[1..]; do right; done
+  NODE_CASE,     // case words[0] in items esac
+  NODE_GROUP,    // { left; }
+  NODE_SUBSHELL, // ( left )
+  NODE_FUNCTION  // words[0]() left
+} NodeKind;
+
+// One pattern list of a case command and the commands it selects
+typedef struct {
+  Word *patterns;
+  int num_patterns;
+  struct Node *body;
+} CaseItem;
+
+typedef struct Node {
+  NodeKind kind;
+  int background;   // sequence item terminated by &
+  int negate;       // ! pipeline
+  const char *text; // source slice, used for job listings
+  size_t text_len;
+  Word *words;      // NODE_COMMAND, NODE_FOR, NODE_CASE, NODE_FUNCTION
+  int num_words;
+  Redir *redirs;    // NODE_COMMAND and the compound commands
+  struct Node **children; // NODE_PIPELINE, NODE_SEQUENCE, NODE_IF
+  int num_children;
+  struct Node *left;  // NODE_AND, NODE_OR and the compound commands
+  struct Node *right;
+  CaseItem *items;    // NODE_CASE
+  int num_items;
+} Node;
+
+// Per-command arena (see arena_alloc). Everything a command line needs
+// while it is parsed and run (tree, expanded words, pipeline bookkeeping)
+// is bump-allocated here and dropped at once when the line is done. Chunks
+// are kept for the next line, so once the arena has grown to fit the
+// largest line seen, running a command does not touch the heap.
+#define ARENA_CHUNK 65536
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *head;
+  ArenaChunk *current;
+  size_t chunks;     // malloc'd so far
+  size_t capacity;   // bytes in all chunks
+  size_t high_water; // most bytes used by one line
+  unsigned long resets;
+  size_t chunk_size; // least size of a new chunk; 0 for ARENA_CHUNK
+} Arena;
+
+// A point in an arena to go back to (see arena_rewind)
+typedef struct {
+  ArenaChunk *chunk;
+  size_t used;
+} ArenaMark;
+
+Arena cmd_arena;
+
+typedef struct {
+  const char *pos;
+  const char *end;
+  const char *prev_end; // end of the last consumed token
+  Token tok;            // current lookahead token
+  const char *error;    // set once a syntax error has been reported
+  Redir *heredocs;      // here-documents whose bodies follow the line
+  Redir *last_heredoc;
+  InputSource *in;      // where an unfinished command continues, or NULL
+  int open;             // constructs still waiting for their closing token
+  int cancelled;        // Ctrl+C at a continuation prompt dropped the command
+} Parser;
+
+// Growable string and argument vectors used by expansion. With arena set
+// they grow inside it and are never freed individually.
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  Arena *arena;
+} StrBuf;
+
+// Field splitting of unquoted expansions (see fields_append):
+// where each field of a word but the last ends, in the word and in its
+// glob pattern
+typedef struct {
+  size_t *ends; // word and pattern offset pairs
+  int count;
+  int cap;
+  int pending;  // a separator was seen; the field ends at pending_word
+  int forced;   // if more text follows. forced: a non-blank separator
+  size_t pending_word;
+  size_t pending_pat;
+  int vanish;   // "$@" without parameters: no word unless other text
+} Fields;
+
+// One item of a parallel run (see builtin_parallel)
+typedef struct {
+  size_t index; // position of the item in the input
+  pid_t pid;    // 0 once reaped
+  int out_fd;   // read end of the output pipe with -k, -1 at EOF
+  StrBuf out;   // output held back until earlier items are written
+  long long start_us;
+  int status;
+} ParallelTask;
+
+typedef struct {
+  char **argv; // NULL-terminated
+  int argc;
+  int cap;
+  Arena *arena; // owns argv and its strings, if set
+} ArgVec;
+
+typedef struct {
+  int fd;
+  int saved; // copy of the original descriptor, or -1 if it was closed
+} SavedFd;
+
+// Words in front of a command or pipeline that change how it runs
+// (see command_prefix)
+#define TIME_TEXT 1 // time
+#define TIME_JSON 2 // time -j
+
+typedef struct {
+  long pipe_size; // pipesize SIZE
+  int time;       // 0, TIME_TEXT or TIME_JSON
+  ProcLimits limits; // pin, nice, limit and ionice
+} CommandPrefix;
+
+// Resource use of one stage of a timed command (see time_report)
+typedef struct {
+  pid_t pid; // 0 for a stage run inside the shell, -1 if it never started
+  char *name;
+  long long start_us;
+  long long end_us;
+  struct rusage usage;
+} StageTiming;
+
+// A pipeline pipe relayed through the shell when pipestats is on: the
+// producer writes into one pipe and the shell splices it into the next
+typedef struct {
+  int from; // shell's read end of the producer's pipe
+  int to;   // shell's write end of the consumer's pipe
+  unsigned long long bytes;
+  long long stall_since_us; // data waiting on a full consumer pipe since
+  long long stalled_us;
+  long long closed_us;
+} PipeEdge;
+
+// Builtin commands (see builtin_find)
+#define BUILTIN_STAGE 1    // only built in as a pipeline stage (is_data_mover)
+#define BUILTIN_DISABLED 2 // turned off with enable -n
+#define BUILTIN_SUBST 4    // leaves the shell alone: $(...) runs it in-process
+
+typedef struct {
+  const char *name;
+  int (*func)(char **args); // core builtin
+  MyshellBuiltin *loaded;   // or one loaded with enable -f
+  char *path;               // shared object it was loaded from
+  void *handle;             // its dlopen handle, one reference per builtin
+  int flags;
+} Builtin;
+
+typedef struct {
+  Builtin *list; // sorted by name
+  int count;
+  int cap;
+} BuiltinTable;
+
+// Shell functions by name (see func_define). Each body is copied out of
+// the command line into an arena of its own, so it outlives the line.
+#define FUNC_BUCKETS 64
+
+typedef struct Function {
+  char *name;
+  Node *body;
+  Arena arena;  // owns body
+  int calls;    // running calls; a replaced function is freed after the last
+  int replaced; // redefined or unset, no longer in the table
+  struct Function *next;
+} Function;
+
+Function *functions[FUNC_BUCKETS];
+int num_functions = 0;
+
+// Line editor for an interactive terminal (see edit_line). The terminal is
+// in raw mode only while a line is being edited; commands run with the
+// settings the shell found.
+#define EDIT_KEYS 256     // typed-ahead or pasted bytes read at once
+#define EDIT_ESC_MS 50    // wait for the rest of an escape sequence
+#define EDIT_ASK_LIST 100 // ask before listing more completions than this
+
+typedef struct {
+  int enabled;           // stdin is a terminal we can drive
+  int active;            // a line is being edited and raw mode is on
+  struct termios cooked; // settings to restore after each line
+  char prompt[PROMPT_MAX + 1]; // prompt of the line being edited
+  size_t prompt_len;
+  size_t prompt_last;    // start of its last line, redrawn on each change
+  int prompt_width;      // columns that last line takes
+  StrBuf line;
+  size_t cursor;         // byte offset in line
+  size_t scroll;         // first byte shown when the line is too wide
+  size_t history_index;  // entry shown; history.count for the new line
+  StrBuf saved;          // the new line while browsing history
+  StrBuf out;            // screen update being built
+  char keys[EDIT_KEYS];  // input read but not yet handled
+  size_t keys_len;
+  size_t keys_pos;
+  int tabs;              // Tab presses in a row
+} LineEditor;
+
+LineEditor editor;
+
+// Every executable on $PATH in a trie, for command completion. Nodes are
+// kept in one array and linked first-child/next-sibling, siblings sorted
+// by byte. Each directory's names are remembered so a directory whose
+// mtime changed is rescanned on its own.
+typedef struct {
+  int child;   // first child, or 0
+  int sibling; // next child of the same parent, or 0
+  int refs;    // PATH directories with a command ending here
+  unsigned char c;
+} TrieNode;
+
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  char **names;
+  int num_names;
+} TrieDir;
+
+typedef struct {
+  TrieNode *nodes; // nodes[0] is the root
+  int num_nodes;
+  int cap;
+  char *path_value; // $PATH the directory list was built from
+  TrieDir *dirs;
+  int num_dirs;
+} CommandTrie;
+
+CommandTrie command_trie;
 
 // Function prototypes
-void parse_command(char *input, char **args);
 int is_builtin(char **args);
-void execute_builtin(char **args);
-void execute_external(char **args);
+int execute_builtin(char **args);
+Builtin *builtin_find(const char *name);
+Builtin *builtin_lookup(char **args);
+int builtin_run(Builtin *builtin, char **args);
+int builtin_enable(char **args);
 void print_prompt();
-int has_pipe(char *input);
-void execute_piped_commands(char *input);
-void execute_single_pipeline(char **commands, int num_commands);
-void execute_external_background(char **args, int background,
-                                 char *original_cmd);
-int is_background_command(char *input);
-void remove_background_symbol(char *input);
+void prompt_show(int with_newline);
+void edit_set_prompt(const char *text, size_t len);
+void edit_redraw(void);
+int edit_line(InputSource *in);
+void prompt_update_cwd(void);
+int execute_node(Node *node);
+int execute_single_pipeline(Node *pipeline, Job *job);
+int execute_command(Node *cmd);
+int command_prefix(Node *cmd, CommandPrefix *prefix);
+const ProcLimits *prefix_limits(const CommandPrefix *prefix);
+void argv_shift(ArgVec *v, int n);
+void time_shell_begin(StageTiming *stage, const char *name,
+                      struct rusage *before);
+void time_shell_end(StageTiming *stage, struct rusage *before);
+void wait_for_stages(StageTiming *stages, int num_stages);
+void time_report(StageTiming *stages, int num_stages, long long start_us,
+                 int format, const char *command);
+void json_write_string(FILE *f, const char *s);
+void trace_emit(const TraceEvent *ev);
+void trace_flush(void);
+void trace_changed(void);
+void hist_add(Histogram *h, long long us);
+int builtin_stats(char **args);
+int builtin_history(char **args);
+void execute_background(Node *node);
+int builtin_export(char **args);
+int builtin_unset(char **args);
+void execute_external_background(char **args, char **env,
+                                 const ProcLimits *limits,
+                                 const char *command, size_t command_len);
 char* search_in_path(const char *command);
-void expand_args(char **args);
-int has_redirection(char *input);
-void execute_with_redirection(char **args, char *input);
+void path_cache_clear(void);
+void path_cache_forget(const char *name);
+int builtin_hash(char **args);
+int make_pipe(int fds[2]);
+void pipe_set_size(int fd, long size);
+void close_cloexec_fds(void);
+int launch_add_fd(LaunchSpec *spec, int from, int to);
+void launch_release(LaunchSpec *spec);
+pid_t launch_command(LaunchSpec *spec);
+void launch_record(LaunchSpec *spec, pid_t pid, long long start_us);
+pid_t launch_external(LaunchSpec *spec);
+int read_full(int fd, void *buf, size_t len);
+Node *parse_input(Parser *p, const char *src, size_t len, InputSource *in);
+Node *parse_sequence(Parser *p);
+Node *parse_compound(Parser *p);
+int parse_redirect(Parser *p, Node *cmd, int fd);
+void heredoc_read(Parser *p, InputSource *in);
+Var *var_lookup(const char *name, size_t len);
+int is_name_char(char c, int first);
+const char *var_get(const char *name);
+int var_set(const char *name, size_t name_len, const char *value, int flags);
+char **var_environ(void);
+void *arena_alloc(Arena *a, size_t size);
+char *arena_strndup(Arena *a, const char *s, size_t n);
+void arena_reset(Arena *a);
+void expand_word(const Word *w, ArgVec *out);
+void expand_word_glob(const Word *w, ArgVec *out, int glob);
+char *expand_word_single(const Word *w);
+void expand_args(Node *cmd, ArgVec *out);
+int word_is_assignment(const Word *w);
+void expand_range(StrBuf *sb, const char *s, const char *end, StrBuf *pat,
+                  Fields *fields);
+void sb_reserve(StrBuf *sb, size_t n);
+void sb_append(StrBuf *sb, const char *s, size_t n);
+void sb_putc(StrBuf *sb, char c);
+char *sb_finish(StrBuf *sb);
+const char *lex_paren(const char *s, const char *end);
+const char *lex_backquote(const char *s, const char *end);
+int word_is(const Word *w, const char *literal);
+const char *lex_brace(const char *s, const char *end);
+void glob_expand(const char *pattern, const char *literal, ArgVec *out);
+const char *glob_class(const char *s, const char *end, GlobOp *op);
+void glob_cache_changed(void);
+void argv_shift(ArgVec *v, int n);
+void argv_free(ArgVec *v);
+int redirect_prepare(Redir *redirs, LaunchSpec *spec);
+int redirect_in_shell(LaunchSpec *spec, SavedFd *saved, int *num_saved);
+void redirect_restore(SavedFd *saved, int num_saved);
+int wait_for_child(pid_t pid);
+int wait_child_event(void);
+int reaped_fg_take(pid_t pid, int *status);
+void reaped_fg_add(pid_t pid, int status);
+int job_proc_exited(pid_t pid, int status);
+Job *job_create(const char *command, size_t command_len);
+void job_remove(Job *job);
+void job_add_proc(Job *job, pid_t pid);
+void job_add_failed(Job *job, int status);
+void job_running(Job *job);
+void job_enqueue(Job *job);
+void job_describe(Job *job, char *buf, size_t size);
+long long monotonic_us(void);
+long long monotonic_ms(void);
+void input_open_fd(InputSource *in, int fd);
+char *input_read_line(InputSource *in);
+void jobs_reap(void);
+void child_events_init(void);
+int parse_size(const char *text, long *size);
+void jobs_dispatch(void);
+int job_notify(void);
+int builtin_wait(char **args);
+int builtin_fg(char **args);
+int builtin_bg(char **args);
+int builtin_kill(char **args);
+int builtin_set(char **args);
+int builtin_parallel(char **args);
+int is_data_mover(char **args);
+int mover_reads_terminal(char **args, LaunchSpec *spec);
+int builtin_cat(char **args);
+int builtin_tee(char **args);
+int builtin_head(char **args);
+void report_exit_status(void);
+char **argv_copy(char **argv);
+void argv_free_copy(char **argv);
+int parse_number(const char *text, long min, long max, long *value);
+Function *func_find(const char *name);
+void func_remove(Function *f);
+int func_call(Function *f, char **args);
 
 // Signal handler for Ctrl+C
 void sigint_handler(int sig) {
-  printf("\n");
-  print_prompt();
+  (void)sig;
+  interrupted = 1;
+  prompt_show(1);
+}
+
+// Append a literal run to the compiled prompt
+void prompt_add_piece(PromptPieceKind kind, const char *text, size_t len) {
+  prompt.pieces =
+      realloc(prompt.pieces, (prompt.num_pieces + 1) * sizeof(PromptPiece));
+  PromptPiece *piece = &prompt.pieces[prompt.num_pieces++];
+  piece->kind = kind;
+  piece->text = NULL;
+  piece->len = 0;
+  if (kind == PROMPT_TEXT) {
+    piece->text = malloc(len);
+    memcpy(piece->text, text, len);
+    piece->len = len;
+  }
+}
+
+// Compile a PS1-style format into prompt pieces. Supported escapes:
+// \u user, \h short host, \H host, \w cwd (~ for home), \W cwd basename,
+// \$ '#' for root else '$', \n, \e and \0NN octal, \\ and \[ \] (ignored).
+void prompt_compile(const char *format) {
+  for (int i = 0; i < prompt.num_pieces; i++) {
+    free(prompt.pieces[i].text);
+  }
+  prompt.num_pieces = 0;
+
+  char literal[PROMPT_MAX];
+  size_t len = 0;
+  for (const char *p = format; *p && len < sizeof(literal) - 1; p++) {
+    if (*p != '\\' || p[1] == '\0') {
+      literal[len++] = *p;
+      continue;
+    }
+
+    PromptPieceKind kind = PROMPT_TEXT;
+    p++;
+    switch (*p) {
+    case 'u': kind = PROMPT_USER; break;
+    case 'h': kind = PROMPT_HOST_SHORT; break;
+    case 'H': kind = PROMPT_HOST; break;
+    case 'w': kind = PROMPT_CWD; break;
+    case 'W': kind = PROMPT_CWD_BASE; break;
+    case '$': kind = PROMPT_DOLLAR; break;
+    case 'n': literal[len++] = '\n'; break;
+    case 'e': literal[len++] = '\033'; break;
+    case 'a': literal[len++] = '\a'; break;
+    case '[':
+    case ']':
+      break;
+    case '0': {
+      // Octal escape such as \033
+      int value = 0;
+      int digits = 0;
+      while (digits < 3 && p[1] >= '0' && p[1] <= '7') {
+        value = value * 8 + (*++p - '0');
+        digits++;
+      }
+      literal[len++] = (char)value;
+      break;
+    }
+    default:
+      if (*p != '\\') {
+        literal[len++] = '\\';
+      }
+      literal[len++] = *p;
+      break;
+    }
+
+    if (kind != PROMPT_TEXT) {
+      if (len > 0) {
+        prompt_add_piece(PROMPT_TEXT, literal, len);
+        len = 0;
+      }
+      prompt_add_piece(kind, NULL, 0);
+    }
+  }
+  if (len > 0) {
+    prompt_add_piece(PROMPT_TEXT, literal, len);
+  }
+}
+
+// Rebuild the inactive prompt buffer from the compiled pieces and the
+// cached user/host/cwd, then make it the current one
+void prompt_render(void) {
+  int next = !prompt.current;
+  char *out = prompt.buffers[next];
+  size_t len = 0;
+  out[len++] = '\n';
+
+  for (int i = 0; i < prompt.num_pieces; i++) {
+    PromptPiece *piece = &prompt.pieces[i];
+    const char *text = NULL;
+    char short_host[256];
+    size_t n;
+
+    switch (piece->kind) {
+    case PROMPT_TEXT:
+      n = piece->len < PROMPT_MAX - len ? piece->len : PROMPT_MAX - len;
+      memcpy(out + len, piece->text, n);
+      len += n;
+      continue;
+    case PROMPT_USER:
+      text = prompt.user;
+      break;
+    case PROMPT_HOST:
+      text = prompt.host;
+      break;
+    case PROMPT_HOST_SHORT:
+      snprintf(short_host, sizeof(short_host), "%.*s",
+               (int)strcspn(prompt.host, "."), prompt.host);
+      text = short_host;
+      break;
+    case PROMPT_CWD: {
+      // Shorten home directory to ~
+      size_t home_len = strlen(prompt.home);
+      if (home_len > 1 && strncmp(prompt.cwd, prompt.home, home_len) == 0 &&
+          (prompt.cwd[home_len] == '/' || prompt.cwd[home_len] == '\0')) {
+        if (len < PROMPT_MAX) {
+          out[len++] = '~';
+        }
+        text = prompt.cwd + home_len;
+      } else {
+        text = prompt.cwd;
+      }
+      break;
+    }
+    case PROMPT_CWD_BASE: {
+      char *slash = strrchr(prompt.cwd, '/');
+      text = (slash != NULL && slash[1] != '\0') ? slash + 1 : prompt.cwd;
+      break;
+    }
+    case PROMPT_DOLLAR:
+      text = prompt.dollar;
+      break;
+    }
+
+    n = strlen(text);
+    if (n > PROMPT_MAX - len) {
+      n = PROMPT_MAX - len;
+    }
+    memcpy(out + len, text, n);
+    len += n;
+  }
+
+  prompt.lengths[next] = len;
+  prompt.current = next;
+}
+
+// Cache user, host and home once, compile PS1 and render the first prompt
+void prompt_init(void) {
+  const char *username = var_get("USER");
+  const char *home = var_get("HOME");
+  const char *ps1 = var_get("PS1");
+
+  snprintf(prompt.user, sizeof(prompt.user), "%s", username ? username : "user");
+  if (gethostname(prompt.host, sizeof(prompt.host)) != 0) {
+    strcpy(prompt.host, "localhost");
+  }
+  prompt.host[sizeof(prompt.host) - 1] = '\0';
+  snprintf(prompt.home, sizeof(prompt.home), "%s", home ? home : "");
+  strcpy(prompt.dollar, geteuid() == 0 ? "#" : "$");
+
+  prompt_compile(ps1 ? ps1 : DEFAULT_PS1);
+  prompt_update_cwd();
+}
+
+// Refresh the cached working directory; called after a successful cd
+void prompt_update_cwd(void) {
+  if (getcwd(prompt.cwd, sizeof(prompt.cwd)) == NULL) {
+    strcpy(prompt.cwd, "unknown");
+  }
+  prompt_render();
+}
+
+// Write the current prompt with a single write(); async-signal-safe
+void prompt_show(int with_newline) {
+  int current = prompt.current;
+  size_t skip = with_newline ? 0 : 1;
+  if (prompt.lengths[current] > skip) {
+    ssize_t ignored =
+        write(STDOUT_FILENO, prompt.buffers[current] + skip,
+              prompt.lengths[current] - skip);
+    (void)ignored;
+  }
+}
+
+// Print colorful prompt with current directory. With the line editor the
+// prompt is drawn (and redrawn) by edit_line instead.
+void print_prompt() {
+  fflush(stdout);
+  if (editor.enabled) {
+    int current = prompt.current;
+    edit_set_prompt(prompt.buffers[current] + 1, prompt.lengths[current] - 1);
+    return;
+  }
+  prompt_show(0);
+}
+
+// Prompt for the next line of an unfinished command or here-document
+void print_prompt2(void) {
+  const char *ps2 = var_get("PS2");
+  ps2 = ps2 != NULL ? ps2 : "> ";
+  if (editor.enabled) {
+    fflush(stdout);
+    edit_set_prompt(ps2, strlen(ps2));
+    return;
+  }
+  printf("%s", ps2);
   fflush(stdout);
 }
 
-// Signal handler for child process termination
-void sigchld_handler(int sig) {
-  pid_t pid;
-  int status;
+// Allocate size bytes that live until the next arena_reset
+void *arena_alloc(Arena *a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  ArenaChunk *c = a->current;
+  while (c != NULL && c->size - c->used < size) {
+    // Move on to the next kept chunk, skipping over ones too small
+    c = c->next;
+    if (c != NULL) {
+      c->used = 0;
+    }
+  }
+  if (c == NULL) {
+    size_t chunk = a->chunk_size ? a->chunk_size : ARENA_CHUNK;
+    chunk = size > chunk ? size : chunk;
+    c = malloc(sizeof(ArenaChunk) + chunk);
+    c->size = chunk;
+    c->used = 0;
+    c->next = NULL;
+    if (a->current != NULL) {
+      c->next = a->current->next;
+      a->current->next = c;
+    } else {
+      c->next = a->head;
+      a->head = c;
+    }
+    a->chunks++;
+    a->capacity += chunk;
+  }
+  a->current = c;
+  void *p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+  char *copy = arena_alloc(a, n + 1);
+  memcpy(copy, s, n);
+  copy[n] = '\0';
+  return copy;
+}
+
+// Drop everything allocated since the last reset, keeping the chunks
+void arena_reset(Arena *a) {
+  size_t used = 0;
+  for (ArenaChunk *c = a->head; c != NULL; c = c->next) {
+    used += c->used;
+    c->used = 0;
+    if (c == a->current) {
+      break;
+    }
+  }
+  if (used > a->high_water) {
+    a->high_water = used;
+  }
+  a->current = a->head;
+  a->resets++;
+}
+
+// Where the arena is now, for arena_rewind
+ArenaMark arena_mark(Arena *a) {
+  ArenaMark mark = {a->current, a->current != NULL ? a->current->used : 0};
+  return mark;
+}
+
+// Drop everything allocated since mark was taken. Loops rewind after each
+// iteration, so a long loop runs in the space of one.
+void arena_rewind(Arena *a, ArenaMark mark) {
+  a->current = mark.chunk != NULL ? mark.chunk : a->head;
+  if (a->current != NULL) {
+    a->current->used = mark.used;
+  }
+}
+
+// Give all chunks back to the heap
+void arena_free(Arena *a) {
+  while (a->head != NULL) {
+    ArenaChunk *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+  a->current = NULL;
+  a->chunks = 0;
+  a->capacity = 0;
+}
+
+// Allocate zeroed memory that lives as long as the parse tree
+void *parse_alloc(Parser *p, size_t size) {
+  (void)p;
+  return memset(arena_alloc(&cmd_arena, size), 0, size);
+}
+
+// Make room for one more element in a parse-owned array
+void *parse_push(Parser *p, void *array, int *count, int *cap, size_t size) {
+  if (*count == *cap) {
+    int new_cap = *cap ? *cap * 2 : 4;
+    void *grown = parse_alloc(p, new_cap * size);
+    if (*count > 0) {
+      memcpy(grown, array, *count * size);
+    }
+    array = grown;
+    *cap = new_cap;
+  }
+  (*count)++;
+  return array;
+}
+
+// Report a syntax error at the current token (only the first one counts)
+void parse_error(Parser *p, const char *message) {
+  if (p->error != NULL) {
+    return;
+  }
+  p->error = message;
+  if (p->tok.kind == TOK_EOF || p->tok.kind == TOK_NEWLINE) {
+    fprintf(stderr, COLOR_RED "myshell: %s" COLOR_RESET "\n", message);
+  } else {
+    fprintf(stderr, COLOR_RED "myshell: %s near `%.*s'" COLOR_RESET "\n",
+            message, (int)p->tok.len, p->tok.start);
+  }
+}
+
+// Go on with a command that is not complete at the end of the line: read
+// the next line (after the bodies of any here-documents so far) into a new
+// segment of the command arena. keep is the start of a word left open by
+// a quote, carried over to the front of the segment; otherwise the segment
+// starts with the newline that ended the last one. Returns 0 at end of
+// input.
+int parse_more(Parser *p, const char *keep) {
+  if (p->in == NULL) {
+    return 0;
+  }
+  if (keep == NULL && p->heredocs != NULL) {
+    heredoc_read(p, p->in);
+  }
+  if (p->error != NULL) {
+    return 0;
+  }
+  if (interactive) {
+    print_prompt2();
+  }
+  char *line = input_read_line(p->in);
+  if (line == NULL && !p->in->eof) {
+    p->error = "interrupted"; // Ctrl+C: drop the command quietly
+    p->cancelled = 1;
+  }
+  if (line == NULL) {
+    return 0;
+  }
+  StrBuf segment = {.arena = &cmd_arena};
+  if (keep != NULL) {
+    sb_append(&segment, keep, p->end - keep);
+  }
+  sb_putc(&segment, '\n');
+  sb_append(&segment, line, strlen(line));
+  p->pos = sb_finish(&segment);
+  p->end = p->pos + segment.len;
+  return 1;
+}
+
+// Find the end of the backquoted command starting at the ` at s. NULL if
+// it is unterminated.
+const char *lex_backquote(const char *s, const char *end) {
+  for (s++; s < end; s++) {
+    if (*s == '\\') {
+      s++;
+    } else if (*s == '`') {
+      return s + 1;
+    }
+  }
+  return NULL;
+}
+
+// Find the end of the $( whose ( is at s: the matching ), skipping quoted text and
+// nested substitutions. NULL if it is unterminated.
+const char *lex_paren(const char *s, const char *end) {
+  int depth = 1;
+  for (s++; s < end;) {
+    if (*s == '\\') {
+      s += 2;
+    } else if (*s == '\'') {
+      const char *close = memchr(s + 1, '\'', end - s - 1);
+      if (close == NULL) {
+        return NULL;
+      }
+      s = close + 1;
+    } else if (*s == '"') {
+      for (s++; s < end && *s != '"';) {
+        if (*s == '\\') {
+          s += 2;
+        } else if (*s == '$' && s + 1 < end && s[1] == '(') {
+          s = lex_paren(s + 1, end);
+        } else if (*s == '`') {
+          s = lex_backquote(s, end);
+        } else {
+          s++;
+        }
+        if (s == NULL) {
+          return NULL;
+        }
+      }
+      if (s >= end) {
+        return NULL;
+      }
+      s++;
+    } else if (*s == '`') {
+      s = lex_backquote(s, end);
+      if (s == NULL) {
+        return NULL;
+      }
+    } else {
+      if (*s == '(') {
+        depth++;
+      } else if (*s == ')' && --depth == 0) {
+        return s + 1;
+      }
+      s++;
+    }
+  }
+  return NULL;
+}
+
+// Skip a $ and, for ${...}, everything up to the matching brace (or the
+// one-character name of $? $$ $!). A $(...) substitution is skipped whole;
+// NULL if it is unterminated.
+const char *lex_brace(const char *s, const char *end) {
+  if (s + 1 < end && strchr("?$!", s[1]) != NULL) {
+    return s + 2;
+  }
+  if (s + 1 < end && s[1] == '(') {
+    return lex_paren(s + 1, end);
+  }
+  if (s + 1 >= end || s[1] != '{') {
+    return s + 1;
+  }
+  int depth = 0;
+  for (const char *p = s + 1; p < end; p++) {
+    if (*p == '{') {
+      depth++;
+    } else if (*p == '}' && --depth == 0) {
+      return p + 1;
+    }
+  }
+  return s + 1; // unterminated: left for expansion to keep literally
+}
+
+// Scan a word starting at s, honoring quotes and backslashes
+const char *lex_word(Parser *p, const char *s, int *flags) {
+  const char *end = p->end;
+  *flags = (*s == '~') ? WORD_TILDE : 0;
+
+  while (s < end && strchr(" \t\n;&|<>()", *s) == NULL) {
+    if (*s == '\\') {
+      *flags |= WORD_QUOTED;
+      if (s + 1 == end && p->in != NULL) {
+        return NULL; // the word goes on in the next line
+      }
+      s += (s + 1 < end) ? 2 : 1;
+    } else if (*s == '\'') {
+      *flags |= WORD_QUOTED;
+      const char *close = memchr(s + 1, '\'', end - s - 1);
+      if (close == NULL) {
+        return NULL;
+      }
+      s = close + 1;
+    } else if (*s == '"') {
+      *flags |= WORD_QUOTED;
+      s++;
+      while (s < end && *s != '"') {
+        if (*s == '\\' && s + 1 < end) {
+          s += 2;
+          continue;
+        }
+        if (*s == '$' || *s == '`') {
+          *flags |= WORD_DOLLAR;
+          s = *s == '$' ? lex_brace(s, end) : lex_backquote(s, end);
+          if (s == NULL) {
+            return NULL;
+          }
+          continue;
+        }
+        s++;
+      }
+      if (s >= end) {
+        return NULL;
+      }
+      s++;
+    } else if (*s == '$' || *s == '`') {
+      *flags |= WORD_DOLLAR;
+      s = *s == '$' ? lex_brace(s, end) : lex_backquote(s, end);
+      if (s == NULL) {
+        return NULL;
+      }
+    } else {
+      if (*s == '*' || *s == '?' || *s == '[') {
+        *flags |= WORD_GLOB;
+      }
+      s++;
+    }
+  }
+  return s;
+}
+
+// Advance to the next token
+void lex_next(Parser *p) {
+  const char *s = p->pos;
+  const char *end = p->end;
+  Token *t = &p->tok;
+
+  p->prev_end = t->start ? t->start + t->len : s;
+
+  while (1) {
+    // Skip blanks, escaped newlines and comments
+    while (s < end) {
+      if (*s == ' ' || *s == '\t') {
+        s++;
+      } else if (*s == '\\' && s + 1 < end && s[1] == '\n') {
+        s += 2;
+      } else if (*s == '#') {
+        while (s < end && *s != '\n') {
+          s++;
+        }
+      } else {
+        break;
+      }
+    }
+    // An if, loop, pipe or && still open at the end of the line goes on
+    // in the next one
+    if (s < end || p->open == 0 || !parse_more(p, NULL)) {
+      break;
+    }
+    s = p->pos;
+    end = p->end;
+  }
+
+  t->start = s;
+  t->flags = 0;
+  if (s >= end) {
+    t->kind = TOK_EOF;
+    t->len = 0;
+    p->pos = s;
+    return;
+  }
+
+  const char *next = s + 1;
+  switch (*s) {
+  case '\n':
+    t->kind = TOK_NEWLINE;
+    break;
+  case ';':
+    t->kind = TOK_SEMI;
+    if (next < end && *next == ';') {
+      t->kind = TOK_DSEMI;
+      next++;
+    }
+    break;
+  case '(':
+    t->kind = TOK_LPAREN;
+    break;
+  case ')':
+    t->kind = TOK_RPAREN;
+    break;
+  case '&':
+    t->kind = TOK_AMP;
+    if (next < end && *next == '&') {
+      t->kind = TOK_AND_IF;
+      next++;
+    }
+    break;
+  case '|':
+    t->kind = TOK_PIPE;
+    if (next < end && *next == '|') {
+      t->kind = TOK_OR_IF;
+      next++;
+    }
+    break;
+  case '<':
+    t->kind = TOK_LESS;
+    if (next < end && *next == '&') {
+      t->kind = TOK_LESSAND;
+      next++;
+    } else if (next < end && *next == '<') {
+      t->kind = TOK_DLESS;
+      next++;
+      if (next < end && *next == '<') {
+        t->kind = TOK_TLESS;
+        next++;
+      } else if (next < end && *next == '-') {
+        t->kind = TOK_DLESSDASH;
+        next++;
+      }
+    }
+    break;
+  case '>':
+    t->kind = TOK_GREAT;
+    if (next < end && *next == '>') {
+      t->kind = TOK_DGREAT;
+      next++;
+    } else if (next < end && *next == '&') {
+      t->kind = TOK_GREATAND;
+      next++;
+    }
+    break;
+  default:
+    next = lex_word(p, s, &t->flags);
+    // An open quote takes in lines until it is closed
+    while (next == NULL && parse_more(p, s)) {
+      s = t->start = p->pos;
+      end = p->end;
+      next = lex_word(p, s, &t->flags);
+    }
+    if (next == NULL) {
+      t->kind = TOK_ERROR;
+      t->len = end - s;
+      p->pos = end;
+      return;
+    }
+    t->kind = TOK_WORD;
+    // A run of digits glued to < or > names the descriptor to redirect
+    if (next < end && (*next == '<' || *next == '>')) {
+      const char *d = s;
+      while (d < next && *d >= '0' && *d <= '9') {
+        d++;
+      }
+      if (d == next) {
+        t->kind = TOK_IO_NUMBER;
+      }
+    }
+    break;
+  }
+  t->len = next - s;
+  p->pos = next;
+}
+
+// Skip any newline tokens (allowed after | && || and between commands)
+void parse_skip_newlines(Parser *p) {
+  while (p->tok.kind == TOK_NEWLINE) {
+    lex_next(p);
+  }
+}
+
+Node *parse_new_node(Parser *p, NodeKind kind) {
+  Node *node = parse_alloc(p, sizeof(Node));
+  node->kind = kind;
+  node->text = p->tok.start;
+  return node;
+}
+
+// Record the source text a node was parsed from. A node that goes on past
+// the end of its first line keeps only that line; the rest was read into
+// other segments (see parse_more).
+void parse_finish_node(Parser *p, Node *node) {
+  size_t len = p->prev_end > node->text ? p->prev_end - node->text : 0;
+  const char *nul = memchr(node->text, '\0', len);
+  node->text_len = nul != NULL ? (size_t)(nul - node->text) : len;
+}
+
+// Whether the current token is the unquoted word kw. Reserved words only
+// count where a command can start, so `echo fi` is an ordinary command.
+int parse_at(Parser *p, const char *kw) {
+  return p->tok.kind == TOK_WORD && p->tok.flags == 0 &&
+         p->tok.len == strlen(kw) && memcmp(p->tok.start, kw, p->tok.len) == 0;
+}
+
+// Whether a command starting here is a compound command
+int parse_at_compound(Parser *p) {
+  return p->tok.kind == TOK_LPAREN || parse_at(p, "{") || parse_at(p, "if") ||
+         parse_at(p, "while") || parse_at(p, "until") || parse_at(p, "for") ||
+         parse_at(p, "case") || parse_at(p, "function");
+}
+
+// Reserved words that end the list of a compound command
+const char *const list_closers[] = {"then", "elif", "else", "fi",
+                                    "do",   "done", "esac", "}"};
+
+// Whether the current token ends a list: end of input, ) or ;; or one of
+// the list_closers
+int parse_list_end(Parser *p) {
+  if (p->tok.kind == TOK_EOF || p->tok.kind == TOK_RPAREN ||
+      p->tok.kind == TOK_DSEMI) {
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(list_closers) / sizeof(list_closers[0]); i++) {
+    if (parse_at(p, list_closers[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Consume an opening reserved word or parenthesis. Until the matching
+// parse_expect(p, ..., 1) the command is open, and the end of a line
+// reads on.
+void parse_open(Parser *p) {
+  p->open++;
+  lex_next(p);
+}
+
+// Consume the current token and the newlines after it, reading on if the
+// line ends there (after | && || and the like)
+void parse_continue(Parser *p) {
+  p->open++;
+  lex_next(p);
+  parse_skip_newlines(p);
+  p->open--;
+}
+
+// Consume the reserved word kw (or ")"), or report it missing. close
+// marks the token that ends a command opened with parse_open.
+int parse_expect(Parser *p, const char *kw, int close) {
+  static char message[64];
+  int found = strcmp(kw, ")") == 0 ? p->tok.kind == TOK_RPAREN
+                                   : parse_at(p, kw);
+  if (!found) {
+    if (p->tok.kind == TOK_EOF) {
+      parse_error(p, "syntax error: unexpected end of input");
+    } else {
+      snprintf(message, sizeof(message), "syntax error: expected `%s'", kw);
+      parse_error(p, message);
+    }
+    return -1;
+  }
+  if (close) {
+    p->open--;
+  }
+  lex_next(p);
+  return 0;
+}
+
+// The list of a compound command, which may not be empty
+Node *parse_list(Parser *p) {
+  Node *list = parse_sequence(p);
+  if (list != NULL && list->num_children == 0) {
+    parse_error(p, p->tok.kind == TOK_EOF
+                       ? "syntax error: unexpected end of input"
+                       : "syntax error: unexpected token");
+    return NULL;
+  }
+  return list;
+}
+
+// Whether a token is an unquoted variable name
+int token_is_name(const Token *t) {
+  if (t->kind != TOK_WORD || t->flags != 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < t->len; i++) {
+    if (!is_name_char(t->start[i], i == 0)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Make the current token the single word of node
+void parse_take_word(Parser *p, Node *node, int *cap) {
+  node->words = parse_push(p, node->words, &node->num_words, cap,
+                           sizeof(Word));
+  Word *w = &node->words[node->num_words - 1];
+  w->text = p->tok.start;
+  w->len = p->tok.len;
+  w->flags = p->tok.flags;
+  lex_next(p);
+}
+
+// if_clause: 'if' list 'then' list ('elif' list 'then' list)*
+//            ['else' list] 'fi'
+Node *parse_if(Parser *p) {
+  Node *node = parse_new_node(p, NODE_IF);
+  int cap = 0;
+  parse_open(p);
+  while (1) {
+    Node *cond = parse_list(p);
+    if (cond == NULL || parse_expect(p, "then", 0) < 0) {
+      return NULL;
+    }
+    Node *body = parse_list(p);
+    if (body == NULL) {
+      return NULL;
+    }
+    node->children = parse_push(p, node->children, &node->num_children, &cap,
+                                sizeof(Node *));
+    node->children[node->num_children - 1] = cond;
+    node->children = parse_push(p, node->children, &node->num_children, &cap,
+                                sizeof(Node *));
+    node->children[node->num_children - 1] = body;
+    if (!parse_at(p, "elif")) {
+      break;
+    }
+    lex_next(p);
+  }
+  if (parse_at(p, "else")) {
+    lex_next(p);
+    Node *body = parse_list(p);
+    if (body == NULL) {
+      return NULL;
+    }
+    node->children = parse_push(p, node->children, &node->num_children, &cap,
+                                sizeof(Node *));
+    node->children[node->num_children - 1] = body;
+  }
+  return parse_expect(p, "fi", 1) == 0 ? node : NULL;
+}
+
+// do_group: 'do' list 'done'
+Node *parse_do_group(Parser *p) {
+  if (parse_expect(p, "do", 0) < 0) {
+    return NULL;
+  }
+  Node *body = parse_list(p);
+  if (body == NULL || parse_expect(p, "done", 1) < 0) {
+    return NULL;
+  }
+  return body;
+}
+
+// while_clause: ('while' | 'until') list do_group
+Node *parse_while(Parser *p) {
+  Node *node = parse_new_node(p, parse_at(p, "while") ? NODE_WHILE
+                                                      : NODE_UNTIL);
+  parse_open(p);
+  node->left = parse_list(p);
+  if (node->left == NULL) {
+    return NULL;
+  }
+  node->right = parse_do_group(p);
+  return node->right != NULL ? node : NULL;
+}
+
+// for_clause: 'for' name [linebreak 'in' word* (';' | newline)]
+//             linebreak do_group
+Node *parse_for(Parser *p) {
+  Node *node = parse_new_node(p, NODE_FOR);
+  int cap = 0;
+  parse_open(p);
+  if (!token_is_name(&p->tok)) {
+    parse_error(p, "syntax error: bad for loop variable");
+    return NULL;
+  }
+  parse_take_word(p, node, &cap);
+  parse_skip_newlines(p);
+  if (parse_at(p, "in")) {
+    lex_next(p);
+    while (p->tok.kind == TOK_WORD) {
+      parse_take_word(p, node, &cap);
+    }
+    if (p->tok.kind != TOK_SEMI && p->tok.kind != TOK_NEWLINE) {
+      parse_error(p, "syntax error: unexpected token");
+      return NULL;
+    }
+    lex_next(p);
+  } else {
+    // Without a word list the loop goes over "$@"
+    node->words = parse_push(p, node->words, &node->num_words, &cap,
+                             sizeof(Word));
+    node->words[1] = (Word){"\"$@\"", 4, WORD_QUOTED | WORD_DOLLAR};
+    if (p->tok.kind == TOK_SEMI) {
+      lex_next(p);
+    }
+  }
+  parse_skip_newlines(p);
+  node->right = parse_do_group(p);
+  return node->right != NULL ? node : NULL;
+}
+
+// case_clause: 'case' word linebreak 'in' linebreak
+//              (['('] pattern ('|' pattern)* ')' list? [';;'] linebreak)*
+//              'esac'
+Node *parse_case(Parser *p) {
+  Node *node = parse_new_node(p, NODE_CASE);
+  int cap = 0;
+  int items_cap = 0;
+  parse_open(p);
+  if (p->tok.kind != TOK_WORD) {
+    parse_error(p, "syntax error: expected a word after case");
+    return NULL;
+  }
+  parse_take_word(p, node, &cap);
+  parse_skip_newlines(p);
+  if (parse_expect(p, "in", 0) < 0) {
+    return NULL;
+  }
+  parse_skip_newlines(p);
+  while (!parse_at(p, "esac")) {
+    node->items = parse_push(p, node->items, &node->num_items, &items_cap,
+                             sizeof(CaseItem));
+    CaseItem *item = &node->items[node->num_items - 1];
+    memset(item, 0, sizeof(*item));
+    int patterns_cap = 0;
+    if (p->tok.kind == TOK_LPAREN) {
+      lex_next(p);
+    }
+    while (1) {
+      if (p->tok.kind != TOK_WORD) {
+        parse_error(p, p->tok.kind == TOK_EOF
+                           ? "syntax error: unexpected end of input"
+                           : "syntax error: expected a case pattern");
+        return NULL;
+      }
+      item->patterns = parse_push(p, item->patterns, &item->num_patterns,
+                                  &patterns_cap, sizeof(Word));
+      Word *w = &item->patterns[item->num_patterns - 1];
+      w->text = p->tok.start;
+      w->len = p->tok.len;
+      w->flags = p->tok.flags;
+      lex_next(p);
+      if (p->tok.kind != TOK_PIPE) {
+        break;
+      }
+      lex_next(p);
+    }
+    if (parse_expect(p, ")", 0) < 0) {
+      return NULL;
+    }
+    item->body = parse_sequence(p);
+    if (item->body == NULL) {
+      return NULL;
+    }
+    if (p->tok.kind == TOK_DSEMI) {
+      lex_next(p);
+      parse_skip_newlines(p);
+    } else if (!parse_at(p, "esac")) {
+      parse_error(p, p->tok.kind == TOK_EOF
+                         ? "syntax error: unexpected end of input"
+                         : "syntax error: expected `;;'");
+      return NULL;
+    }
+  }
+  return parse_expect(p, "esac", 1) == 0 ? node : NULL;
+}
+
+// brace_group: '{' list '}'; subshell: '(' list ')'
+Node *parse_group(Parser *p, NodeKind kind) {
+  Node *node = parse_new_node(p, kind);
+  parse_open(p);
+  node->left = parse_list(p);
+  if (node->left == NULL ||
+      parse_expect(p, kind == NODE_SUBSHELL ? ")" : "}", 1) < 0) {
+    return NULL;
+  }
+  return node;
+}
+
+// The compound command a function definition ends with
+Node *parse_function_body(Parser *p, Node *func) {
+  if (!parse_at_compound(p) || parse_at(p, "function")) {
+    parse_error(p, p->tok.kind == TOK_EOF
+                       ? "syntax error: unexpected end of input"
+                       : "syntax error: function body must be a compound "
+                         "command");
+    return NULL;
+  }
+  func->left = parse_compound(p);
+  if (func->left == NULL) {
+    return NULL;
+  }
+  parse_finish_node(p, func);
+  return func;
+}
+
+// compound_command: (brace_group | subshell | if_clause | while_clause |
+// for_clause | case_clause) redirection*, or
+// 'function' name ['(' ')'] linebreak compound_command
+Node *parse_compound(Parser *p) {
+  Node *node;
+  if (parse_at(p, "function")) {
+    Node *func = parse_new_node(p, NODE_FUNCTION);
+    int cap = 0;
+    parse_open(p);
+    if (p->tok.kind != TOK_WORD || p->tok.flags != 0) {
+      parse_error(p, "syntax error: bad function name");
+      return NULL;
+    }
+    parse_take_word(p, func, &cap);
+    if (p->tok.kind == TOK_LPAREN) {
+      lex_next(p);
+      if (parse_expect(p, ")", 0) < 0) {
+        return NULL;
+      }
+    }
+    parse_skip_newlines(p);
+    p->open--;
+    return parse_function_body(p, func);
+  }
+  if (p->tok.kind == TOK_LPAREN) {
+    node = parse_group(p, NODE_SUBSHELL);
+  } else if (parse_at(p, "{")) {
+    node = parse_group(p, NODE_GROUP);
+  } else if (parse_at(p, "if")) {
+    node = parse_if(p);
+  } else if (parse_at(p, "for")) {
+    node = parse_for(p);
+  } else if (parse_at(p, "case")) {
+    node = parse_case(p);
+  } else {
+    node = parse_while(p);
+  }
+
+  while (node != NULL) {
+    Token *t = &p->tok;
+    if (t->kind == TOK_IO_NUMBER) {
+      int fd = atoi(t->start);
+      lex_next(p);
+      if (parse_redirect(p, node, fd) < 0) {
+        return NULL;
+      }
+    } else if (t->kind >= TOK_LESS && t->kind <= TOK_TLESS) {
+      if (parse_redirect(p, node, -1) < 0) {
+        return NULL;
+      }
+    } else {
+      parse_finish_node(p, node);
+      break;
+    }
+  }
+  return node;
+}
+
+// redirection: [n]op word
+int parse_redirect(Parser *p, Node *cmd, int fd) {
+  Redir *r = parse_alloc(p, sizeof(Redir));
+  switch (p->tok.kind) {
+  case TOK_LESS:
+    r->kind = REDIR_IN;
+    break;
+  case TOK_GREAT:
+    r->kind = REDIR_OUT;
+    break;
+  case TOK_DGREAT:
+    r->kind = REDIR_APPEND;
+    break;
+  case TOK_LESSAND:
+    r->kind = REDIR_DUP_IN;
+    break;
+  case TOK_DLESS:
+  case TOK_DLESSDASH:
+    r->kind = REDIR_HEREDOC;
+    r->strip_tabs = p->tok.kind == TOK_DLESSDASH;
+    break;
+  case TOK_TLESS:
+    r->kind = REDIR_HERESTRING;
+    break;
+  default:
+    r->kind = REDIR_DUP_OUT;
+    break;
+  }
+  if (fd < 0) {
+    fd = (r->kind == REDIR_OUT || r->kind == REDIR_APPEND ||
+          r->kind == REDIR_DUP_OUT)
+             ? STDOUT_FILENO
+             : STDIN_FILENO;
+  }
+  r->fd = fd;
+
+  lex_next(p);
+  if (p->tok.kind != TOK_WORD) {
+    parse_error(p, "syntax error: missing redirection target");
+    return -1;
+  }
+  r->target.text = p->tok.start;
+  r->target.len = p->tok.len;
+  r->target.flags = p->tok.flags;
+
+  // The body of a here-document is read once the whole line is parsed
+  // (or before the next line of a command that goes on, see parse_more)
+  if (r->kind == REDIR_HEREDOC) {
+    r->body.flags = (r->target.flags & WORD_QUOTED) ? 0 : WORD_DOLLAR;
+    if (p->last_heredoc != NULL) {
+      p->last_heredoc->next_heredoc = r;
+    } else {
+      p->heredocs = r;
+    }
+    p->last_heredoc = r;
+  }
+  lex_next(p);
+
+  // Keep redirections in source order; they are applied left to right
+  Redir **link = &cmd->redirs;
+  while (*link != NULL) {
+    link = &(*link)->next;
+  }
+  *link = r;
+  return 0;
+}
+
+// command: compound_command | function_definition | (word | redirection)+
+Node *parse_command(Parser *p) {
+  if (parse_at_compound(p)) {
+    return parse_compound(p);
+  }
+  if (p->tok.kind == TOK_WORD && parse_list_end(p)) {
+    parse_error(p, "syntax error: unexpected token");
+    return NULL;
+  }
+  Node *cmd = parse_new_node(p, NODE_COMMAND);
+  int cap = 0;
+
+  while (1) {
+    Token *t = &p->tok;
+    if (t->kind == TOK_WORD) {
+      cmd->words = parse_push(p, cmd->words, &cmd->num_words, &cap,
+                              sizeof(Word));
+      Word *w = &cmd->words[cmd->num_words - 1];
+      w->text = t->start;
+      w->len = t->len;
+      w->flags = t->flags;
+      lex_next(p);
+    } else if (t->kind == TOK_IO_NUMBER) {
+      int fd = atoi(t->start);
+      lex_next(p);
+      if (parse_redirect(p, cmd, fd) < 0) {
+        return NULL;
+      }
+    } else if (t->kind >= TOK_LESS && t->kind <= TOK_TLESS) {
+      if (parse_redirect(p, cmd, -1) < 0) {
+        return NULL;
+      }
+    } else {
+      break;
+    }
+  }
+
+  if (p->tok.kind == TOK_ERROR) {
+    parse_error(p, "syntax error: unterminated quote");
+    return NULL;
+  }
+  if (cmd->num_words == 0 && cmd->redirs == NULL) {
+    parse_error(p, p->tok.kind == TOK_EOF
+                       ? "syntax error: unexpected end of input"
+                       : "syntax error: unexpected token");
+    return NULL;
+  }
+  // name() compound_command defines a function
+  if (p->tok.kind == TOK_LPAREN && cmd->num_words == 1 &&
+      cmd->redirs == NULL && cmd->words[0].flags == 0) {
+    cmd->kind = NODE_FUNCTION;
+    lex_next(p);
+    if (p->tok.kind != TOK_RPAREN) {
+      parse_error(p, "syntax error: expected `)'");
+      return NULL;
+    }
+    parse_continue(p);
+    return parse_function_body(p, cmd);
+  }
+  parse_finish_node(p, cmd);
+  return cmd;
+}
+
+// pipeline: ['!'] command ('|' command)*
+Node *parse_pipeline(Parser *p) {
+  int negate = 0;
+  if (parse_at(p, "!")) {
+    negate = 1;
+    lex_next(p);
+  }
+  Node *first = parse_command(p);
+  if (first == NULL || p->tok.kind != TOK_PIPE) {
+    if (first != NULL) {
+      first->negate = negate;
+    }
+    return first;
+  }
+
+  Node *pipeline = parse_new_node(p, NODE_PIPELINE);
+  pipeline->text = first->text;
+  pipeline->negate = negate;
+  int cap = 0;
+  pipeline->children = parse_push(p, pipeline->children,
+                                  &pipeline->num_children, &cap, sizeof(Node *));
+  pipeline->children[0] = first;
+
+  while (p->tok.kind == TOK_PIPE) {
+    parse_continue(p);
+    Node *stage = parse_command(p);
+    if (stage == NULL) {
+      return NULL;
+    }
+    pipeline->children = parse_push(p, pipeline->children,
+                                    &pipeline->num_children, &cap,
+                                    sizeof(Node *));
+    pipeline->children[pipeline->num_children - 1] = stage;
+  }
+  parse_finish_node(p, pipeline);
+  return pipeline;
+}
+
+// and_or: pipeline (('&&' | '||') pipeline)*
+Node *parse_and_or(Parser *p) {
+  Node *left = parse_pipeline(p);
+  while (left != NULL &&
+         (p->tok.kind == TOK_AND_IF || p->tok.kind == TOK_OR_IF)) {
+    Node *node = parse_new_node(p, p->tok.kind == TOK_AND_IF ? NODE_AND
+                                                              : NODE_OR);
+    node->text = left->text;
+    node->left = left;
+    parse_continue(p);
+    node->right = parse_pipeline(p);
+    if (node->right == NULL) {
+      return NULL;
+    }
+    parse_finish_node(p, node);
+    left = node;
+  }
+  return left;
+}
+
+// sequence: and_or ((';' | '&' | newline) and_or)* [';' | '&'], up to
+// the end of input or of the enclosing compound command (parse_list_end)
+Node *parse_sequence(Parser *p) {
+  Node *seq = parse_new_node(p, NODE_SEQUENCE);
+  int cap = 0;
+
+  parse_skip_newlines(p);
+  while (!parse_list_end(p)) {
+    Node *item = parse_and_or(p);
+    if (item == NULL) {
+      return NULL;
+    }
+    if (p->tok.kind == TOK_AMP) {
+      item->background = 1;
+      lex_next(p);
+    } else if (p->tok.kind == TOK_SEMI || p->tok.kind == TOK_NEWLINE) {
+      lex_next(p);
+    } else if (!parse_list_end(p)) {
+      parse_error(p, "syntax error: unexpected token");
+      return NULL;
+    }
+    seq->children = parse_push(p, seq->children, &seq->num_children, &cap,
+                               sizeof(Node *));
+    seq->children[seq->num_children - 1] = item;
+    parse_skip_newlines(p);
+  }
+  parse_finish_node(p, seq);
+  return seq;
+}
+
+// Parse a command line in a single pass. Returns NULL after reporting a
+// syntax error. The tree points into src and lives in cmd_arena until the
+// line has been executed. With in, a command left open at the end of the
+// line (an if without its fi, a trailing |, an open quote) goes on in
+// the lines read from it, which then must be kept in cmd_arena too.
+Node *parse_input(Parser *p, const char *src, size_t len, InputSource *in) {
+  memset(p, 0, sizeof(*p));
+  p->pos = src;
+  p->end = src + len;
+  p->in = in;
+  lex_next(p);
+  Node *tree = parse_sequence(p);
+  if (tree != NULL && p->tok.kind != TOK_EOF) {
+    parse_error(p, "syntax error: unexpected token");
+    return NULL;
+  }
+  return tree;
+}
+
+// Append bytes to a growable string
+void sb_append(StrBuf *sb, const char *s, size_t n) {
+  sb_reserve(sb, n);
+  memcpy(sb->data + sb->len, s, n);
+  sb->len += n;
+  sb->data[sb->len] = '\0';
+}
+
+// Make room for n more bytes (and the terminating NUL)
+void sb_reserve(StrBuf *sb, size_t n) {
+  if (sb->len + n + 1 > sb->cap) {
+    size_t cap = sb->cap ? sb->cap : 32;
+    while (sb->len + n + 1 > cap) {
+      cap *= 2;
+    }
+    if (sb->arena != NULL) {
+      char *grown = arena_alloc(sb->arena, cap);
+      if (sb->len > 0) {
+        memcpy(grown, sb->data, sb->len);
+      }
+      sb->data = grown;
+    } else {
+      sb->data = realloc(sb->data, cap);
+    }
+    sb->cap = cap;
+  }
+}
+
+void sb_putc(StrBuf *sb, char c) { sb_append(sb, &c, 1); }
+
+// Hand over the built string (never NULL, possibly empty)
+char *sb_finish(StrBuf *sb) {
+  if (sb->data == NULL) {
+    return sb->arena != NULL ? arena_strndup(sb->arena, "", 0) : strdup("");
+  }
+  return sb->data;
+}
+
+// Append an argument, keeping the vector NULL-terminated
+void argv_push(ArgVec *v, char *arg) {
+  if (v->argc + 2 > v->cap) {
+    int cap = v->cap ? v->cap * 2 : 8;
+    if (v->arena != NULL) {
+      char **grown = arena_alloc(v->arena, cap * sizeof(char *));
+      if (v->argc > 0) {
+        memcpy(grown, v->argv, v->argc * sizeof(char *));
+      }
+      v->argv = grown;
+    } else {
+      v->argv = realloc(v->argv, cap * sizeof(char *));
+    }
+    v->cap = cap;
+  }
+  v->argv[v->argc++] = arg;
+  v->argv[v->argc] = NULL;
+}
+
+void argv_free(ArgVec *v) {
+  if (v->arena == NULL) {
+    for (int i = 0; i < v->argc; i++) {
+      free(v->argv[i]);
+    }
+    free(v->argv);
+  }
+  v->argv = NULL;
+  v->argc = v->cap = 0;
+}
+
+static inline size_t var_hash(const char *name, size_t len) {
+  size_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Find a variable by name (not NUL-terminated)
+Var *var_lookup(const char *name, size_t len) {
+  if (vars.num_buckets == 0) {
+    return NULL;
+  }
+  Var *v = vars.buckets[var_hash(name, len) & (vars.num_buckets - 1)];
+  while (v != NULL &&
+         (strncmp(v->name, name, len) != 0 || v->name[len] != '\0')) {
+    v = v->next;
+  }
+  return v;
+}
+
+// Value of a set variable, or NULL (the getenv of shell variables)
+const char *var_get(const char *name) {
+  Var *v = var_lookup(name, strlen(name));
+  return v != NULL ? v->value : NULL;
+}
+
+// Double the bucket array once the table is as full as it is wide
+void var_grow(void) {
+  size_t size = vars.num_buckets ? vars.num_buckets * 2 : VAR_INITIAL_BUCKETS;
+  Var **buckets = calloc(size, sizeof(Var *));
+  for (size_t i = 0; i < vars.num_buckets; i++) {
+    Var *v = vars.buckets[i];
+    while (v != NULL) {
+      Var *next = v->next;
+      size_t b = var_hash(v->name, strlen(v->name)) & (size - 1);
+      v->next = buckets[b];
+      buckets[b] = v;
+      v = next;
+    }
+  }
+  free(vars.buckets);
+  vars.buckets = buckets;
+  vars.num_buckets = size;
+}
+
+// Variables the shell itself depends on take effect at once
+void var_changed(Var *v) {
+  if (strcmp(v->name, "PS1") == 0 && interactive) {
+    prompt_compile(v->value ? v->value : DEFAULT_PS1);
+    prompt_render();
+  } else if (strcmp(v->name, "HOME") == 0 && interactive) {
+    snprintf(prompt.home, sizeof(prompt.home), "%s", v->value ? v->value : "");
+    prompt_render();
+  }
+  // PATH needs nothing here: the PATH cache notices the new value itself
+}
+
+// Set a variable, adding the given VAR_* flags to any it already has.
+// A NULL value only changes flags. Returns -1 (after saying so) if the
+// variable is readonly.
+int var_set(const char *name, size_t name_len, const char *value, int flags) {
+  Var *v = var_lookup(name, name_len);
+  if (v != NULL && (v->flags & VAR_READONLY) && value != NULL) {
+    fprintf(stderr, COLOR_RED "myshell: %s: readonly variable" COLOR_RESET
+            "\n", v->name);
+    return -1;
+  }
+  if (v == NULL) {
+    if (vars.count >= vars.num_buckets) {
+      var_grow();
+    }
+    v = calloc(1, sizeof(Var));
+    v->name = strndup(name, name_len);
+    size_t b = var_hash(name, name_len) & (vars.num_buckets - 1);
+    v->next = vars.buckets[b];
+    vars.buckets[b] = v;
+    vars.count++;
+  }
+  int was_exported = v->flags & VAR_EXPORT;
+  v->flags |= flags;
+  if (value != NULL) {
+    free(v->value);
+    v->value = strdup(value);
+  }
+  if ((v->flags & VAR_EXPORT) && (value != NULL || !was_exported)) {
+    vars.env_dirty = 1;
+  }
+  if (value != NULL) {
+    var_changed(v);
+  }
+  vars.changes++;
+  return 0;
+}
+
+// Remove a variable. Returns -1 if it is readonly.
+int var_unset(const char *name) {
+  size_t len = strlen(name);
+  if (vars.num_buckets == 0) {
+    return 0;
+  }
+  Var **link = &vars.buckets[var_hash(name, len) & (vars.num_buckets - 1)];
+  while (*link != NULL && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  Var *v = *link;
+  if (v == NULL) {
+    return 0;
+  }
+  if (v->flags & VAR_READONLY) {
+    fprintf(stderr, COLOR_RED "unset: %s: readonly variable" COLOR_RESET
+            "\n", name);
+    return -1;
+  }
+  *link = v->next;
+  vars.count--;
+  if (v->flags & VAR_EXPORT) {
+    vars.env_dirty = 1;
+  }
+  free(v->value);
+  v->value = NULL;
+  var_changed(v);
+  free(v->name);
+  free(v);
+  vars.changes++;
+  return 0;
+}
+
+// Export every NAME=value in env
+void vars_import(char **env) {
+  for (char **e = env; *e != NULL; e++) {
+    char *eq = strchr(*e, '=');
+    if (eq != NULL && eq > *e) {
+      var_set(*e, eq - *e, eq + 1, VAR_EXPORT);
+    }
+  }
+}
+
+// Import the environment the shell was started with
+void vars_init(void) {
+  vars_import(environ);
+  shell_pid = getpid();
+}
+
+// Drop every variable, readonly ones included, and start over from env.
+// A --serve worker uses this to undo what a request did.
+void vars_reset(char **env) {
+  for (size_t i = 0; i < vars.num_buckets; i++) {
+    Var *v = vars.buckets[i];
+    while (v != NULL) {
+      Var *next = v->next;
+      free(v->value);
+      free(v->name);
+      free(v);
+      v = next;
+    }
+    vars.buckets[i] = NULL;
+  }
+  vars.count = 0;
+  vars.env_dirty = 1;
+  vars_import(env);
+}
+
+// The environment for children, rebuilt only after an exported variable
+// has changed. environ is pointed at it too, so the C library's getenv
+// agrees with the shell.
+char **var_environ(void) {
+  if (!vars.env_dirty && vars.envp != NULL) {
+    return vars.envp;
+  }
+  if (vars.envp != NULL) {
+    for (char **e = vars.envp; *e != NULL; e++) {
+      free(*e);
+    }
+    free(vars.envp);
+  }
+  size_t n = 0;
+  vars.envp = malloc((vars.count + 1) * sizeof(char *));
+  for (size_t i = 0; i < vars.num_buckets; i++) {
+    for (Var *v = vars.buckets[i]; v != NULL; v = v->next) {
+      if ((v->flags & VAR_EXPORT) && v->value != NULL) {
+        size_t name_len = strlen(v->name);
+        size_t value_len = strlen(v->value);
+        char *entry = malloc(name_len + value_len + 2);
+        memcpy(entry, v->name, name_len);
+        entry[name_len] = '=';
+        memcpy(entry + name_len + 1, v->value, value_len + 1);
+        vars.envp[n++] = entry;
+      }
+    }
+  }
+  vars.envp[n] = NULL;
+  vars.env_dirty = 0;
+  environ = vars.envp;
+  stats.env_builds++;
+  return vars.envp;
+}
+
+// The environment plus a command's own NAME=value assignments, which
+// replace any exported variable of the same name
+char **var_environ_with(char **env, int num_env) {
+  char **base = var_environ();
+  size_t n = 0;
+  while (base[n] != NULL) {
+    n++;
+  }
+  char **envp = arena_alloc(&cmd_arena, (n + num_env + 1) * sizeof(char *));
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t name_len = strchr(base[i], '=') - base[i];
+    int replaced = 0;
+    for (int j = 0; j < num_env && !replaced; j++) {
+      replaced = strncmp(env[j], base[i], name_len + 1) == 0;
+    }
+    if (!replaced) {
+      envp[count++] = base[i];
+    }
+  }
+  for (int j = 0; j < num_env; j++) {
+    envp[count++] = env[j];
+  }
+  envp[count] = NULL;
+  return envp;
+}
+
+// Compare two variables by name for sorted listings
+int compare_var_names(const void *a, const void *b) {
+  return strcmp((*(Var *const *)a)->name, (*(Var *const *)b)->name);
+}
+
+// Print every variable with the given flag as a command that recreates it
+void var_list(int flag, const char *command) {
+  Var **list = arena_alloc(&cmd_arena, (vars.count + 1) * sizeof(Var *));
+  size_t n = 0;
+  for (size_t i = 0; i < vars.num_buckets; i++) {
+    for (Var *v = vars.buckets[i]; v != NULL; v = v->next) {
+      if (v->flags & flag) {
+        list[n++] = v;
+      }
+    }
+  }
+  qsort(list, n, sizeof(Var *), compare_var_names);
+  for (size_t i = 0; i < n; i++) {
+    if (list[i]->value == NULL) {
+      printf("%s %s\n", command, list[i]->name);
+      continue;
+    }
+    printf("%s %s=\"", command, list[i]->name);
+    for (const char *c = list[i]->value; *c != '\0'; c++) {
+      if (strchr("\"\\$`", *c) != NULL) {
+        putchar('\\');
+      }
+      putchar(*c);
+    }
+    printf("\"\n");
+  }
+}
+
+// export [-p] [NAME[=value]...] and readonly [-p] [NAME[=value]...]
+int builtin_export(char **args) {
+  int flag = strcmp(args[0], "readonly") == 0 ? VAR_READONLY : VAR_EXPORT;
+  int i = 1;
+  if (args[i] != NULL && strcmp(args[i], "-p") == 0) {
+    i++;
+  }
+  if (args[i] == NULL) {
+    var_list(flag, args[0]);
+    return 0;
+  }
+  int status = 0;
+  for (; args[i] != NULL; i++) {
+    char *eq = strchr(args[i], '=');
+    size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+    int valid = len > 0;
+    for (size_t j = 0; j < len && valid; j++) {
+      valid = is_name_char(args[i][j], j == 0);
+    }
+    if (!valid) {
+      fprintf(stderr, COLOR_RED "%s: %s: not a valid identifier" COLOR_RESET
+              "\n", args[0], args[i]);
+      status = 1;
+    } else if (var_set(args[i], len, eq ? eq + 1 : NULL, flag) < 0) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// unset [-v] NAME... and unset -f NAME...
+int builtin_unset(char **args) {
+  int status = 0;
+  int funcs = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-v") == 0 || strcmp(args[i], "-f") == 0) {
+      funcs = args[i][1] == 'f';
+      continue;
+    }
+    Function *func = funcs ? func_find(args[i]) : NULL;
+    if (func != NULL) {
+      func_remove(func);
+    } else if (!funcs && var_unset(args[i]) < 0) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Whether c may appear in a variable name (first: as its first character)
+int is_name_char(char c, int first) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (!first && c >= '0' && c <= '9');
+}
+
+// Number of positional parameters ($#)
+int pos_count(void) { return pos_args.argc - pos_args.shift; }
+
+// Replace the positional parameters (set -- and scripts' arguments)
+void pos_set(char **argv) {
+  if (pos_args.argv != NULL) {
+    argv_free_copy(pos_args.argv);
+  }
+  pos_args.argv = argv_copy(argv);
+  pos_args.argc = 0;
+  pos_args.shift = 0;
+  while (argv[pos_args.argc] != NULL) {
+    pos_args.argc++;
+  }
+}
+
+// $@ or $* outside of field splitting: the parameters joined by sep, in
+// the command arena
+const char *pos_join(const char *sep) {
+  StrBuf sb = {.arena = &cmd_arena};
+  for (int i = pos_args.shift; i < pos_args.argc; i++) {
+    if (i > pos_args.shift) {
+      sb_append(&sb, sep, strlen(sep));
+    }
+    sb_append(&sb, pos_args.argv[i], strlen(pos_args.argv[i]));
+  }
+  return sb_finish(&sb);
+}
+
+// Value of $name: the special parameters ? $ ! # @ * 0-9 (or more digits,
+// as in ${10}) or a variable. Numbers are formatted into buf. NULL when
+// unset.
+const char *expand_param(const char *name, size_t len, char *buf,
+                         size_t size) {
+  if (len == 1 && *name == '?') {
+    snprintf(buf, size, "%d", last_status);
+    return buf;
+  }
+  if (len == 1 && *name == '$') {
+    snprintf(buf, size, "%d", (int)shell_pid);
+    return buf;
+  }
+  if (len == 1 && *name == '!') {
+    if (last_bg_pid == 0) {
+      return NULL;
+    }
+    snprintf(buf, size, "%d", (int)last_bg_pid);
+    return buf;
+  }
+  if (len == 1 && *name == '#') {
+    snprintf(buf, size, "%d", pos_count());
+    return buf;
+  }
+  if (len == 1 && (*name == '@' || *name == '*')) {
+    // "$*" joins with the first character of $IFS
+    const char *ifs = var_get("IFS");
+    char sep[2] = {ifs == NULL ? ' ' : *ifs, '\0'};
+    return pos_join(*name == '@' ? " " : sep);
+  }
+  if (*name >= '0' && *name <= '9') {
+    long n = 0;
+    for (size_t i = 0; i < len && n <= INT_MAX; i++) {
+      n = n * 10 + (name[i] - '0');
+    }
+    if (n == 0) {
+      return shell_name;
+    }
+    return n <= pos_count() ? pos_args.argv[pos_args.shift + n - 1] : NULL;
+  }
+  Var *v = var_lookup(name, len);
+  return v != NULL ? v->value : NULL;
+}
+
+// Expand the $ reference at s into sb and return the position after it:
+// $NAME, $?, $$, $!, $#, $0-$9, ${NAME}, ${#NAME} (the length of the
+// value) and ${NAME op word} with op one of :- - := = :+ + (the colon
+// forms also treat an empty value as unset)
+const char *expand_dollar(const char *s, const char *end, StrBuf *sb) {
+  const char *p = s + 1;
+  char num[24];
+  if (p < end && *p == '{') {
+    const char *close = lex_brace(s, end) - 1;
+    if (close <= p) {
+      sb_putc(sb, '$'); // no closing brace
+      return p;
+    }
+    const char *name = p + 1;
+    const char *q = name;
+    if (*name == '#' && close - name > 1) {
+      char length[24];
+      const char *value = expand_param(name + 1, close - name - 1, num,
+                                       sizeof(num));
+      snprintf(length, sizeof(length), "%zu",
+               value != NULL ? strlen(value) : 0);
+      sb_append(sb, length, strlen(length));
+      return close + 1;
+    }
+    if (q < close && *q >= '0' && *q <= '9') {
+      while (q < close && *q >= '0' && *q <= '9') {
+        q++;
+      }
+    } else if (q < close && strchr("?$!#@*", *q) != NULL) {
+      q++;
+    } else {
+      while (q < close && is_name_char(*q, q == name)) {
+        q++;
+      }
+    }
+    const char *value = expand_param(name, q - name, num, sizeof(num));
+    int colon = q < close && *q == ':';
+    char op = q + colon < close ? q[colon] : '\0';
+    const char *word = q + colon + (op != '\0');
+    int set = value != NULL && (!colon || *value != '\0');
+    if (q == name || (op != '\0' && strchr("-=+", op) == NULL) ||
+        (op == '\0' && colon)) {
+      fprintf(stderr, COLOR_RED "myshell: %.*s: bad substitution" COLOR_RESET
+              "\n", (int)(close + 1 - s), s);
+    } else if (op == '\0' || (op != '+' && set)) {
+      if (value != NULL) {
+        sb_append(sb, value, strlen(value));
+      }
+    } else if (op == '+' ? set : 1) {
+      size_t start = sb->len;
+      expand_range(sb, word, close, NULL, NULL);
+      if (op == '=') {
+        var_set(name, q - name, sb->data + start, 0);
+      }
+    }
+    return close + 1;
+  }
+  if (p < end && strchr("?$!#@*0123456789", *p) != NULL) {
+    const char *value = expand_param(p, 1, num, sizeof(num));
+    if (value != NULL) {
+      sb_append(sb, value, strlen(value));
+    }
+    return p + 1;
+  }
+  if (p < end && is_name_char(*p, 1)) {
+    const char *q = p;
+    while (q < end && is_name_char(*q, q == p)) {
+      q++;
+    }
+    const char *value = expand_param(p, q - p, num, sizeof(num));
+    if (value != NULL) {
+      sb_append(sb, value, strlen(value));
+    }
+    return q;
+  }
+  sb_putc(sb, '$');
+  return p;
+}
+
+// Arithmetic expansion $((...)) (see arith_eval): C integer expressions on
+// longs, with shell variables by name and the assignment operators
+typedef struct {
+  const char *s;
+  const char *error; // the first error, if any
+  int skip;          // in the operand && || or ?: does not take: no effects
+  int depth;         // nesting of variables whose values are expressions
+} Arith;
+
+// Binary operators, longest first so << is not read as <
+typedef struct {
+  const char *op;
+  int prec; // higher binds tighter
+} ArithOp;
+
+const ArithOp arith_ops[] = {
+    {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7},
+    {"<<", 8}, {">>", 8}, {"|", 3},  {"^", 4},  {"&", 5},  {"<", 7},
+    {">", 7},  {"+", 9},  {"-", 9},  {"*", 10}, {"/", 10}, {"%", 10}};
+
+long arith_assign(Arith *a);
+
+void arith_blank(Arith *a) {
+  while (*a->s == ' ' || *a->s == '\t' || *a->s == '\n') {
+    a->s++;
+  }
+}
+
+long arith_fail(Arith *a, const char *message) {
+  if (a->error == NULL) {
+    a->error = message;
+  }
+  return 0;
+}
+
+// The binary operator at s, or NULL. An operator followed by = is an
+// assignment (+=, <<=), except for the comparisons.
+const ArithOp *arith_match(const char *s) {
+  for (size_t i = 0; i < sizeof(arith_ops) / sizeof(arith_ops[0]); i++) {
+    size_t len = strlen(arith_ops[i].op);
+    if (strncmp(s, arith_ops[i].op, len) == 0) {
+      if (s[len] == '=' && arith_ops[i].prec != 6 && arith_ops[i].prec != 7) {
+        return NULL;
+      }
+      return &arith_ops[i];
+    }
+  }
+  return NULL;
+}
+
+// Apply a binary operator (also for op=), wrapping around on overflow
+long arith_apply(Arith *a, const char *op, long l, long r) {
+  unsigned long ul = l;
+  unsigned long ur = r;
+  switch (op[0]) {
+  case '+':
+    return (long)(ul + ur);
+  case '-':
+    return (long)(ul - ur);
+  case '*':
+    return (long)(ul * ur);
+  case '/':
+  case '%':
+    if (r == 0) {
+      return a->skip ? 0 : arith_fail(a, "division by zero");
+    }
+    if (r == -1) {
+      return op[0] == '/' ? (long)(0 - ul) : 0; // LONG_MIN / -1
+    }
+    return op[0] == '/' ? l / r : l % r;
+  case '<':
+    if (op[1] == '<') {
+      return (long)(ul << (r & 63));
+    }
+    return op[1] == '=' ? l <= r : l < r;
+  case '>':
+    if (op[1] == '>') {
+      return l >> (r & 63);
+    }
+    return op[1] == '=' ? l >= r : l > r;
+  case '=':
+    return l == r;
+  case '!':
+    return l != r;
+  case '&':
+    return l & r;
+  case '^':
+    return l ^ r;
+  default:
+    return l | r;
+  }
+}
+
+// The value of a variable: 0 if unset or empty, otherwise its value
+// evaluated as an expression of its own
+long arith_var(Arith *a, const char *name, size_t len) {
+  Var *v = var_lookup(name, len);
+  if (v == NULL || v->value == NULL || v->value[0] == '\0') {
+    return 0;
+  }
+  // Plain decimal numbers, the common case, skip the parser
+  const char *s = v->value + (v->value[0] == '-');
+  if (*s >= '1' && *s <= '9' && s[strspn(s, "0123456789")] == '\0' &&
+      strlen(s) < 19) {
+    return strtol(v->value, NULL, 10);
+  }
+  if (a->depth >= 32) {
+    return arith_fail(a, "expression recursion level exceeded");
+  }
+  Arith sub = {.s = arena_strndup(&cmd_arena, v->value, strlen(v->value)),
+               .skip = a->skip, .depth = a->depth + 1};
+  long value = arith_assign(&sub);
+  arith_blank(&sub);
+  if (sub.error == NULL && *sub.s != '\0') {
+    sub.error = "syntax error in variable value";
+  }
+  if (sub.error != NULL) {
+    arith_fail(a, sub.error);
+  }
+  return value;
+}
+
+void arith_store(Arith *a, const char *name, size_t len, long value) {
+  if (a->skip) {
+    return;
+  }
+  char num[24];
+  snprintf(num, sizeof(num), "%ld", value);
+  if (var_set(name, len, num, 0) < 0) {
+    arith_fail(a, "assignment failed");
+  }
+}
+
+// A number (decimal, 0x hexadecimal or 0 octal), a variable with an
+// optional ++ or --, or a parenthesized expression
+long arith_primary(Arith *a) {
+  arith_blank(a);
+  const char *s = a->s;
+  if (*s == '(') {
+    a->s++;
+    long value = arith_assign(a);
+    arith_blank(a);
+    if (*a->s != ')') {
+      return arith_fail(a, "missing `)'");
+    }
+    a->s++;
+    return value;
+  }
+  if (*s >= '0' && *s <= '9') {
+    char *end;
+    errno = 0;
+    long value = strtol(s, &end, 0);
+    if (errno != 0 || is_name_char(*end, 0)) {
+      return arith_fail(a, "invalid number");
+    }
+    a->s = end;
+    return value;
+  }
+  if (is_name_char(*s, 1)) {
+    while (is_name_char(*a->s, 0)) {
+      a->s++;
+    }
+    size_t len = a->s - s;
+    long value = arith_var(a, s, len);
+    arith_blank(a);
+    if ((a->s[0] == '+' || a->s[0] == '-') && a->s[1] == a->s[0]) {
+      arith_store(a, s, len, value + (a->s[0] == '+' ? 1 : -1));
+      a->s += 2;
+    }
+    return value;
+  }
+  return arith_fail(a, "operand expected");
+}
+
+// Unary + - ! ~ and prefix ++ --
+long arith_unary(Arith *a) {
+  arith_blank(a);
+  char c = *a->s;
+  if ((c == '+' || c == '-') && a->s[1] == c) {
+    a->s += 2;
+    arith_blank(a);
+    const char *name = a->s;
+    while (is_name_char(*a->s, a->s == name)) {
+      a->s++;
+    }
+    if (a->s == name) {
+      return arith_fail(a, "variable expected after ++ or --");
+    }
+    long value = arith_var(a, name, a->s - name) + (c == '+' ? 1 : -1);
+    arith_store(a, name, a->s - name, value);
+    return value;
+  }
+  if (c == '+' || c == '-' || c == '!' || c == '~') {
+    a->s++;
+    long value = arith_unary(a);
+    if (c == '-') {
+      return (long)(0 - (unsigned long)value);
+    }
+    return c == '+' ? value : c == '!' ? !value : ~value;
+  }
+  return arith_primary(a);
+}
+
+// Binary operators of precedence min_prec or tighter, left to right
+long arith_binary(Arith *a, int min_prec) {
+  long left = arith_unary(a);
+  while (a->error == NULL) {
+    arith_blank(a);
+    const ArithOp *op = arith_match(a->s);
+    if (op == NULL || op->prec < min_prec) {
+      break;
+    }
+    a->s += strlen(op->op);
+    if (op->prec <= 2) {
+      // && and || only evaluate the right side when it decides
+      int skip = op->prec == 1 ? left != 0 : left == 0;
+      a->skip += skip;
+      long right = arith_binary(a, op->prec + 1);
+      a->skip -= skip;
+      left = op->prec == 1 ? (left || right) : (left && right);
+    } else {
+      left = arith_apply(a, op->op, left, arith_binary(a, op->prec + 1));
+    }
+  }
+  return left;
+}
+
+// cond ? yes : no
+long arith_ternary(Arith *a) {
+  long cond = arith_binary(a, 1);
+  arith_blank(a);
+  if (*a->s != '?') {
+    return cond;
+  }
+  a->s++;
+  a->skip += !cond;
+  long yes = arith_assign(a);
+  a->skip -= !cond;
+  arith_blank(a);
+  if (*a->s != ':') {
+    return arith_fail(a, "`:' expected");
+  }
+  a->s++;
+  a->skip += cond != 0;
+  long no = arith_ternary(a);
+  a->skip -= cond != 0;
+  return cond ? yes : no;
+}
+
+// NAME = expr and NAME op= expr, or a conditional expression
+long arith_assign(Arith *a) {
+  static const char *const assign_ops[] = {"=",  "*=",  "/=", "%=",
+                                           "+=", "-=",  "<<=", ">>=",
+                                           "&=", "^=",  "|="};
+  arith_blank(a);
+  const char *name = a->s;
+  const char *q = name;
+  while (is_name_char(*q, q == name)) {
+    q++;
+  }
+  size_t len = q - name;
+  while (len > 0 && (*q == ' ' || *q == '\t' || *q == '\n')) {
+    q++;
+  }
+  for (size_t i = 0; len > 0 && i < sizeof(assign_ops) / sizeof(assign_ops[0]);
+       i++) {
+    size_t op_len = strlen(assign_ops[i]);
+    if (strncmp(q, assign_ops[i], op_len) != 0 ||
+        (op_len == 1 && q[1] == '=')) {
+      continue;
+    }
+    a->s = q + op_len;
+    long value = arith_assign(a);
+    if (op_len > 1) {
+      value = arith_apply(a, assign_ops[i], arith_var(a, name, len), value);
+    }
+    arith_store(a, name, len, value);
+    return value;
+  }
+  return arith_ternary(a);
+}
+
+// Evaluate the text of a $((...)) after its own expansions. Returns -1
+// after reporting an error.
+int arith_eval(const char *text, long *value) {
+  Arith a = {.s = text};
+  arith_blank(&a);
+  *value = *a.s != '\0' ? arith_assign(&a) : 0;
+  arith_blank(&a);
+  if (a.error == NULL && *a.s != '\0') {
+    a.error = "syntax error in expression";
+  }
+  if (a.error != NULL) {
+    fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", text,
+            a.error);
+    return -1;
+  }
+  return 0;
+}
+
+// The end of the $((...)) at s, or NULL if it is a command substitution
+// such as $( (cd dir) )
+const char *arith_end(const char *s, const char *end) {
+  if (s + 2 >= end || s[1] != '(' || s[2] != '(') {
+    return NULL;
+  }
+  const char *close = lex_paren(s + 1, end);
+  return close != NULL && close - s >= 5 && close[-2] == ')' ? close : NULL;
+}
+
+// Expand the $((...)) at s into sb and return the position after it, or
+// NULL if s is not an arithmetic expansion. The expression has its $
+// references and substitutions expanded first; a plain one such as
+// $((i+1)) is only copied.
+const char *expand_arith(const char *s, const char *end, StrBuf *sb) {
+  const char *close = arith_end(s, end);
+  if (close == NULL) {
+    return NULL;
+  }
+  const char *expr = s + 3;
+  size_t len = close - 2 - expr;
+  char *text;
+  if (memchr(expr, '$', len) == NULL && memchr(expr, '`', len) == NULL &&
+      memchr(expr, '\\', len) == NULL && memchr(expr, '"', len) == NULL &&
+      memchr(expr, '\'', len) == NULL) {
+    text = arena_strndup(&cmd_arena, expr, len);
+  } else {
+    StrBuf expanded = {.arena = &cmd_arena};
+    expand_range(&expanded, expr, close - 2, NULL, NULL);
+    text = sb_finish(&expanded);
+  }
+  long value;
+  if (arith_eval(text, &value) == 0) {
+    char num[24];
+    snprintf(num, sizeof(num), "%ld", value);
+    sb_append(sb, num, strlen(num));
+  }
+  return close;
+}
+
+// Append text to a glob pattern, escaping it so it only matches itself
+void pattern_append_literal(StrBuf *pat, const char *s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (strchr("*?[]\\", s[i]) != NULL) {
+      sb_putc(pat, '\\');
+    }
+    sb_putc(pat, s[i]);
+  }
+}
+
+// An empty read/write file that lives in memory, for here-documents and
+// captured output. Where memfd_create is missing an unlinked temporary
+// file stands in.
+int memfile_open(const char *name) {
+  int fd = -1;
+#ifdef __linux__
+  fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+  if (fd < 0) {
+    char path[] = "/tmp/myshell-XXXXXX";
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", name,
+              strerror(errno));
+      return -1;
+    }
+    unlink(path);
+  }
+  return fd;
+}
+
+// End the current field of a word being split
+void fields_end(Fields *f, size_t word, size_t pat) {
+  if (f->count == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 8;
+    size_t *grown = arena_alloc(&cmd_arena, f->cap * 2 * sizeof(size_t));
+    if (f->count > 0) {
+      memcpy(grown, f->ends, f->count * 2 * sizeof(size_t));
+    }
+    f->ends = grown;
+  }
+  f->ends[2 * f->count] = word;
+  f->ends[2 * f->count + 1] = pat;
+  f->count++;
+  f->pending = 0;
+  f->forced = 0;
+}
+
+// Note a field separator at the end of a word being split: the field ends
+// there if more text follows. A blank one only counts after some text.
+void fields_separator(Fields *f, StrBuf *sb, StrBuf *pat, int blank) {
+  size_t start = f->count > 0 ? f->ends[2 * (f->count - 1)] : 0;
+  if (!blank && f->forced) {
+    fields_end(f, f->pending_word, f->pending_pat);
+  }
+  if (!blank || (sb->len > start && !f->pending)) {
+    if (!f->pending) {
+      f->pending = 1;
+      f->pending_word = sb->len;
+      f->pending_pat = pat != NULL ? pat->len : 0;
+    }
+    f->forced |= !blank;
+  }
+}
+
+// Append the result of an unquoted expansion or substitution to a word,
+// splitting it at the characters of $IFS (default space, tab, newline).
+// Runs of blanks separate fields and vanish at the edges; any other IFS
+// character ends a field, so with IFS=: the text a::b is a, an empty
+// field, and b.
+void fields_append(Fields *f, StrBuf *sb, StrBuf *pat, const char *text,
+                   size_t len) {
+  const char *ifs = var_get("IFS");
+  if (ifs == NULL) {
+    ifs = " \t\n";
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = text[i];
+    if (c != '\0' && strchr(ifs, c) != NULL) {
+      fields_separator(f, sb, pat, c == ' ' || c == '\t' || c == '\n');
+      continue;
+    }
+    if (f->pending) {
+      fields_end(f, f->pending_word, f->pending_pat);
+    }
+    sb_putc(sb, c);
+    if (pat != NULL) {
+      pattern_append_literal(pat, &c, 1);
+    }
+  }
+}
+
+// Length of the $@ or ${@} at s, also $* and ${*} unquoted, which expand
+// to one field per positional parameter; 0 for any other $ reference
+size_t all_params_len(const char *s, const char *end, int in_double) {
+  const char *name = s + 1 + (s + 1 < end && s[1] == '{');
+  if (name >= end || (*name != '@' && (*name != '*' || in_double))) {
+    return 0;
+  }
+  if (name == s + 1) {
+    return 2;
+  }
+  return name + 1 < end && name[1] == '}' ? 4 : 0;
+}
+
+// Append the positional parameters to a word being split, each in a field
+// of its own: "a$@b" with parameters 1 and 2 gives a1 and 2b. Without
+// parameters a lone "$@" gives no word at all. Unquoted (split set), each
+// parameter is split further and empty ones vanish, as with $x.
+void fields_params(Fields *f, StrBuf *sb, StrBuf *pat, int split) {
+  if (pos_count() == 0) {
+    f->vanish = 1;
+    return;
+  }
+  if (f->pending && !split) {
+    fields_end(f, f->pending_word, f->pending_pat);
+  }
+  for (int i = pos_args.shift; i < pos_args.argc; i++) {
+    const char *arg = pos_args.argv[i];
+    if (split) {
+      if (i > pos_args.shift) {
+        fields_separator(f, sb, pat, 1);
+      }
+      fields_append(f, sb, pat, arg, strlen(arg));
+      continue;
+    }
+    if (i > pos_args.shift) {
+      fields_end(f, sb->len, pat != NULL ? pat->len : 0);
+    }
+    sb_append(sb, arg, strlen(arg));
+    if (pat != NULL) {
+      pattern_append_literal(pat, arg, strlen(arg));
+    }
+  }
+}
+
+// Command substitutions being evaluated in the shell process
+int subst_depth = 0;
+// Status of the last substitution in the command being expanded, or -1
+int subst_status = -1;
+
+#define SUBST_CHUNK 65536 // least free space for each read of subshell output
+
+// Whether $(...) can be evaluated without a subshell: a simple command
+// whose name is an external program (spawned as usual, output to memory)
+// or a builtin that leaves the shell's state alone (not a function), or one
+// made only of assignments. Decided from the literal words, before
+// anything expands.
+int subst_in_shell(Node *tree) {
+  if (tree->num_children != 1 || tree->children[0]->kind != NODE_COMMAND ||
+      tree->children[0]->background) {
+    return 0;
+  }
+  Node *cmd = tree->children[0];
+  int i = 0;
+  while (i < cmd->num_words && word_is_assignment(&cmd->words[i])) {
+    i++;
+  }
+  if (i == cmd->num_words) {
+    return cmd->redirs == NULL;
+  }
+  Word *w = &cmd->words[i];
+  if (w->flags != 0 || word_is(w, "time") || word_is(w, "pipesize")) {
+    return 0;
+  }
+  char *name = arena_strndup(&cmd_arena, w->text, w->len);
+  if (func_find(name) != NULL) {
+    return 0;
+  }
+  Builtin *builtin = builtin_lookup((char *[]){name, NULL});
+  return builtin == NULL || builtin->loaded != NULL ||
+         (builtin->flags & BUILTIN_SUBST) != 0;
+}
+
+// Run a simple command in the shell with stdout on an in-memory file,
+// then read it back in one go
+void subst_capture(Node *cmd, StrBuf *out) {
+  int fd = memfile_open("subst");
+  if (fd < 0) {
+    last_status = 1;
+    return;
+  }
+  fflush(stdout);
+  int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+  dup2(fd, STDOUT_FILENO);
+  execute_command(cmd);
+  fflush(stdout);
+  if (saved >= 0) {
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+  } else {
+    close(STDOUT_FILENO);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    sb_reserve(out, st.st_size);
+    while (out->len < (size_t)st.st_size) {
+      ssize_t n = pread(fd, out->data + out->len, st.st_size - out->len,
+                        out->len);
+      if (n <= 0 && !(n < 0 && errno == EINTR)) {
+        break;
+      }
+      out->len += n > 0 ? n : 0;
+    }
+    out->data[out->len] = '\0';
+  }
+  close(fd);
+}
+
+// Run a command line in a forked child, so cd, exit or assignments stay
+// in the subshell, and read its output from a pipe
+void subst_fork(Node *tree, StrBuf *out) {
+  int fds[2];
+  if (make_pipe(fds) < 0) {
+    perror("pipe");
+    last_status = 1;
+    return;
+  }
+  stats.subst_forks++;
+  LaunchSpec spec = {.argv = (char *[]){"$(...)", NULL}, .builtin = 1,
+                     .subshell = tree};
+  launch_add_fd(&spec, fds[1], STDOUT_FILENO);
+  spec.opened[spec.num_opened++] = fds[1];
+  pid_t pid = launch_command(&spec);
+  launch_release(&spec);
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    last_status = 1;
+    return;
+  }
+  while (1) {
+    sb_reserve(out, SUBST_CHUNK);
+    ssize_t n = read(fds[0], out->data + out->len, out->cap - out->len - 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    out->len += n;
+  }
+  if (out->data != NULL) {
+    out->data[out->len] = '\0';
+  }
+  close(fds[0]);
+  wait_for_child(pid);
+}
+
+// Run the command text [src, src + len) and return its output without
+// trailing newlines; last_status is its exit status. Simple commands are
+// evaluated in the shell (see subst_in_shell), anything else in a
+// subshell.
+char *command_subst(const char *src, size_t len, size_t *out_len) {
+  StrBuf out = {.arena = &cmd_arena};
+  Parser parser;
+  Node *tree = parse_input(&parser, src, len, NULL);
+  stats.substs++;
+  *out_len = 0;
+  if (tree == NULL) {
+    last_status = 2;
+    return "";
+  }
+  last_status = 0;
+  if (tree->num_children == 0) {
+    return "";
+  }
+
+  subst_depth++;
+  if (!subst_in_shell(tree)) {
+    subst_fork(tree, &out);
+  } else if (tree->children[0]->num_words > 0 &&
+             !word_is_assignment(&tree->children[0]->words[0])) {
+    subst_capture(tree->children[0], &out);
+  } else {
+    // Assignments only: expanded for their own substitutions, but like
+    // any subshell assignment they do not reach the shell
+    ArgVec args = {.arena = &cmd_arena};
+    Node *cmd = tree->children[0];
+    for (int i = 0; i < cmd->num_words; i++) {
+      expand_word_glob(&cmd->words[i], &args, 0);
+    }
+  }
+  subst_depth--;
+  subst_status = last_status;
+
+  while (out.len > 0 && out.data[out.len - 1] == '\n') {
+    out.len--;
+  }
+  *out_len = out.len;
+  return out.len > 0 ? out.data : "";
+}
+
+// Expand the $(...) or `...` at s into sb (and pat) and return the
+// position after it. With fields the output is split into fields, as for
+// an unquoted substitution; otherwise it is appended as it is.
+const char *expand_subst(const char *s, const char *end, StrBuf *sb,
+                         StrBuf *pat, Fields *fields) {
+  const char *close;
+  const char *src;
+  size_t src_len;
+  if (*s == '`') {
+    close = lex_backquote(s, end);
+    if (close == NULL) {
+      close = end;
+    }
+    // \$ \` and \\ lose their backslash before the command is parsed
+    StrBuf text = {.arena = &cmd_arena};
+    const char *stop = close - (*(close - 1) == '`' && close - 1 > s);
+    for (const char *p = s + 1; p < stop; p++) {
+      if (*p == '\\' && p + 1 < stop && strchr("$`\\", p[1]) != NULL) {
+        p++;
+      }
+      sb_putc(&text, *p);
+    }
+    src = sb_finish(&text);
+    src_len = text.len;
+  } else {
+    close = lex_paren(s + 1, end);
+    if (close == NULL) {
+      close = end;
+    }
+    src = s + 2;
+    src_len = close - src - (*(close - 1) == ')');
+  }
+
+  size_t len;
+  char *text = command_subst(src, src_len, &len);
+  if (fields != NULL) {
+    fields_append(fields, sb, pat, text, len);
+  } else {
+    sb_append(sb, text, len);
+    if (pat != NULL) {
+      pattern_append_literal(pat, text, len);
+    }
+  }
+  return close;
+}
+
+// Expand $ references and command substitutions in [s, end) and remove
+// quotes, appending to sb. With pat, also build the word's glob pattern:
+// unquoted characters as they are, quoted text and expansions escaped.
+// With fields, unquoted expansions and substitutions are split into
+// fields.
+void expand_range(StrBuf *sb, const char *s, const char *end, StrBuf *pat,
+                  Fields *fields) {
+  int in_double = 0;
+  size_t n;
+  const char *next;
+  while (s < end) {
+    char c = *s;
+    size_t before = sb->len;
+    int quoted = 1;
+    if (c == '\'' && !in_double) {
+      const char *close = memchr(s + 1, '\'', end - s - 1);
+      if (close == NULL) {
+        close = end; // only inside an unbalanced ${...} word
+      }
+      sb_append(sb, s + 1, close - s - 1);
+      s = close + (close < end);
+    } else if (c == '"') {
+      in_double = !in_double;
+      s++;
+    } else if (c == '$' && (next = expand_arith(s, end, sb)) != NULL) {
+      s = next;
+    } else if ((c == '$' && s + 1 < end && s[1] == '(') || c == '`') {
+      s = expand_subst(s, end, sb, pat, in_double ? NULL : fields);
+      continue;
+    } else if (c == '$' && fields != NULL &&
+               (n = all_params_len(s, end, in_double)) > 0) {
+      fields_params(fields, sb, pat, !in_double);
+      s += n;
+      continue;
+    } else if (c == '$' && fields != NULL && !in_double) {
+      StrBuf value = {.arena = &cmd_arena};
+      s = expand_dollar(s, end, &value);
+      fields_append(fields, sb, pat, value.data, value.len);
+      continue;
+    } else if (c == '$') {
+      s = expand_dollar(s, end, sb);
+    } else if (c == '\\' && s + 1 < end &&
+               (!in_double || strchr("$`\"\\\n", s[1]) != NULL)) {
+      if (s[1] != '\n') {
+        sb_putc(sb, s[1]);
+      }
+      s += 2;
+    } else {
+      // Copy a run of ordinary characters at once
+      n = 1;
+      while (s + n < end && s[n] != '\'' && s[n] != '"' && s[n] != '$' &&
+             s[n] != '`' && s[n] != '\\') {
+        n++;
+      }
+      sb_append(sb, s, n);
+      s += n;
+      quoted = in_double;
+      if (pat != NULL && !quoted) {
+        sb_append(pat, sb->data + before, n);
+        continue;
+      }
+    }
+    if (pat != NULL && quoted) {
+      pattern_append_literal(pat, sb->data + before, sb->len - before);
+    } else if (pat != NULL) {
+      sb_putc(pat, c);
+    }
+  }
+}
+
+// Add the fields a word was split into, each globbed if glob is set
+void expand_fields(StrBuf *sb, StrBuf *pat, Fields *fields, int glob,
+                   ArgVec *out) {
+  size_t word_start = 0;
+  size_t pat_start = 0;
+  for (int i = 0; i <= fields->count; i++) {
+    size_t word_end = i < fields->count ? fields->ends[2 * i] : sb->len;
+    size_t pat_end = i < fields->count ? fields->ends[2 * i + 1] : pat->len;
+    char *word = arena_strndup(&cmd_arena, sb->data + word_start,
+                               word_end - word_start);
+    if (glob) {
+      glob_expand(arena_strndup(&cmd_arena, pat->data + pat_start,
+                                pat_end - pat_start),
+                  word, out);
+    } else {
+      argv_push(out, word);
+    }
+    word_start = word_end;
+    pat_start = pat_end;
+  }
+}
+
+// Expand one word: tilde, variables, command substitution, quote removal
+// and, if glob is set, field splitting of unquoted expansions and
+// pathname expansion. An unquoted word that expands to nothing is
+// dropped. The results live in the command arena.
+void expand_word_glob(const Word *w, ArgVec *out, int glob) {
+  const char *s = w->text;
+  const char *end = s + w->len;
+  int split = glob;
+  glob = glob && (w->flags & WORD_GLOB);
+
+  if (w->flags == 0) {
+    argv_push(out, arena_strndup(&cmd_arena, s, w->len));
+    return;
+  }
+
+  StrBuf sb = {.arena = &cmd_arena};
+  StrBuf pat = {.arena = &cmd_arena};
+
+  // Part 3: Tilde expansion (~ or ~/path)
+  if ((w->flags & WORD_TILDE) && (w->len == 1 || s[1] == '/')) {
+    const char *home = var_get("HOME");
+    if (home != NULL) {
+      sb_append(&sb, home, strlen(home));
+      pattern_append_literal(&pat, home, strlen(home));
+      s++;
+    }
+  }
+
+  // Part 2: Variable expansion, anywhere in the word
+  Fields fields = {0};
+  expand_range(&sb, s, end, glob ? &pat : NULL, split ? &fields : NULL);
+  if (fields.pending && sb.len > fields.pending_word) {
+    fields_end(&fields, fields.pending_word, fields.pending_pat);
+  }
+  if (fields.count > 0) {
+    expand_fields(&sb, &pat, &fields, glob, out);
+    return;
+  }
+  if (sb.len == 0 && (fields.vanish || (!(w->flags & WORD_QUOTED) &&
+                                        (w->flags & WORD_DOLLAR)))) {
+    return;
+  }
+  if (glob) {
+    glob_expand(sb_finish(&pat), sb_finish(&sb), out);
+    return;
+  }
+  argv_push(out, sb_finish(&sb));
+}
+
+void expand_word(const Word *w, ArgVec *out) { expand_word_glob(w, out, 1); }
+
+// Expand a word that must produce exactly one string (redirection
+// targets); no globbing
+char *expand_word_single(const Word *w) {
+  ArgVec v = {.arena = &cmd_arena};
+  expand_word_glob(w, &v, 0);
+  return v.argc > 0 ? v.argv[0] : arena_strndup(&cmd_arena, "", 0);
+}
+
+// What assign_all is about to overwrite, so a builtin's NAME=value
+// assignments can be undone afterwards
+typedef struct {
+  char *value; // NULL if the variable did not exist or was unset
+  int flags;
+  int existed;
+} VarSaved;
+
+VarSaved *var_save(char **env, int num_env) {
+  if (num_env == 0) {
+    return NULL;
+  }
+  VarSaved *saved = arena_alloc(&cmd_arena, (num_env + 1) * sizeof(VarSaved));
+  for (int i = 0; i < num_env; i++) {
+    Var *v = var_lookup(env[i], strchr(env[i], '=') - env[i]);
+    saved[i].existed = v != NULL;
+    saved[i].flags = v ? v->flags : 0;
+    saved[i].value = v && v->value ? arena_strndup(&cmd_arena, v->value,
+                                                   strlen(v->value))
+                                   : NULL;
+  }
+  return saved;
+}
+
+void var_restore(VarSaved *saved, int num_env, char **env) {
+  for (int i = num_env - 1; i >= 0; i--) {
+    char *eq = strchr(env[i], '=');
+    Var *v = var_lookup(env[i], eq - env[i]);
+    if (v == NULL || (v->flags & VAR_READONLY)) {
+      continue;
+    }
+    if (!saved[i].existed) {
+      char *name = arena_strndup(&cmd_arena, env[i], eq - env[i]);
+      var_unset(name);
+      continue;
+    }
+    if (!(saved[i].flags & VAR_EXPORT) && (v->flags & VAR_EXPORT)) {
+      vars.env_dirty = 1;
+    }
+    v->flags = saved[i].flags;
+    if (saved[i].value != NULL) {
+      var_set(v->name, strlen(v->name), saved[i].value, 0);
+    }
+  }
+}
+
+// Whether a word is a NAME=value assignment
+int word_is_assignment(const Word *w) {
+  size_t i = 0;
+  while (i < w->len && is_name_char(w->text[i], i == 0)) {
+    i++;
+  }
+  return i > 0 && i < w->len && w->text[i] == '=';
+}
+
+// Move the NAME=value words in front of a command (from word skip on) out
+// of its expanded arguments and into spec->env
+void take_assignments(Node *cmd, int skip, ArgVec *args, LaunchSpec *spec) {
+  int n = 0;
+  while (n < args->argc && skip + n < cmd->num_words &&
+         word_is_assignment(&cmd->words[skip + n])) {
+    n++;
+  }
+  if (n == 0) {
+    return;
+  }
+  spec->env = arena_alloc(&cmd_arena, (n + 1) * sizeof(char *));
+  memcpy(spec->env, args->argv, n * sizeof(char *));
+  spec->env[n] = NULL;
+  spec->num_env = n;
+  argv_shift(args, n);
+}
+
+// Assign every NAME=value in env as a shell variable. Returns 1 if one
+// was readonly.
+int assign_all(char **env, int num_env, int flags) {
+  int status = 0;
+  for (int i = 0; i < num_env; i++) {
+    char *eq = strchr(env[i], '=');
+    if (var_set(env[i], eq - env[i], eq + 1, flags) < 0) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Compile one pattern component (backslash escapes already in place)
+void glob_compile(const char *s, size_t len, GlobPart *part) {
+  memset(part, 0, sizeof(*part));
+  part->globstar = len == 2 && s[0] == '*' && s[1] == '*';
+  part->match_dot = len > 0 && s[0] == '.';
+  part->ops = arena_alloc(&cmd_arena, (len + 1) * sizeof(GlobOp));
+  StrBuf text = {.arena = &cmd_arena};
+  part->literal = 1;
+  const char *end = s + len;
+  while (s < end) {
+    GlobOp *op = &part->ops[part->num_ops];
+    if (*s == '\\' && s + 1 < end) {
+      op->kind = GLOB_CHAR;
+      op->c = s[1];
+      sb_putc(&text, s[1]);
+      s += 2;
+    } else if (*s == '*') {
+      op->kind = GLOB_STAR;
+      part->literal = 0;
+      while (s < end && *s == '*') {
+        s++;
+      }
+    } else if (*s == '?') {
+      op->kind = GLOB_ANY;
+      part->literal = 0;
+      s++;
+    } else if (*s == '[' && glob_class(s, end, op) != NULL) {
+      part->literal = 0;
+      s = glob_class(s, end, op);
+    } else {
+      op->kind = GLOB_CHAR;
+      op->c = *s;
+      sb_putc(&text, *s);
+      s++;
+    }
+    part->num_ops++;
+  }
+  part->text = sb_finish(&text);
+}
+
+// Parse a bracket expression at s into op. Returns the position after it,
+// or NULL if it is not closed (the [ is then an ordinary character).
+const char *glob_class(const char *s, const char *end, GlobOp *op) {
+  static const struct {
+    const char *name;
+    int (*test)(int);
+  } classes[] = {{"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+                 {"upper", isupper}, {"lower", islower}, {"space", isspace},
+                 {"punct", ispunct}, {"xdigit", isxdigit}};
+  const char *p = s + 1;
+  int negate = p < end && (*p == '!' || *p == '^');
+  p += negate;
+  memset(op->set, 0, sizeof(op->set));
+  op->kind = GLOB_CLASS;
+  int first = 1;
+  while (p < end && (*p != ']' || first)) {
+    first = 0;
+    if (*p == '[' && p + 1 < end && p[1] == ':') {
+      const char *close = p + 2;
+      while (close + 1 < end && !(close[0] == ':' && close[1] == ']')) {
+        close++;
+      }
+      size_t n = close - (p + 2);
+      for (size_t k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+        if (strlen(classes[k].name) == n &&
+            strncmp(classes[k].name, p + 2, n) == 0) {
+          for (int c = 1; c < 256; c++) {
+            if (classes[k].test(c)) {
+              op->set[c >> 3] |= 1 << (c & 7);
+            }
+          }
+        }
+      }
+      p = close + 2;
+      continue;
+    }
+    if (*p == '\\' && p + 1 < end) {
+      p++;
+    }
+    unsigned char lo = *p++;
+    unsigned char hi = lo;
+    if (p + 1 < end && *p == '-' && p[1] != ']') {
+      p++;
+      if (*p == '\\' && p + 1 < end) {
+        p++;
+      }
+      hi = *p++;
+    }
+    for (int c = lo; c <= hi; c++) {
+      op->set[c >> 3] |= 1 << (c & 7);
+    }
+  }
+  if (p >= end) {
+    return NULL;
+  }
+  if (negate) {
+    for (int i = 0; i < 32; i++) {
+      op->set[i] = ~op->set[i];
+    }
+  }
+  op->set['/' >> 3] &= ~(1 << ('/' & 7));
+  return p + 1;
+}
+
+// Match a name against a compiled component. Backtracks only to the last
+// star, so the cost is linear in practice.
+int glob_match(const GlobPart *part, const char *name) {
+  if (name[0] == '.' && !part->match_dot) {
+    return 0; // hidden names need an explicit leading dot
+  }
+  const GlobOp *ops = part->ops;
+  int n = part->num_ops;
+  int i = 0;
+  int star = -1;
+  const char *star_name = NULL;
+  const unsigned char *s = (const unsigned char *)name;
+  while (*s != '\0') {
+    if (i < n && ops[i].kind == GLOB_STAR) {
+      star = i++;
+      star_name = (const char *)s;
+      continue;
+    }
+    if (i < n && (ops[i].kind == GLOB_ANY ||
+                  (ops[i].kind == GLOB_CHAR && ops[i].c == *s) ||
+                  (ops[i].kind == GLOB_CLASS &&
+                   (ops[i].set[*s >> 3] & (1 << (*s & 7)))))) {
+      i++;
+      s++;
+      continue;
+    }
+    if (star < 0) {
+      return 0;
+    }
+    i = star + 1;
+    s = (const unsigned char *)++star_name;
+  }
+  while (i < n && ops[i].kind == GLOB_STAR) {
+    i++;
+  }
+  return i == n;
+}
+
+void glob_dir_free(GlobDir *d) {
+  free(d->path);
+  free(d->names);
+  free(d->offsets);
+  free(d->types);
+  free(d);
+}
+
+// Drop every cached listing when the cache is turned off
+void glob_cache_changed(void) {
+  for (int i = 0; i < GLOB_CACHE_SLOTS; i++) {
+    if (glob_dirs[i] != NULL && glob_dirs[i]->users == 0) {
+      glob_dir_free(glob_dirs[i]);
+      glob_dirs[i] = NULL;
+    }
+  }
+}
+
+// Read every entry of a directory except . and ..
+GlobDir *glob_read_dir(const char *path, int fd) {
+  GlobDir *d = calloc(1, sizeof(GlobDir));
+  size_t names_cap = 4096;
+  size_t names_len = 0;
+  size_t cap = 64;
+  d->names = malloc(names_cap);
+  d->offsets = malloc(cap * sizeof(size_t));
+  d->types = malloc(cap);
+  d->path = strdup(path);
+#ifdef __linux__
+  // getdents64 hands back many entries per call with their types, which
+  // saves a stat per entry when only directories matter. One buffer serves
+  // every directory: a ** walk visits thousands, and arena space would
+  // stay with the shell for good.
+  static char *buf = NULL;
+  if (buf == NULL) {
+    buf = malloc(GLOB_DENTS_BUFFER);
+  }
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, GLOB_DENTS_BUFFER)) > 0) {
+    for (long pos = 0; pos < n;) {
+      struct {
+        uint64_t ino;
+        int64_t off;
+        unsigned short reclen;
+        unsigned char type;
+        char name[];
+      } *ent = (void *)(buf + pos);
+      pos += ent->reclen;
+      const char *name = ent->name;
+      unsigned char type = ent->type;
+#else
+  DIR *dir = fdopendir(dup(fd));
+  struct dirent *de;
+  while (dir != NULL && (de = readdir(dir)) != NULL) {
+    {
+      const char *name = de->d_name;
+      unsigned char type = DT_UNKNOWN;
+#endif
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      size_t len = strlen(name) + 1;
+      if (names_len + len > names_cap) {
+        while (names_len + len > names_cap) {
+          names_cap *= 2;
+        }
+        d->names = realloc(d->names, names_cap);
+      }
+      if (d->count == cap) {
+        cap *= 2;
+        d->offsets = realloc(d->offsets, cap * sizeof(size_t));
+        d->types = realloc(d->types, cap);
+      }
+      memcpy(d->names + names_len, name, len);
+      d->offsets[d->count] = names_len;
+      d->types[d->count] = type;
+      d->count++;
+      names_len += len;
+    }
+  }
+#ifndef __linux__
+  if (dir != NULL) {
+    closedir(dir);
+  }
+#endif
+  return d;
+}
+
+
+// List a directory ("" is the current one), from the cache when the
+// directory has not changed. Release the result with glob_release.
+GlobDir *glob_list(const char *path) {
+  const char *dir = *path ? path : ".";
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  long long now = monotonic_ms();
+  int free_slot = -1;
+  for (int i = 0; i < GLOB_CACHE_SLOTS && glob_cache; i++) {
+    GlobDir *d = glob_dirs[i];
+    if (d == NULL) {
+      free_slot = free_slot < 0 ? i : free_slot;
+      continue;
+    }
+    int fresh = now - d->read_ms < GLOB_CACHE_TTL_MS;
+    if (fresh && d->dev == st.st_dev && d->ino == st.st_ino &&
+        d->mtime.tv_sec == STAT_MTIME(st).tv_sec &&
+        d->mtime.tv_nsec == STAT_MTIME(st).tv_nsec &&
+        strcmp(d->path, dir) == 0) {
+      close(fd);
+      d->users++;
+      return d;
+    }
+    if (!fresh && d->users == 0) {
+      glob_dir_free(d);
+      glob_dirs[i] = NULL;
+      free_slot = free_slot < 0 ? i : free_slot;
+    }
+  }
+  GlobDir *d = glob_read_dir(dir, fd);
+  close(fd);
+  d->dev = st.st_dev;
+  d->ino = st.st_ino;
+  d->mtime = STAT_MTIME(st);
+  d->read_ms = now;
+  d->users = 1;
+  if (glob_cache && free_slot >= 0) {
+    glob_dirs[free_slot] = d;
+  }
+  return d;
+}
+
+// Done iterating a listing; uncached ones are freed
+void glob_release(GlobDir *d) {
+  d->users--;
+  for (int i = 0; i < GLOB_CACHE_SLOTS; i++) {
+    if (glob_dirs[i] == d) {
+      return;
+    }
+  }
+  glob_dir_free(d);
+}
+
+// Whether entry i of a listing is a directory (symlinks to directories
+// count, except while descending through **)
+int glob_is_dir(GlobDir *d, size_t i, StrBuf *path, int follow) {
+  unsigned char type = d->types[i];
+  if (type == DT_DIR) {
+    return 1;
+  }
+  if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+    return 0;
+  }
+  size_t len = path->len;
+  sb_append(path, d->names + d->offsets[i], strlen(d->names + d->offsets[i]));
+  struct stat st;
+  int is_dir = (follow ? stat(path->data, &st) : lstat(path->data, &st)) == 0 &&
+               S_ISDIR(st.st_mode);
+  path->len = len;
+  path->data[len] = '\0';
+  return is_dir;
+}
+
+// Match parts[i..] below path (which is empty or ends with '/')
+void glob_walk(GlobPart *parts, int num_parts, int i, int dir_only,
+               StrBuf *path, ArgVec *out) {
+  if (i == num_parts) {
+    argv_push(out, arena_strndup(&cmd_arena, path->data, path->len));
+    return;
+  }
+  GlobPart *part = &parts[i];
+  int last = i == num_parts - 1;
+  size_t len = path->len;
+
+  if (part->literal) {
+    sb_append(path, part->text, strlen(part->text));
+    if (last) {
+      struct stat st;
+      if (lstat(path->data, &st) == 0 && (!dir_only || S_ISDIR(st.st_mode))) {
+        if (dir_only) {
+          sb_putc(path, '/');
+        }
+        argv_push(out, arena_strndup(&cmd_arena, path->data, path->len));
+      }
+    } else {
+      sb_putc(path, '/');
+      glob_walk(parts, num_parts, i + 1, dir_only, path, out);
+    }
+    path->len = len;
+    path->data[len] = '\0';
+    return;
+  }
+
+  if (part->globstar) {
+    // ** matches no directory at all, or any number of them
+    if (!last) {
+      glob_walk(parts, num_parts, i + 1, dir_only, path, out);
+    }
+  }
+
+  GlobDir *d = glob_list(path->data);
+  if (d == NULL) {
+    return;
+  }
+  for (size_t k = 0; k < d->count; k++) {
+    const char *name = d->names + d->offsets[k];
+    if (part->globstar ? name[0] == '.' : !glob_match(part, name)) {
+      continue;
+    }
+    int is_dir = -1;
+    if (part->globstar) {
+      is_dir = glob_is_dir(d, k, path, 0);
+      if (last && (!dir_only || is_dir)) {
+        sb_append(path, name, strlen(name));
+        if (dir_only) {
+          sb_putc(path, '/');
+        }
+        argv_push(out, arena_strndup(&cmd_arena, path->data, path->len));
+        path->len = len;
+        path->data[len] = '\0';
+      }
+      if (is_dir) {
+        sb_append(path, name, strlen(name));
+        sb_putc(path, '/');
+        glob_walk(parts, num_parts, i, dir_only, path, out);
+        path->len = len;
+        path->data[len] = '\0';
+      }
+      continue;
+    }
+    if (last && !dir_only) {
+      sb_append(path, name, strlen(name));
+      argv_push(out, arena_strndup(&cmd_arena, path->data, path->len));
+    } else if (glob_is_dir(d, k, path, 1)) {
+      sb_append(path, name, strlen(name));
+      sb_putc(path, '/');
+      if (last) {
+        argv_push(out, arena_strndup(&cmd_arena, path->data, path->len));
+      } else {
+        glob_walk(parts, num_parts, i + 1, dir_only, path, out);
+      }
+    }
+    path->len = len;
+    path->data[len] = '\0';
+  }
+  glob_release(d);
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Whether a pattern can match anything but itself: an unescaped * or ?,
+// or a [ with a ] after it. A lone [ (the test command) is just a name.
+int glob_has_magic(const char *pattern) {
+  for (const char *s = pattern; *s != '\0'; s++) {
+    if (*s == '\\' && s[1] != '\0') {
+      s++;
+    } else if (*s == '*' || *s == '?' ||
+               (*s == '[' && strchr(s + 1, ']') != NULL)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Expand a glob pattern (quoted characters backslash-escaped) into sorted
+// matching paths appended to out. Without matches the word stays as it
+// was written, minus its quotes (literal).
+void glob_expand(const char *pattern, const char *literal, ArgVec *out) {
+  if (!glob_has_magic(pattern)) {
+    argv_push(out, arena_strndup(&cmd_arena, literal, strlen(literal)));
+    return;
+  }
+  StrBuf path = {.arena = &cmd_arena};
+  sb_append(&path, "", 0); // walks always have a string to extend
+  const char *s = pattern;
+  if (*s == '/') {
+    sb_putc(&path, '/');
+    while (*s == '/') {
+      s++;
+    }
+  }
+
+  // Split at unescaped slashes; a trailing slash matches directories only
+  int cap = 8;
+  int num_parts = 0;
+  GlobPart *parts = arena_alloc(&cmd_arena, cap * sizeof(GlobPart));
+  int dir_only = 0;
+  while (*s != '\0') {
+    const char *start = s;
+    while (*s != '\0' && *s != '/') {
+      s += (*s == '\\' && s[1] != '\0') ? 2 : 1;
+    }
+    if (num_parts == cap) {
+      GlobPart *grown = arena_alloc(&cmd_arena, cap * 2 * sizeof(GlobPart));
+      memcpy(grown, parts, cap * sizeof(GlobPart));
+      parts = grown;
+      cap *= 2;
+    }
+    glob_compile(start, s - start, &parts[num_parts++]);
+    while (*s == '/') {
+      s++;
+      dir_only = *s == '\0';
+    }
+  }
+
+  int first = out->argc;
+  if (num_parts > 0) {
+    glob_walk(parts, num_parts, 0, dir_only, &path, out);
+  }
+  if (out->argc == first) {
+    argv_push(out, arena_strndup(&cmd_arena, literal, strlen(literal)));
+    return;
+  }
+  qsort(out->argv + first, out->argc - first, sizeof(char *), compare_strings);
+}
+
+// Expand a command's words. Leading NAME=value assignments are not
+// globbed.
+void expand_args(Node *cmd, ArgVec *out) {
+  int assigning = 1;
+  for (int i = 0; i < cmd->num_words; i++) {
+    assigning = assigning && word_is_assignment(&cmd->words[i]);
+    expand_word_glob(&cmd->words[i], out, !assigning);
+  }
+}
+
+// The delimiter of a here-document: its word with quotes removed but
+// nothing expanded
+char *heredoc_delimiter(const Word *w) {
+  StrBuf sb = {.arena = &cmd_arena};
+  for (size_t i = 0; i < w->len; i++) {
+    char c = w->text[i];
+    if (c == '\\' && i + 1 < w->len) {
+      sb_putc(&sb, w->text[++i]);
+    } else if (c != '\'' && c != '"') {
+      sb_putc(&sb, c);
+    }
+  }
+  return sb_finish(&sb);
+}
+
+// Read the bodies of the here-documents parsed so far from the lines
+// after them, into the command arena. Input that ends before the delimiter ends the
+// body, as in other shells.
+void heredoc_read(Parser *p, InputSource *in) {
+  // At the terminal, a command that did not parse has no bodies to read
+  if (p->error != NULL && in->edit) {
+    p->heredocs = p->last_heredoc = NULL;
+    return;
+  }
+  for (Redir *r = p->heredocs; r != NULL; r = r->next_heredoc) {
+    char *delimiter = heredoc_delimiter(&r->target);
+    StrBuf body = {.arena = &cmd_arena};
+    while (1) {
+      if (interactive) {
+        print_prompt2();
+      }
+      char *line = input_read_line(in);
+      if (line == NULL && !in->eof) {
+        p->error = "interrupted"; // Ctrl+C: drop the command quietly
+        p->cancelled = 1;
+        return;
+      }
+      if (line == NULL) {
+        fprintf(stderr, COLOR_YELLOW "myshell: here-document ended by end of "
+                                     "input (wanted `%s')" COLOR_RESET "\n",
+                delimiter);
+        break;
+      }
+      if (r->strip_tabs) {
+        line += strspn(line, "\t");
+      }
+      if (strcmp(line, delimiter) == 0) {
+        break;
+      }
+      sb_append(&body, line, strlen(line));
+      sb_putc(&body, '\n');
+    }
+    r->body.text = sb_finish(&body);
+    r->body.len = body.len;
+  }
+  p->heredocs = p->last_heredoc = NULL;
+}
+
+// Expand a here-document body: $ references, command substitutions and
+// the backslash escapes
+// \$ \` \\ and \newline; quotes are ordinary characters
+void expand_heredoc(StrBuf *sb, const char *s, const char *end) {
+  while (s < end) {
+    const char *next;
+    if (*s == '$' && (next = expand_arith(s, end, sb)) != NULL) {
+      s = next;
+    } else if ((*s == '$' && s + 1 < end && s[1] == '(') || *s == '`') {
+      s = expand_subst(s, end, sb, NULL, NULL);
+    } else if (*s == '$') {
+      s = expand_dollar(s, end, sb);
+    } else if (*s == '\\' && s + 1 < end && strchr("$`\\\n", s[1]) != NULL) {
+      if (s[1] != '\n') {
+        sb_putc(sb, s[1]);
+      }
+      s += 2;
+    } else {
+      sb_putc(sb, *s++);
+    }
+  }
+}
+
+// Put the text of a here-document or here-string in an in-memory file
+// (see memfile_open), sealed against changes and rewound, so the command
+// reads it like a regular file
+int heredoc_open(Redir *r) {
+  StrBuf text = {.arena = &cmd_arena};
+  if (r->kind == REDIR_HERESTRING) {
+    char *word = expand_word_single(&r->target);
+    sb_append(&text, word, strlen(word));
+    sb_putc(&text, '\n');
+  } else if (r->body.flags & WORD_DOLLAR) {
+    expand_heredoc(&text, r->body.text, r->body.text + r->body.len);
+  } else {
+    sb_append(&text, r->body.text, r->body.len);
+  }
+
+  int fd = memfile_open("here-document");
+  if (fd < 0) {
+    return -1;
+  }
+  for (size_t done = 0; done < text.len;) {
+    ssize_t n = write(fd, text.data + done, text.len - done);
+    if (n < 0 && errno != EINTR) {
+      fprintf(stderr, COLOR_RED "myshell: here-document: %s" COLOR_RESET "\n",
+              strerror(errno));
+      close(fd);
+      return -1;
+    }
+    done += n > 0 ? (size_t)n : 0;
+  }
+#ifdef __linux__
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+                             F_SEAL_SEAL);
+#endif
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+// Open the files named by a command's redirections and turn every
+// redirection into a dup2/close action on spec, in source order. On error
+// the message is printed and -1 returned; the caller still releases spec.
+int redirect_prepare(Redir *redirs, LaunchSpec *spec) {
+  for (Redir *r = redirs; r != NULL; r = r->next) {
+    if (spec->num_fds >= LAUNCH_MAX_FDS) {
+      fprintf(stderr, COLOR_RED "myshell: too many redirections" COLOR_RESET "\n");
+      return -1;
+    }
+
+    if (r->kind == REDIR_HEREDOC || r->kind == REDIR_HERESTRING) {
+      int from = heredoc_open(r);
+      if (from < 0) {
+        return -1;
+      }
+      spec->opened[spec->num_opened++] = from;
+      launch_add_fd(spec, from, r->fd);
+      continue;
+    }
+
+    char *target = expand_word_single(&r->target);
+    int from = -1;
+
+    if (r->kind == REDIR_DUP_IN || r->kind == REDIR_DUP_OUT) {
+      char *endp;
+      if (strcmp(target, "-") != 0) {
+        from = (int)strtol(target, &endp, 10);
+        if (*target == '\0' || *endp != '\0' || from < 0) {
+          fprintf(stderr, COLOR_RED "myshell: %s: ambiguous redirect" COLOR_RESET "\n",
+                  target);
+          return -1;
+        }
+      }
+    } else {
+      int flags = O_CLOEXEC;
+      if (r->kind == REDIR_IN) {
+        flags |= O_RDONLY;
+      } else if (r->kind == REDIR_OUT) {
+        flags |= O_WRONLY | O_CREAT | O_TRUNC;
+      } else {
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+      }
+      from = open(target, flags, 0600);
+      if (from < 0) {
+        fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", target,
+                strerror(errno));
+        return -1;
+      }
+      spec->opened[spec->num_opened++] = from;
+    }
+    launch_add_fd(spec, from, r->fd);
+  }
+  return 0;
+}
+
+// Apply a spec's descriptor mappings to the shell itself (for builtins),
+// remembering what each target descriptor was so it can be put back
+int redirect_in_shell(LaunchSpec *spec, SavedFd *saved, int *num_saved) {
+  fflush(stdout);
+  *num_saved = 0;
+  for (int i = 0; i < spec->num_fds; i++) {
+    int to = spec->fds[i].to;
+    int already = 0;
+    for (int j = 0; j < *num_saved; j++) {
+      if (saved[j].fd == to) {
+        already = 1;
+      }
+    }
+    if (!already) {
+      saved[*num_saved].fd = to;
+      saved[*num_saved].saved = fcntl(to, F_DUPFD_CLOEXEC, 10);
+      (*num_saved)++;
+    }
+
+    if (spec->fds[i].from < 0) {
+      close(to);
+    } else if (spec->fds[i].from != to && dup2(spec->fds[i].from, to) < 0) {
+      fprintf(stderr, COLOR_RED "myshell: %d: %s" COLOR_RESET "\n",
+              spec->fds[i].from, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Undo redirect_in_shell
+void redirect_restore(SavedFd *saved, int num_saved) {
+  fflush(stdout);
+  for (int i = num_saved - 1; i >= 0; i--) {
+    if (saved[i].saved >= 0) {
+      dup2(saved[i].saved, saved[i].fd);
+      close(saved[i].saved);
+    } else {
+      close(saved[i].fd);
+    }
+  }
+}
+
+// Execute a simple command: functions and builtins run in the shell with
+// their redirections applied temporarily, everything else is spawned
+int execute_command(Node *cmd) {
+  ArgVec args = {.arena = &cmd_arena};
+  LaunchSpec spec = {0};
+  CommandPrefix prefix = {0};
+  StageTiming stage = {0};
+  struct rusage before;
+
+  // A pipesize prefix has nothing to apply to without pipes
+  subst_status = -1;
+  int prefix_words = command_prefix(cmd, &prefix);
+  if (prefix_words < 0) {
+    return last_status = 2;
+  }
+  long long start_us = prefix.time ? monotonic_us() : 0;
+  expand_args(cmd, &args);
+  argv_shift(&args, prefix_words);
+  take_assignments(cmd, prefix_words, &args, &spec);
+  spec.limits = prefix_limits(&prefix);
+  Function *func = args.argc > 0 ? func_find(args.argv[0]) : NULL;
+  Builtin *builtin =
+      args.argc > 0 && func == NULL ? builtin_lookup(args.argv) : NULL;
+  stage.pid = -1;
+  stats.commands++;
+  if (redirect_prepare(cmd->redirs, &spec) < 0) {
+    launch_release(&spec);
+    last_status = 1;
+  } else if (args.argc == 0 && spec.num_env > 0) {
+    // NAME=value with no command sets shell variables; NAME=$(cmd) has
+    // the status of cmd
+    int substituted = subst_status;
+    launch_release(&spec);
+    last_status = assign_all(spec.env, spec.num_env, 0);
+    if (last_status == 0 && substituted >= 0) {
+      last_status = substituted;
+    }
+  } else if (args.argc == 0) {
+    // Only redirections: the files have been created/opened, nothing to run
+    launch_release(&spec);
+    last_status = 0;
+  } else if ((builtin != NULL || func != NULL) && spec.limits == NULL) {
+    SavedFd saved[LAUNCH_MAX_FDS];
+    int num_saved = 0;
+    spec.argv = args.argv;
+    if (prefix.time) {
+      time_shell_begin(&stage, args.argv[0], &before);
+    }
+    VarSaved *old = var_save(spec.env, spec.num_env);
+    if (assign_all(spec.env, spec.num_env, VAR_EXPORT) != 0) {
+      launch_release(&spec);
+      last_status = 1;
+    } else if (redirect_in_shell(&spec, saved, &num_saved) == 0) {
+      launch_release(&spec);
+      last_status = func != NULL ? func_call(func, args.argv)
+                                 : builtin_run(builtin, args.argv);
+    } else {
+      launch_release(&spec);
+      last_status = 1;
+    }
+    redirect_restore(saved, num_saved);
+    var_restore(old, spec.num_env, spec.env);
+    if (prefix.time) {
+      time_shell_end(&stage, &before);
+    }
+  } else {
+    // A builtin or function with pin, nice, limit or ionice runs in a
+    // child so the settings do not stick to the shell
+    spec.argv = args.argv;
+    spec.builtin = builtin != NULL || func != NULL;
+    stage.start_us = monotonic_us();
+    stage.pid = spec.builtin ? launch_command(&spec) : launch_external(&spec);
+    stage.name = args.argv[0];
+    launch_release(&spec);
+    if (stage.pid >= 0 && prefix.time) {
+      wait_for_stages(&stage, 1);
+    } else if (stage.pid >= 0) {
+      wait_for_child(stage.pid);
+      report_exit_status();
+    }
+  }
+
+  if (prefix.time) {
+    time_report(&stage, stage.pid < 0 ? 0 : 1, start_us, prefix.time, NULL);
+  }
+  argv_free(&args);
+  return last_status;
+}
+
+// Whether a word is exactly the given unquoted literal
+int word_is(const Word *w, const char *literal) {
+  return w->flags == 0 && w->len == strlen(literal) &&
+         memcmp(w->text, literal, w->len) == 0;
+}
+
+// Resource limits the limit prefix knows, by key
+typedef struct {
+  const char *name;
+  int resource;
+  int is_size; // shown with K, M or G
+} RlimitName;
+
+RlimitName rlimit_names[] = {
+    {"core", RLIMIT_CORE, 1},     {"cpu", RLIMIT_CPU, 0},
+    {"fsize", RLIMIT_FSIZE, 1},   {"mem", RLIMIT_AS, 1},
+    {"nofile", RLIMIT_NOFILE, 0}, {"nproc", RLIMIT_NPROC, 0},
+    {"stack", RLIMIT_STACK, 1},
+};
+
+#define NUM_RLIMIT_NAMES (int)(sizeof(rlimit_names) / sizeof(rlimit_names[0]))
+
+// Parse a whole decimal number within [min, max]
+int parse_number(const char *text, long min, long max, long *value) {
+  char *end;
+  errno = 0;
+  long n = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || n < min || n > max) {
+    return -1;
+  }
+  *value = n;
+  return 0;
+}
+
+// Parse a CPU list such as 0-3,8,10-11, or all for every online CPU
+int parse_cpuset(const char *text, ProcLimits *limits) {
+  memset(limits->cpus, 0, sizeof(limits->cpus));
+  limits->num_cpus = 0;
+  if (strcmp(text, "all") == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < online && cpu < LIMITS_MAX_CPUS; cpu++) {
+      limits->cpus[cpu / 8] |= 1 << (cpu % 8);
+      limits->num_cpus++;
+    }
+    return limits->num_cpus > 0 ? 0 : -1;
+  }
+  const char *p = text;
+  while (1) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return -1;
+      }
+    }
+    if (last >= LIMITS_MAX_CPUS) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (!(limits->cpus[cpu / 8] & (1 << (cpu % 8)))) {
+        limits->cpus[cpu / 8] |= 1 << (cpu % 8);
+        limits->num_cpus++;
+      }
+    }
+    if (*end == '\0') {
+      return 0;
+    }
+    if (*end != ',') {
+      return -1;
+    }
+    p = end + 1;
+  }
+}
+
+// Parse limit settings such as mem=1G,cpu=60,nofile=256. Values take K, M
+// and G suffixes (cpu is in seconds) or "unlimited"; a repeated key
+// replaces the earlier value. Returns -1 after reporting a bad setting.
+int parse_rlimits(char *text, ProcLimits *limits) {
+  for (char *item = strtok(text, ","); item != NULL;
+       item = strtok(NULL, ",")) {
+    char *eq = strchr(item, '=');
+    int k = 0;
+    while (eq != NULL && k < NUM_RLIMIT_NAMES &&
+           (strncmp(item, rlimit_names[k].name, eq - item) != 0 ||
+            rlimit_names[k].name[eq - item] != '\0')) {
+      k++;
+    }
+    long value = 0;
+    if (eq == NULL || k == NUM_RLIMIT_NAMES ||
+        (strcmp(eq + 1, "unlimited") != 0 && parse_size(eq + 1, &value) < 0)) {
+      fprintf(stderr, COLOR_RED "limit: %s: expected one of core, cpu, "
+              "fsize, mem, nofile, nproc or stack =VALUE" COLOR_RESET "\n",
+              item);
+      return -1;
+    }
+    int i = 0;
+    while (i < limits->num_rlimits &&
+           limits->rlimits[i].resource != rlimit_names[k].resource) {
+      i++;
+    }
+    limits->rlimits[i].resource = rlimit_names[k].resource;
+    limits->rlimits[i].value =
+        strcmp(eq + 1, "unlimited") == 0 ? RLIM_INFINITY : (rlim_t)value;
+    if (i == limits->num_rlimits) {
+      limits->num_rlimits++;
+    }
+  }
+  return 0;
+}
+
+// Parse an ionice class with an optional level: idle, best-effort[:N] or
+// realtime[:N] (also be, rt, or the numbers 3, 2 and 1)
+int parse_ionice(const char *text, ProcLimits *limits) {
+  static const char *classes[][3] = {{"realtime", "rt", "1"},
+                                     {"best-effort", "be", "2"},
+                                     {"idle", "idle", "3"}};
+  size_t len = strcspn(text, ":");
+  for (int c = 0; c < 3; c++) {
+    for (int alias = 0; alias < 3; alias++) {
+      if (strlen(classes[c][alias]) != len ||
+          strncmp(text, classes[c][alias], len) != 0) {
+        continue;
+      }
+      long level = 4; // the kernel's default for best-effort
+      if (text[len] == ':' &&
+          (c == 2 || parse_number(text + len + 1, 0, 7, &level) < 0)) {
+        return -1;
+      }
+      limits->io_class = c + 1;
+      limits->io_level = c == 2 ? 0 : level;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Render limits for the jobs listing, e.g. "cpus 0-3 spread, nice 5"
+void limits_describe(const ProcLimits *limits, char *buf, size_t size) {
+  static const char *io_classes[] = {"", "realtime", "best-effort", "idle"};
+  StrBuf sb = {0};
+  char item[64];
+  if (limits->flags & LIMITS_PIN) {
+    sb_append(&sb, "cpus ", 5);
+    int first = 1;
+    for (int cpu = 0; cpu < LIMITS_MAX_CPUS; cpu++) {
+      if (!(limits->cpus[cpu / 8] & (1 << (cpu % 8)))) {
+        continue;
+      }
+      int last = cpu;
+      while (last + 1 < LIMITS_MAX_CPUS &&
+             (limits->cpus[(last + 1) / 8] & (1 << ((last + 1) % 8)))) {
+        last++;
+      }
+      snprintf(item, sizeof(item), last > cpu ? "%s%d-%d" : "%s%d",
+               first ? "" : ",", cpu, last);
+      sb_append(&sb, item, strlen(item));
+      first = 0;
+      cpu = last;
+    }
+    if (limits->flags & LIMITS_SPREAD) {
+      sb_append(&sb, " spread", 7);
+    }
+  }
+  if (limits->flags & LIMITS_NICE) {
+    snprintf(item, sizeof(item), "%snice %d", sb.len ? ", " : "",
+             limits->nice);
+    sb_append(&sb, item, strlen(item));
+  }
+  if (limits->flags & LIMITS_IONICE) {
+    snprintf(item, sizeof(item), "%sio %s", sb.len ? ", " : "",
+             io_classes[limits->io_class]);
+    sb_append(&sb, item, strlen(item));
+    if (limits->io_class != 3) {
+      snprintf(item, sizeof(item), ":%d", limits->io_level);
+      sb_append(&sb, item, strlen(item));
+    }
+  }
+  for (int i = 0; i < limits->num_rlimits; i++) {
+    const RlimitSetting *r = &limits->rlimits[i];
+    int k = 0;
+    while (rlimit_names[k].resource != r->resource) {
+      k++;
+    }
+    unsigned long long value = r->value;
+    int unit = 0; // index into " KMG"
+    while (rlimit_names[k].is_size && r->value != RLIM_INFINITY && unit < 3 &&
+           value >= 1024 && value % 1024 == 0) {
+      value /= 1024;
+      unit++;
+    }
+    if (r->value == RLIM_INFINITY) {
+      snprintf(item, sizeof(item), "%s%s=unlimited", sb.len ? ", " : "",
+               rlimit_names[k].name);
+    } else {
+      snprintf(item, sizeof(item), "%s%s=%llu%.*s", sb.len ? ", " : "",
+               rlimit_names[k].name, value, unit > 0, &" KMG"[unit]);
+    }
+    sb_append(&sb, item, strlen(item));
+  }
+  snprintf(buf, size, "%s", sb.len ? sb.data : "");
+  free(sb.data);
+}
+
+// Recognise the prefixes in front of a command or pipeline, in any order:
+// `time [-j]`, `pipesize SIZE`, `pin [-s] CPUSET`, `nice [-n] N`,
+// `limit key=value,...` and `ionice CLASS[:LEVEL]`. nice and ionice only
+// count with an argument they understand, so nice(1) and ionice(1) still
+// run otherwise. Returns the number of words they take up, or -1 after
+// reporting a bad argument.
+int command_prefix(Node *cmd, CommandPrefix *prefix) {
+  int n = 0;
+  ProcLimits *limits = &prefix->limits;
+  prefix->pipe_size = pipe_size;
+  prefix->time = 0;
+  memset(limits, 0, sizeof(*limits));
+  if (cmd->kind != NODE_COMMAND) {
+    return 0;
+  }
+  while (n < cmd->num_words) {
+    Word *words = cmd->words + n;
+    int left = cmd->num_words - n;
+    if (!prefix->time && word_is(&words[0], "time")) {
+      prefix->time = TIME_TEXT;
+      n++;
+      if (n < cmd->num_words && word_is(&cmd->words[n], "-j")) {
+        prefix->time = TIME_JSON;
+        n++;
+      }
+    } else if (left > 1 && word_is(&words[0], "pipesize")) {
+      char *text = expand_word_single(&words[1]);
+      int ok = parse_size(text, &prefix->pipe_size) == 0;
+      if (!ok) {
+        fprintf(stderr, COLOR_RED "pipesize: %s: invalid size" COLOR_RESET
+                        "\n",
+                text);
+      }
+      if (!ok) {
+        return -1;
+      }
+      n += 2;
+    } else if (left > 1 && word_is(&words[0], "pin")) {
+      int spread = left > 2 && word_is(&words[1], "-s");
+      char *text = expand_word_single(&words[1 + spread]);
+#ifdef __linux__
+      if (parse_cpuset(text, limits) < 0) {
+        fprintf(stderr, COLOR_RED "pin: %s: invalid CPU set" COLOR_RESET
+                "\n", text);
+        return -1;
+      }
+#else
+      fprintf(stderr, COLOR_RED "pin: not supported on this system"
+              COLOR_RESET "\n");
+      return -1;
+#endif
+      limits->flags |= LIMITS_PIN | (spread ? LIMITS_SPREAD : 0);
+      n += 2 + spread;
+    } else if (left > 1 && word_is(&words[0], "nice")) {
+      int dash_n = left > 2 && word_is(&words[1], "-n");
+      long value;
+      if (parse_number(expand_word_single(&words[1 + dash_n]), -39, 39,
+                       &value) < 0) {
+        break;
+      }
+      limits->flags |= LIMITS_NICE;
+      limits->nice = value;
+      n += 2 + dash_n;
+    } else if (left > 1 && word_is(&words[0], "ionice")) {
+#ifdef __linux__
+      if (parse_ionice(expand_word_single(&words[1]), limits) < 0) {
+        break;
+      }
+      limits->flags |= LIMITS_IONICE;
+      n += 2;
+#else
+      break;
+#endif
+    } else if (left > 1 && word_is(&words[0], "limit")) {
+      if (parse_rlimits(expand_word_single(&words[1]), limits) < 0) {
+        return -1;
+      }
+      n += 2;
+    } else {
+      break;
+    }
+  }
+  return n;
+}
+
+// The limits a prefix asked for, or NULL if there are none
+const ProcLimits *prefix_limits(const CommandPrefix *prefix) {
+  const ProcLimits *limits = &prefix->limits;
+  return limits->flags != 0 || limits->num_rlimits > 0 ? limits : NULL;
+}
+
+// Drop the first n arguments
+void argv_shift(ArgVec *v, int n) {
+  if (n <= 0) {
+    return;
+  }
+  for (int i = 0; i < n && v->arena == NULL; i++) {
+    free(v->argv[i]);
+  }
+  memmove(v->argv, v->argv + n, (v->argc - n + 1) * sizeof(char *));
+  v->argc -= n;
+}
+
+#ifdef __linux__
+// Close one relayed pipe on both sides
+void pipe_edge_close(PipeEdge *edge, long long now) {
+  if (edge->stall_since_us != 0) {
+    edge->stalled_us += now - edge->stall_since_us;
+    edge->stall_since_us = 0;
+  }
+  close(edge->from);
+  close(edge->to);
+  edge->from = edge->to = -1;
+  edge->closed_us = now;
+}
+
+// Move data across every relayed pipe until all are closed. Time an edge
+// spends with data in hand but its consumer's pipe full counts as stalled.
+void pipe_relay(PipeEdge *edges, int num_edges) {
+  struct pollfd *fds = arena_alloc(&cmd_arena,
+                                   num_edges * sizeof(struct pollfd));
+  int open_edges = 0;
+  for (int i = 0; i < num_edges; i++) {
+    if (edges[i].from >= 0) {
+      fcntl(edges[i].from, F_SETFL, O_NONBLOCK);
+      fcntl(edges[i].to, F_SETFL, O_NONBLOCK);
+      open_edges++;
+    }
+  }
+
+  while (open_edges > 0) {
+    for (int i = 0; i < num_edges; i++) {
+      PipeEdge *edge = &edges[i];
+      fds[i].revents = 0;
+      if (edge->from < 0) {
+        fds[i].fd = -1;
+      } else if (edge->stall_since_us != 0) {
+        fds[i].fd = edge->to;
+        fds[i].events = POLLOUT;
+      } else {
+        fds[i].fd = edge->from;
+        fds[i].events = POLLIN;
+      }
+    }
+    if (poll(fds, num_edges, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    for (int i = 0; i < num_edges; i++) {
+      PipeEdge *edge = &edges[i];
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      long long now = monotonic_us();
+      if (fds[i].fd == edge->to && (fds[i].revents & (POLLERR | POLLHUP))) {
+        pipe_edge_close(edge, now); // consumer is gone
+        open_edges--;
+        continue;
+      }
+      ssize_t n = splice(edge->from, NULL, edge->to, NULL, 1 << 20,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        edge->bytes += n;
+        if (edge->stall_since_us != 0) {
+          edge->stalled_us += now - edge->stall_since_us;
+          edge->stall_since_us = 0;
+        }
+      } else if (n < 0 && errno == EAGAIN) {
+        if (edge->stall_since_us == 0) {
+          edge->stall_since_us = now; // readable input, so the output is full
+        }
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else {
+        pipe_edge_close(edge, now); // end of input, or consumer gone
+        open_edges--;
+      }
+    }
+  }
+}
+
+// Print what each relayed pipe carried, to stderr
+void pipe_report(PipeEdge *edges, char **names, int num_edges,
+                 long long started) {
+  for (int i = 0; i < num_edges; i++) {
+    PipeEdge *edge = &edges[i];
+    if (edge->closed_us == 0) {
+      continue;
+    }
+    double secs = (edge->closed_us - started) / 1e6;
+    fprintf(stderr,
+            "pipe %d (%s -> %s): %llu bytes in %.3fs (%.1f MB/s), "
+            "stalled %.3fs\n",
+            i + 1, names[i] ? names[i] : "?", names[i + 1] ? names[i + 1] : "?",
+            edge->bytes, secs, secs > 0 ? edge->bytes / secs / 1e6 : 0.0,
+            edge->stalled_us / 1e6);
+  }
+}
+#endif
+
+// Start timing a stage that runs inside the shell
+void time_shell_begin(StageTiming *stage, const char *name,
+                      struct rusage *before) {
+  stage->pid = 0;
+  stage->name = (char *)name;
+  stage->start_us = monotonic_us();
+  getrusage(RUSAGE_SELF, before);
+}
+
+// Charge the shell's own usage since time_shell_begin to the stage
+void time_shell_end(StageTiming *stage, struct rusage *before) {
+  struct rusage after;
+  getrusage(RUSAGE_SELF, &after);
+  stage->end_us = monotonic_us();
+  timersub(&after.ru_utime, &before->ru_utime, &stage->usage.ru_utime);
+  timersub(&after.ru_stime, &before->ru_stime, &stage->usage.ru_stime);
+  stage->usage.ru_maxrss = after.ru_maxrss;
+  stage->usage.ru_nvcsw = after.ru_nvcsw - before->ru_nvcsw;
+  stage->usage.ru_nivcsw = after.ru_nivcsw - before->ru_nivcsw;
+}
+
+// Wait for the children of a timed command with wait4, in whatever order
+// they exit, so each stage gets its own end time and rusage. Other
+// children reaped meanwhile are handed to the job table. The last stage
+// sets last_status.
+void wait_for_stages(StageTiming *stages, int num_stages) {
+  int left = 0;
+  for (int i = 0; i < num_stages; i++) {
+    int status;
+    if (stages[i].pid > 0 && reaped_fg_take(stages[i].pid, &status)) {
+      stages[i].end_us = monotonic_us(); // reaped earlier; no rusage
+      if (i == num_stages - 1) {
+        last_status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                        : 128 + WTERMSIG(status);
+      }
+    } else if (stages[i].pid > 0) {
+      left++;
+    }
+  }
+
+  long long start_us = monotonic_us();
+  trace_flush();
+  while (left > 0) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    int i = 0;
+    while (i < num_stages && stages[i].pid != pid) {
+      i++;
+    }
+    if (i == num_stages) {
+      if (job_proc_exited(pid, status)) {
+        jobs_dispatch();
+      } else {
+        reaped_fg_add(pid, status);
+      }
+      continue;
+    }
+    stages[i].end_us = monotonic_us();
+    stages[i].usage = usage;
+    left--;
+    hist_add(&stats.wait, stages[i].end_us - start_us);
+    trace_emit(&(TraceEvent){.event = "wait", .start_us = start_us,
+                             .dur_us = stages[i].end_us - start_us,
+                             .pid = pid, .key = "status",
+                             .value = WIFEXITED(status)
+                                          ? WEXITSTATUS(status)
+                                          : 128 + WTERMSIG(status)});
+    if (i == num_stages - 1) {
+      last_status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                      : 128 + WTERMSIG(status);
+    }
+  }
+}
+
+// Max RSS in kilobytes (macOS reports bytes)
+long rusage_maxrss_kb(const struct rusage *usage) {
+#ifdef __APPLE__
+  return usage->ru_maxrss / 1024;
+#else
+  return usage->ru_maxrss;
+#endif
+}
+
+// Wall time of one timed stage; a stage that never started has none
+double stage_real(const StageTiming *stage) {
+  return stage->pid < 0 ? 0 : (stage->end_us - stage->start_us) / 1e6;
+}
+
+// Print a timed command's resource use to stderr: a table with one row
+// per pipeline stage and a total labelled with command (the pipeline
+// text), or one JSON object for time -j
+void time_report(StageTiming *stages, int num_stages, long long start_us,
+                 int format, const char *command) {
+  double real = (monotonic_us() - start_us) / 1e6;
+  double user = 0;
+  double sys = 0;
+  long maxrss = 0;
+  long vcsw = 0;
+  long ivcsw = 0;
+  for (int i = 0; i < num_stages; i++) {
+    struct rusage *u = &stages[i].usage;
+    user += u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6;
+    sys += u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6;
+    if (rusage_maxrss_kb(u) > maxrss) {
+      maxrss = rusage_maxrss_kb(u);
+    }
+    vcsw += u->ru_nvcsw;
+    ivcsw += u->ru_nivcsw;
+  }
+
+  if (format == TIME_JSON) {
+    fprintf(stderr,
+            "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+            "\"vcsw\":%ld,\"ivcsw\":%ld,\"status\":%d,\"stages\":[",
+            real, user, sys, maxrss, vcsw, ivcsw, last_status);
+    for (int i = 0; i < num_stages; i++) {
+      struct rusage *u = &stages[i].usage;
+      fprintf(stderr, "%s{\"command\":", i > 0 ? "," : "");
+      json_write_string(stderr, stages[i].name ? stages[i].name : "");
+      fprintf(stderr,
+              ",\"pid\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+              "\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld}",
+              (int)stages[i].pid, stage_real(&stages[i]),
+              u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6,
+              u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6,
+              rusage_maxrss_kb(u), u->ru_nvcsw, u->ru_nivcsw);
+    }
+    fprintf(stderr, "]}\n");
+    return;
+  }
+
+  fprintf(stderr, "%-7s %9s %9s %9s %10s %7s %7s  %s\n", "stage", "real",
+          "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+  for (int i = 0; i < num_stages && num_stages > 1; i++) {
+    struct rusage *u = &stages[i].usage;
+    fprintf(stderr, "%-7d %8.3fs %8.3fs %8.3fs %8ldKB %7ld %7ld  %s%s\n", i + 1,
+            stage_real(&stages[i]),
+            u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6,
+            u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6,
+            rusage_maxrss_kb(u), u->ru_nvcsw, u->ru_nivcsw,
+            stages[i].name ? stages[i].name : "?",
+            stages[i].pid == 0 ? " (in shell)" : "");
+  }
+  fprintf(stderr, "%-7s %8.3fs %8.3fs %8.3fs %8ldKB %7ld %7ld  %s\n", "total",
+          real, user, sys, maxrss, vcsw, ivcsw,
+          command != NULL                    ? command
+          : num_stages == 1 && stages[0].name ? stages[0].name
+                                              : "");
+}
+
+// Write s as a JSON string literal
+void json_write_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(f, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+  fputc('"', f);
+}
+
+// Execute a pipeline of commands. Pipes are created one stage at a time
+// so the shell never holds more than two pipe ends open. Builtin stages run
+// in forked children, except that a first stage which only produces data
+// (echo, cat, ...) runs in the shell itself after the others are started,
+// unless it would read the terminal.
+// Pipes get the pipesize capacity; with pipestats on, every pipe is split
+// in two and the shell relays between them, measuring each edge.
+// For a background job every stage is a child in the job's process group
+// and nothing is waited for (or timed, or relayed).
+int execute_single_pipeline(Node *pipeline, Job *job) {
+  int num_commands = pipeline->num_children;
+  pid_t *pids = arena_alloc(&cmd_arena, num_commands * sizeof(pid_t));
+  int prev_read = -1;
+  ArgVec first_args = {0}; // deferred first stage
+  LaunchSpec first = {0};
+  int first_write = -1;
+  CommandPrefix prefix;
+  StageTiming *timing = NULL;
+  int relay = 0;
+  PipeEdge *edges = NULL;
+  char **names = NULL;
+  long long started = monotonic_us();
+
+  int prefix_words = command_prefix(pipeline->children[0], &prefix);
+  if (prefix_words < 0) {
+    return last_status = 2;
+  }
+  long size = prefix.pipe_size;
+  if (prefix.time && job == NULL) {
+    timing = arena_alloc(&cmd_arena, num_commands * sizeof(StageTiming));
+    memset(timing, 0, num_commands * sizeof(StageTiming));
+  }
+#ifdef __linux__
+  relay = pipe_stats != 0 && job == NULL;
+#endif
+  if (relay) {
+    edges = arena_alloc(&cmd_arena, num_commands * sizeof(PipeEdge));
+    names = arena_alloc(&cmd_arena, num_commands * sizeof(char *));
+    memset(edges, 0, num_commands * sizeof(PipeEdge));
+    for (int i = 0; i < num_commands; i++) {
+      edges[i].from = edges[i].to = -1;
+      names[i] = NULL;
+    }
+  }
+  for (int i = 0; i < num_commands; i++) {
+    pids[i] = -1;
+    if (timing != NULL) {
+      timing[i].pid = -1;
+    }
+  }
+
+  for (int i = 0; i < num_commands; i++) {
+    Node *stage = pipeline->children[i];
+    int pipe_fds[2] = {-1, -1};
+    ArgVec args = {.arena = &cmd_arena};
+    LaunchSpec spec = {0};
+
+    if (stage->kind == NODE_COMMAND) {
+      expand_args(stage, &args);
+      if (i == 0) {
+        argv_shift(&args, prefix_words);
+      }
+      take_assignments(stage, i == 0 ? prefix_words : 0, &args, &spec);
+    } else {
+      // A compound stage runs in a forked shell, named for the listings
+      // by its first word
+      size_t n = 0;
+      while (n < stage->text_len && strchr(" \t\n", stage->text[n]) == NULL) {
+        n++;
+      }
+      argv_push(&args, arena_strndup(&cmd_arena, stage->text, n));
+      spec.subshell = stage;
+    }
+    spec.limits = prefix_limits(&prefix);
+    spec.stage = i;
+    if (job != NULL) {
+      spec.pgid = job->pgid != 0 ? job->pgid : -1;
+    }
+    stats.commands++;
+
+    if (i < num_commands - 1) {
+      if (make_pipe(pipe_fds) < 0) {
+        perror("pipe");
+        argv_free(&args);
+        break;
+      }
+      pipe_set_size(pipe_fds[1], size);
+      int down[2];
+      if (relay && make_pipe(down) == 0) {
+        // The stage writes into pipe_fds; the shell passes it on to the
+        // next stage through down
+        pipe_set_size(down[1], size);
+        edges[i].from = pipe_fds[0];
+        edges[i].to = down[1];
+        pipe_fds[0] = down[0];
+      }
+    }
+
+    // Read from previous pipe (if not first command)
+    if (prev_read >= 0) {
+      launch_add_fd(&spec, prev_read, STDIN_FILENO);
+    }
+
+    // Write to next pipe (if not last command)
+    if (pipe_fds[1] >= 0) {
+      launch_add_fd(&spec, pipe_fds[1], STDOUT_FILENO);
+    }
+
+    // Stage redirections are applied after the pipe wiring (by the
+    // subshell itself for a compound stage)
+    if ((spec.subshell != NULL ||
+         redirect_prepare(stage->redirs, &spec) == 0) && args.argc > 0) {
+      spec.argv = args.argv;
+      if (relay) {
+        names[i] = args.argv[0];
+      }
+      if (timing != NULL) {
+        timing[i].name = args.argv[0];
+        timing[i].start_us = monotonic_us();
+      }
+      if (i == 0 && num_commands > 1 && !relay && job == NULL &&
+          spec.limits == NULL && spec.subshell == NULL &&
+          func_find(args.argv[0]) == NULL && is_data_mover(args.argv) &&
+          !mover_reads_terminal(args.argv, &spec)) {
+        first = spec;
+        first_args = args;
+        first_write = pipe_fds[1];
+        pids[0] = 0;
+        prev_read = pipe_fds[0];
+        continue;
+      }
+      spec.builtin = spec.subshell != NULL || is_builtin(args.argv) ||
+                     is_data_mover(args.argv);
+      pids[i] = spec.builtin ? launch_command(&spec) : launch_external(&spec);
+      if (pids[i] < 0 && spec.builtin) {
+        perror("fork");
+      } else if (pids[i] > 0 && job != NULL) {
+        job_add_proc(job, pids[i]);
+      }
+    }
+    launch_release(&spec);
+    argv_free(&args);
+
+    if (prev_read >= 0) {
+      close(prev_read);
+    }
+    if (pipe_fds[1] >= 0) {
+      close(pipe_fds[1]);
+    }
+    prev_read = pipe_fds[0];
+  }
+  if (prev_read >= 0) {
+    close(prev_read);
+  }
+  if (job != NULL) {
+    if (pids[num_commands - 1] < 0 && job->num_procs > 0) {
+      job_add_failed(job, 127);
+    }
+    return last_status;
+  }
+
+  // Run the deferred first stage now that its readers exist. SIGPIPE is
+  // ignored meanwhile so a reader that quits early ends it with EPIPE
+  // instead of killing the shell.
+  if (first_write >= 0) {
+    SavedFd saved[LAUNCH_MAX_FDS];
+    int num_saved;
+    struct rusage before;
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    if (timing != NULL) {
+      time_shell_begin(&timing[0], timing[0].name, &before);
+    }
+    if (redirect_in_shell(&first, saved, &num_saved) == 0) {
+      launch_release(&first);
+      execute_builtin(first_args.argv);
+    }
+    launch_release(&first);
+    redirect_restore(saved, num_saved);
+    if (timing != NULL) {
+      time_shell_end(&timing[0], &before);
+    }
+    clearerr(stdout);
+    signal(SIGPIPE, old_sigpipe);
+    close(first_write);
+    argv_free(&first_args);
+  }
+
+#ifdef __linux__
+  if (relay) {
+    pipe_relay(edges, num_commands - 1);
+  }
+#endif
+
+  // Wait for all children to finish; the last stage sets the status
+  if (timing != NULL) {
+    for (int i = 0; i < num_commands; i++) {
+      timing[i].pid = pids[i];
+    }
+    wait_for_stages(timing, num_commands);
+  } else {
+    for (int i = 0; i < num_commands; i++) {
+      if (pids[i] > 0) {
+        wait_for_child(pids[i]);
+      }
+    }
+  }
+  if (pids[num_commands - 1] < 0) {
+    last_status = 127;
+  }
+  if (timing != NULL) {
+    time_report(timing, num_commands, started, prefix.time,
+                arena_strndup(&cmd_arena, pipeline->text, pipeline->text_len));
+  }
+
+#ifdef __linux__
+  if (relay) {
+    pipe_report(edges, names, num_commands - 1, started);
+  }
+#endif
+  return last_status;
+}
+
+// Run a command with & as a job whose processes share a process group:
+// the stages of a pipeline, or one forked shell for a list. While every
+// job slot is busy a simple external command is queued as its expanded
+// argv; anything else is forked at once as a whole, so it sees the shell
+// as it is now, and held at a gate until jobs_dispatch gives it a slot.
+void execute_background(Node *node) {
+  JobTable *t = &job_table;
+  ArgVec args = {.arena = &cmd_arena};
+  LaunchSpec spec = {0};
+  CommandPrefix prefix;
+  Redir *redirs = NULL;
+  char *subshell_argv[] = {"(...)", NULL};
+  int queue =
+      t->queue_head != NULL || (job_slots > 0 && t->running >= job_slots);
+  if (node->kind == NODE_COMMAND) {
+    int prefix_words = command_prefix(node, &prefix);
+    if (prefix_words < 0) {
+      last_status = 2;
+      return;
+    }
+    expand_args(node, &args);
+    argv_shift(&args, prefix_words);
+    take_assignments(node, prefix_words, &args, &spec);
+    spec.limits = prefix_limits(&prefix);
+    if (args.argc == 0) {
+      last_status = assign_all(spec.env, spec.num_env, 0);
+      argv_free(&args);
+      return;
+    }
+    spec.builtin = is_builtin(args.argv);
+    if (!spec.builtin && node->redirs == NULL) {
+      execute_external_background(args.argv, spec.env, spec.limits,
+                                  node->text, node->text_len);
+      argv_free(&args);
+      return;
+    }
+    spec.argv = args.argv;
+    redirs = node->redirs;
+  } else if (node->kind != NODE_PIPELINE || queue) {
+    spec.argv = subshell_argv;
+    spec.builtin = 1;
+    spec.subshell = node->kind == NODE_SUBSHELL ? node->left : node;
+    redirs = node->kind == NODE_SUBSHELL ? node->redirs : NULL;
+  }
+
+  int gate[2] = {0, 0};
+  Job *job = job_create(node->text, node->text_len);
+  last_status = 1;
+  trace.job = job->id;
+  if (node->kind == NODE_PIPELINE && !queue) {
+    execute_single_pipeline(node, job);
+  } else if (redirect_prepare(redirs, &spec) == 0 &&
+             (!queue || make_pipe(gate) == 0)) {
+    spec.pgid = -1;
+    spec.gate = gate[0];
+    spec.gate_owner = getpid();
+    pid_t pid = spec.builtin ? launch_command(&spec) : launch_external(&spec);
+    if (gate[0] > 0) {
+      close(gate[0]); // the child's end
+    }
+    if (pid >= 0) {
+      job_add_proc(job, pid);
+    } else if (spec.builtin) {
+      perror("fork");
+    }
+  }
+  launch_release(&spec);
+  trace.job = 0;
+  argv_free(&args);
+
+  if (job->num_procs == 0) {
+    if (gate[1] > 0) {
+      close(gate[1]);
+    }
+    job_remove(job); // nothing started; the error has been reported
+    return;
+  }
+  if (queue) {
+    job->gate = gate[1];
+    job_enqueue(job);
+    if (interactive) {
+      printf("[%d] queued\n", job->id);
+    }
+  } else {
+    job_running(job);
+    if (interactive) {
+      printf("[%d] %d\n", job->id, last_bg_pid);
+    }
+  }
+  last_status = 0;
+}
+
+// Whether the rest of a list is skipped: exit in a --serve request, or a
+// break, continue or return on its way out
+int unwinding(void) {
+  return pending_exit >= 0 || breaking || continuing || returning;
+}
+
+// After each pass of a loop: whether the loop ends here. break N and
+// continue N are used up one loop at a time; Ctrl+C leaves every loop.
+int loop_done(void) {
+  if (interrupted) {
+    breaking = loop_depth;
+    continuing = 0;
+    last_status = 130;
+  }
+  if (breaking > 0) {
+    breaking--;
+    return 1;
+  }
+  if (continuing > 0) {
+    return --continuing > 0;
+  }
+  return pending_exit >= 0 || returning;
+}
+
+// if: the body of the first condition that succeeds, else the else part
+int execute_if(Node *node) {
+  int i;
+  for (i = 0; i + 1 < node->num_children; i += 2) {
+    int cond = execute_node(node->children[i]);
+    if (unwinding()) {
+      return last_status;
+    }
+    if (cond == 0) {
+      return execute_node(node->children[i + 1]);
+    }
+  }
+  if (i < node->num_children) {
+    return execute_node(node->children[i]);
+  }
+  return last_status = 0;
+}
+
+// while and until. The tree is parsed once; each pass only expands and
+// runs it, and gives back the arena space the pass used.
+int execute_while(Node *node) {
+  int status = 0;
+  if (loop_depth++ == 0) {
+    interrupted = 0;
+  }
+  while (1) {
+    ArenaMark mark = arena_mark(&cmd_arena);
+    int cond = execute_node(node->left);
+    if (!unwinding() && (cond == 0) == (node->kind == NODE_WHILE)) {
+      status = execute_node(node->right);
+    } else if (!unwinding()) {
+      arena_rewind(&cmd_arena, mark);
+      break;
+    }
+    arena_rewind(&cmd_arena, mark);
+    if (loop_done()) {
+      status = last_status;
+      break;
+    }
+  }
+  loop_depth--;
+  return last_status = status;
+}
+
+// for NAME in WORDS: the words are expanded once, up front
+int execute_for(Node *node) {
+  ArgVec items = {.arena = &cmd_arena};
+  for (int i = 1; i < node->num_words; i++) {
+    expand_word(&node->words[i], &items);
+  }
+  int status = 0;
+  if (loop_depth++ == 0) {
+    interrupted = 0;
+  }
+  for (int i = 0; i < items.argc; i++) {
+    if (var_set(node->words[0].text, node->words[0].len, items.argv[i], 0) <
+        0) {
+      status = 1;
+      break;
+    }
+    ArenaMark mark = arena_mark(&cmd_arena);
+    status = execute_node(node->right);
+    arena_rewind(&cmd_arena, mark);
+    if (loop_done()) {
+      status = last_status;
+      break;
+    }
+  }
+  loop_depth--;
+  return last_status = status;
+}
+
+// Whether a case pattern matches s; quoted parts match literally
+int case_match(const Word *w, const char *s) {
+  if (w->flags == 0) {
+    return strlen(s) == w->len && memcmp(s, w->text, w->len) == 0;
+  }
+  StrBuf text = {.arena = &cmd_arena};
+  StrBuf pat = {.arena = &cmd_arena};
+  expand_range(&text, w->text, w->text + w->len, &pat, NULL);
+  if (!(w->flags & WORD_GLOB)) {
+    return strcmp(sb_finish(&text), s) == 0;
+  }
+  GlobPart part;
+  glob_compile(pat.data, pat.len, &part);
+  part.match_dot = 1;
+  return glob_match(&part, s);
+}
+
+// case WORD in PATTERN) ...;; esac: the first item with a matching
+// pattern runs
+int execute_case(Node *node) {
+  char *subject = expand_word_single(&node->words[0]);
+  for (int i = 0; i < node->num_items; i++) {
+    CaseItem *item = &node->items[i];
+    for (int j = 0; j < item->num_patterns; j++) {
+      if (case_match(&item->patterns[j], subject)) {
+        last_status = 0;
+        return execute_node(item->body);
+      }
+    }
+  }
+  return last_status = 0;
+}
+
+// ( list ): the list runs in a forked copy of the shell
+int execute_subshell(Node *node) {
+  LaunchSpec spec = {.argv = (char *[]){"(...)", NULL}, .builtin = 1,
+                     .subshell = node->left};
+  if (redirect_prepare(node->redirs, &spec) < 0) {
+    launch_release(&spec);
+    return last_status = 1;
+  }
+  pid_t pid = launch_command(&spec);
+  launch_release(&spec);
+  if (pid < 0) {
+    perror("fork");
+    return last_status = 1;
+  }
+  wait_for_child(pid);
+  report_exit_status();
+  return last_status;
+}
+
+// The commands of a compound command run in the shell
+int execute_compound(Node *node) {
+  switch (node->kind) {
+  case NODE_IF:
+    return execute_if(node);
+  case NODE_WHILE:
+  case NODE_UNTIL:
+    return execute_while(node);
+  case NODE_FOR:
+    return execute_for(node);
+  case NODE_CASE:
+    return execute_case(node);
+  default:
+    return execute_node(node->left);
+  }
+}
+
+// A compound command with redirections: they apply to the shell while its
+// commands run, as for a builtin
+int execute_redirected(Node *node) {
+  LaunchSpec spec = {0};
+  SavedFd saved[LAUNCH_MAX_FDS];
+  int num_saved = 0;
+  if (redirect_prepare(node->redirs, &spec) < 0) {
+    launch_release(&spec);
+    return last_status = 1;
+  }
+  if (redirect_in_shell(&spec, saved, &num_saved) == 0) {
+    launch_release(&spec);
+    execute_compound(node);
+  } else {
+    launch_release(&spec);
+    last_status = 1;
+  }
+  redirect_restore(saved, num_saved);
+  return last_status;
+}
+
+// The function called name, or NULL
+Function *func_find(const char *name) {
+  if (num_functions == 0) {
+    return NULL;
+  }
+  Function *f = functions[var_hash(name, strlen(name)) % FUNC_BUCKETS];
+  while (f != NULL && strcmp(f->name, name) != 0) {
+    f = f->next;
+  }
+  return f;
+}
+
+void func_free(Function *f) {
+  arena_free(&f->arena);
+  free(f->name);
+  free(f);
+}
+
+// Take a function out of the table. A running one is freed when its last
+// call returns.
+void func_remove(Function *f) {
+  Function **link = &functions[var_hash(f->name, strlen(f->name)) %
+                               FUNC_BUCKETS];
+  while (*link != f) {
+    link = &(*link)->next;
+  }
+  *link = f->next;
+  num_functions--;
+  f->replaced = 1;
+  if (f->calls == 0) {
+    func_free(f);
+  }
+}
+
+// Drop every function (between --serve requests)
+void funcs_reset(void) {
+  for (int i = 0; i < FUNC_BUCKETS; i++) {
+    while (functions[i] != NULL) {
+      func_remove(functions[i]);
+    }
+  }
+}
+
+Word word_copy(Arena *a, const Word *w) {
+  Word copy = *w;
+  if (w->text != NULL) {
+    copy.text = arena_strndup(a, w->text, w->len);
+  }
+  return copy;
+}
+
+Word *words_copy(Arena *a, const Word *words, int n) {
+  if (n == 0) {
+    return NULL;
+  }
+  Word *copy = arena_alloc(a, n * sizeof(Word));
+  for (int i = 0; i < n; i++) {
+    copy[i] = word_copy(a, &words[i]);
+  }
+  return copy;
+}
+
+// Deep copy of a parse tree into a, source text and here-document bodies
+// included, so it outlives the command line it came from
+Node *node_copy(Arena *a, const Node *node) {
+  if (node == NULL) {
+    return NULL;
+  }
+  Node *copy = arena_alloc(a, sizeof(Node));
+  *copy = *node;
+  copy->text = arena_strndup(a, node->text, node->text_len);
+  copy->words = words_copy(a, node->words, node->num_words);
+  Redir **link = &copy->redirs;
+  for (Redir *r = node->redirs; r != NULL; r = r->next) {
+    Redir *c = arena_alloc(a, sizeof(Redir));
+    *c = *r;
+    c->target = word_copy(a, &r->target);
+    c->body = word_copy(a, &r->body);
+    c->next = c->next_heredoc = NULL;
+    *link = c;
+    link = &c->next;
+  }
+  if (node->num_children > 0) {
+    copy->children = arena_alloc(a, node->num_children * sizeof(Node *));
+    for (int i = 0; i < node->num_children; i++) {
+      copy->children[i] = node_copy(a, node->children[i]);
+    }
+  }
+  copy->left = node_copy(a, node->left);
+  copy->right = node_copy(a, node->right);
+  if (node->num_items > 0) {
+    copy->items = arena_alloc(a, node->num_items * sizeof(CaseItem));
+    for (int i = 0; i < node->num_items; i++) {
+      CaseItem *item = &copy->items[i];
+      item->num_patterns = node->items[i].num_patterns;
+      item->patterns = words_copy(a, node->items[i].patterns,
+                                  item->num_patterns);
+      item->body = node_copy(a, node->items[i].body);
+    }
+  }
+  return copy;
+}
+
+// name() body: keep a copy of the body, replacing any function of that
+// name. Each call runs the copy; nothing is parsed again.
+int func_define(Node *node) {
+  char *name = strndup(node->words[0].text, node->words[0].len);
+  Function *old = func_find(name);
+  if (old != NULL) {
+    func_remove(old);
+  }
+  Function *f = calloc(1, sizeof(Function));
+  size_t bucket = var_hash(name, strlen(name)) % FUNC_BUCKETS;
+  f->name = name;
+  f->arena.chunk_size = 4096;
+  f->body = node_copy(&f->arena, node->left);
+  f->next = functions[bucket];
+  functions[bucket] = f;
+  num_functions++;
+  return last_status = 0;
+}
+
+// Run a function with the rest of args as its positional parameters
+int func_call(Function *f, char **args) {
+  if (func_depth >= FUNC_MAX_DEPTH) {
+    fprintf(stderr, COLOR_RED "%s: maximum function nesting level exceeded"
+            COLOR_RESET "\n", args[0]);
+    return 1;
+  }
+  PosArgs saved = pos_args;
+  pos_args.argv = NULL;
+  pos_set(args + 1);
+  f->calls++;
+  func_depth++;
+  execute_node(f->body);
+  returning = 0;
+  func_depth--;
+  f->calls--;
+  argv_free_copy(pos_args.argv);
+  pos_args = saved;
+  if (f->replaced && f->calls == 0) {
+    func_free(f);
+  }
+  return last_status;
+}
+
+// Execute a parsed command line
+int execute_node(Node *node) {
+  switch (node->kind) {
+  case NODE_SEQUENCE:
+    for (int i = 0; i < node->num_children && !unwinding(); i++) {
+      if (node->children[i]->background) {
+        execute_background(node->children[i]);
+      } else {
+        execute_node(node->children[i]);
+      }
+    }
+    break;
+  case NODE_AND:
+    if (execute_node(node->left) == 0 && !unwinding()) {
+      execute_node(node->right);
+    }
+    break;
+  case NODE_OR:
+    if (execute_node(node->left) != 0 && !unwinding()) {
+      execute_node(node->right);
+    }
+    break;
+  case NODE_PIPELINE:
+    execute_single_pipeline(node, NULL);
+    break;
+  case NODE_COMMAND:
+    execute_command(node);
+    break;
+  case NODE_FUNCTION:
+    func_define(node);
+    break;
+  case NODE_SUBSHELL:
+    execute_subshell(node);
+    break;
+  default:
+    if (node->redirs != NULL) {
+      execute_redirected(node);
+    } else {
+      execute_compound(node);
+    }
+    break;
+  }
+  if (node->negate) {
+    last_status = last_status == 0;
+  }
+  return last_status;
+}
+
+// Builtins loaded with enable -f, searched before the core table so a
+// loaded builtin can replace a core one
+BuiltinTable loaded_builtins = {0};
+
+// cd [dir], cd - and cd with no argument (HOME)
+int builtin_cd(char **args) {
+  if (args[1] == NULL) {
+    // No argument - go to home directory
+    const char *home = var_get("HOME");
+    if (home != NULL) {
+      if (chdir(home) != 0) {
+        perror("cd");
+        return 1;
+      }
+      prompt_update_cwd();
+    } else {
+      fprintf(stderr, COLOR_RED "cd: HOME not set" COLOR_RESET "\n");
+      return 1;
+    }
+  } else if (strcmp(args[1], "-") == 0) {
+    // cd - goes to previous directory
+    const char *oldpwd = var_get("OLDPWD");
+    if (oldpwd != NULL) {
+      printf("%s\n", oldpwd);
+      if (chdir(oldpwd) != 0) {
+        perror("cd");
+        return 1;
+      }
+      prompt_update_cwd();
+    } else {
+      fprintf(stderr, COLOR_RED "cd: OLDPWD not set" COLOR_RESET "\n");
+      return 1;
+    }
+  } else {
+    // Save current directory as OLDPWD
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+      var_set("OLDPWD", 6, cwd, VAR_EXPORT);
+    }
+
+    // Change to specified directory
+    if (chdir(args[1]) != 0) {
+      perror("cd");
+      return 1;
+    }
+    prompt_update_cwd();
+  }
+  return 0;
+}
+
+int builtin_pwd(char **args) {
+  (void)args;
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    printf("%s\n", cwd);
+  } else {
+    perror("pwd");
+    return 1;
+  }
+  return 0;
+}
+
+int builtin_echo(char **args) {
+  for (int i = 1; args[i] != NULL; i++) {
+    printf("%s", args[i]);
+    if (args[i + 1] != NULL) {
+      printf(" ");
+    }
+  }
+  printf("\n");
+  return 0;
+}
+
+int builtin_clear(char **args) {
+  (void)args;
+  printf("\033[2J\033[H"); // Clear screen and move cursor to top
+  return 0;
+}
+
+int builtin_help(char **args) {
+  (void)args;
+  printf("\n");
+  printf("═══════════════════════════════════════════════════════════\n");
+  printf("                   " COLOR_GREEN "MyShell Help" COLOR_RESET "\n");
+  printf("═══════════════════════════════════════════════════════════\n");
+  printf("\n");
+  printf(COLOR_BLUE "Built-in Commands:" COLOR_RESET "\n");
+  printf("  cd [dir]       Change directory\n");
+  printf("                 - cd          : Go to home directory\n");
+  printf("                 - cd -        : Go to previous directory\n");
+  printf("                 - cd /path    : Go to specified path\n");
+  printf("\n");
+  printf("  pwd            Print current working directory\n");
+  printf("  echo [text]    Print text to screen\n");
+  printf("  clear          Clear the screen\n");
+  printf("  jobs [-l]      List background jobs (-l: with their pids)\n");
+  printf("  fg, bg [%%N]    Continue a job in the foreground or background\n");
+  printf("  kill [-SIG] %%N|PID\n");
+  printf("                 Signal a whole job or a process (-l: signal names)\n");
+  printf("  hash [-r|-l]   Show, reset or list remembered command paths\n");
+  printf("  wait [-n|%%N]   Wait for all jobs, the next one, or job N\n");
+  printf("  set [opt=val]  Show or change shell options (jobslots, globcache,\n");
+  printf("                 pipesize, pipestats, trace)\n");
+  printf("  stats [-r]     Show (or reset) execution counters and latencies\n");
+  printf("  history [N]    Show the whole history, or its last N entries\n");
+  printf("  export [NAME[=value]]\n");
+  printf("                 Export variables to commands, or list exported ones\n");
+  printf("  readonly [NAME[=value]]\n");
+  printf("                 Make variables readonly, or list them\n");
+  printf("  unset [-f] NAME\n");
+  printf("                 Remove a variable (-f: a function)\n");
+  printf("  test, [ ... ]  Check files, strings and integers\n");
+  printf("  read [-r] NAME...\n");
+  printf("                 Read a line and split it into variables\n");
+  printf("  shift [N]      Drop the first N positional parameters\n");
+  printf("  break, continue [N], return [N]\n");
+  printf("                 Leave or restart loops, leave a function\n");
+  printf("  true, false, : Do nothing, successfully or not\n");
+  printf("  enable [-n|-d] [-f lib.so] name\n");
+  printf("                 Load a builtin from a shared object, or turn one\n");
+  printf("                 off (-n) or remove it (-d); no name lists them\n");
+  printf("  parallel [-j N] [-k] cmd {} [::: items]\n");
+  printf("                 Run cmd for each item (default: stdin lines)\n");
+  printf("  cat, tee [-a], head -c N\n");
+  printf("                 Built in when used as pipeline stages\n");
+  printf("  help           Show this help message\n");
+  printf("  exit           Exit the shell\n");
+  for (int i = 0; i < loaded_builtins.count; i++) {
+    Builtin *b = &loaded_builtins.list[i];
+    printf("  %-14s %s\n", b->name,
+           b->loaded->help != NULL ? b->loaded->help : b->path);
+  }
+  printf("\n");
+  printf(COLOR_BLUE "Special Features:" COLOR_RESET "\n");
+  printf("  !!             Repeat the last command\n");
+  printf("  !N, !-N        Repeat history entry N, or the Nth most recent\n");
+  printf("  !abc, !?abc    Repeat the last command starting with / containing abc\n");
+  printf("  $(cmd), `cmd`  Replace with the output of cmd\n");
+  printf("  Tab            Complete a command, $variable or path\n");
+  printf("  Up, Down       Walk the history (Ctrl+P, Ctrl+N)\n");
+  printf("  Ctrl+A, Ctrl+E Move to the start or end of the line\n");
+  printf("  Ctrl+K, Ctrl+U, Ctrl+W\n");
+  printf("                 Delete to the end, to the start, or a word\n");
+  printf("  Ctrl+C         Cancel current input (doesn't exit shell)\n");
+  printf("  Ctrl+D         Exit the shell\n");
+  printf("\n");
+  printf(COLOR_BLUE "Piping:" COLOR_RESET "\n");
+  printf("  cmd1 | cmd2    Connect output of cmd1 to input of cmd2\n");
+  printf("  pipesize 1M cmd1 | cmd2\n");
+  printf("                 Use 1 MB pipes for this pipeline\n");
+  printf("  time [-j] cmd1 | cmd2\n");
+  printf("                 Show time, memory and context switches per stage\n");
+  printf("  pin [-s] 0-3 cmd1 | cmd2\n");
+  printf("                 Run on CPUs 0-3 (-s: one CPU per stage, in turn)\n");
+  printf("  nice [-n] N, ionice idle|be[:N]|rt[:N], limit mem=1G,cpu=60,nofile=256\n");
+  printf("                 Lower priority or cap resources; also for cmd &\n");
+  printf("  Examples:\n");
+  printf("    ls | grep txt       - List files containing 'txt'\n");
+  printf("    cat file | wc -l    - Count lines in file\n");
+  printf("    ps aux | grep user  - Find processes by user\n");
+  printf("\n");
+  printf(COLOR_BLUE "Redirection and Lists:" COLOR_RESET "\n");
+  printf("  cmd > file     Write output to file (>> appends)\n");
+  printf("  cmd < file     Read input from file\n");
+  printf("  cmd 2>&1       Send errors where output goes\n");
+  printf("  cmd <<EOF      Read the following lines up to EOF (<<- strips tabs)\n");
+  printf("  cmd <<< word   Read word and a newline\n");
+  printf("  a ; b          Run a, then b\n");
+  printf("  a && b         Run b only if a succeeds (|| if it fails)\n");
+  printf("\n");
+  printf(COLOR_BLUE "Control Flow:" COLOR_RESET "\n");
+  printf("  if a; then b; elif c; then d; else e; fi\n");
+  printf("  while a; do b; done, until a; do b; done\n");
+  printf("  for x in items; do b; done\n");
+  printf("  case $x in a|b) c ;; *) d ;; esac\n");
+  printf("  name() { cmds; }   Define a function ($1, $#, \"$@\" inside)\n");
+  printf("  { cmds; }, (cmds)  Group commands, or run them in a subshell\n");
+  printf("  $((expr))          Integer arithmetic (+ - * / %% << & && ?: =)\n");
+  printf("\n");
+  printf(COLOR_BLUE "Background Processing:" COLOR_RESET "\n");
+  printf("  command &      Run command in background\n");
+  printf("  Examples:\n");
+  printf("    sleep 10 &         - Sleep for 10 seconds in background\n");
+  printf("    long_task &        - Run long task without blocking shell\n");
+  printf("    a | b > out &      - Pipelines, redirections and lists too\n");
+  printf("    jobs               - List running background jobs\n");
+  printf("    fg %%1, kill %%2     - Resume or signal a whole job\n");
+  printf("    set jobslots=4     - Run at most 4 jobs at once, queue the rest\n");
+  printf("\n");
+  printf(COLOR_BLUE "External Commands:" COLOR_RESET "\n");
+  printf("  You can run any system command like:\n");
+  printf("  ls, cat, grep, date, whoami, etc.\n");
+  printf("\n");
+  printf("═══════════════════════════════════════════════════════════\n");
+  printf("\n");
+  return 0;
+}
+
+// jobs [-l] : list running, stopped and queued jobs; -l adds the pid of
+//             every process in each job
+int builtin_jobs(char **args) {
+  int pids = args[1] != NULL && strcmp(args[1], "-l") == 0;
+  int active_jobs = 0;
+  jobs_reap();
+  for (int id = 1; id < job_table.id_cap; id++) {
+    Job *job = job_table.by_id[id];
+    if (job != NULL && job->state != JOB_DONE) {
+      char limits[256] = "";
+      char state[64];
+      if (job->limits != NULL) {
+        limits_describe(job->limits, limits, sizeof(limits));
+      }
+      job_describe(job, state, sizeof(state));
+      printf("[%d]  ", job->id);
+      for (int i = 0; pids && i < job->num_procs; i++) {
+        if (job->procs[i].pid > 0) {
+          printf("%d ", job->procs[i].pid);
+        }
+      }
+      printf("%-24s%s &%s%s%s\n", state, job->command,
+             limits[0] ? "  (" : "", limits, limits[0] ? ")" : "");
+      active_jobs++;
+    }
+  }
+  job_notify();
+  if (active_jobs == 0) {
+    printf("No background jobs.\n");
+  }
+  return 0;
+}
+
+// exit [code]; without a code, exit with the status of the last command
+int builtin_exit(char **args) {
+  int code = last_status;
+  if (args[1] != NULL) {
+    // Exit with specific code if provided
+    code = atoi(args[1]);
+  }
+  fflush(stdout);
+  if (serving) {
+    // Unwind to run_input; the worker lives on for the next request
+    pending_exit = code & 0xff;
+    return pending_exit;
+  }
+  exit(code);
+}
+
+// true, false and :
+int builtin_true(char **args) {
+  (void)args;
+  return 0;
+}
+
+int builtin_false(char **args) {
+  (void)args;
+  return 1;
+}
+
+// break [N] and continue [N]: leave N enclosing loops, or go on with the
+// next pass of the Nth
+int builtin_break(char **args) {
+  long n = 1;
+  if (args[1] != NULL && parse_number(args[1], 1, INT_MAX, &n) < 0) {
+    fprintf(stderr, COLOR_RED "%s: %s: loop count out of range" COLOR_RESET
+            "\n", args[0], args[1]);
+    return 1;
+  }
+  if (loop_depth == 0) {
+    fprintf(stderr, COLOR_RED "%s: only meaningful in a loop" COLOR_RESET
+            "\n", args[0]);
+    return 0;
+  }
+  if (n > loop_depth) {
+    n = loop_depth;
+  }
+  if (strcmp(args[0], "continue") == 0) {
+    continuing = n;
+  } else {
+    breaking = n;
+  }
+  return 0;
+}
+
+// return [N]: leave the running function with status N (default: the last
+// command's)
+int builtin_return(char **args) {
+  long n = last_status;
+  if (args[1] != NULL && parse_number(args[1], LONG_MIN, LONG_MAX, &n) < 0) {
+    fprintf(stderr, COLOR_RED "return: %s: numeric argument required"
+            COLOR_RESET "\n", args[1]);
+    n = 2;
+  }
+  if (func_depth == 0) {
+    fprintf(stderr, COLOR_RED "return: can only be used in a function"
+            COLOR_RESET "\n");
+    return 1;
+  }
+  returning = 1;
+  return n & 0xff;
+}
+
+// shift [N]: drop the first N positional parameters
+int builtin_shift(char **args) {
+  long n = 1;
+  if (args[1] != NULL && parse_number(args[1], 0, INT_MAX, &n) < 0) {
+    fprintf(stderr, COLOR_RED "shift: %s: numeric argument required"
+            COLOR_RESET "\n", args[1]);
+    return 1;
+  }
+  if (n > pos_count()) {
+    fprintf(stderr, COLOR_RED "shift: shift count out of range" COLOR_RESET
+            "\n");
+    return 1;
+  }
+  pos_args.shift += n;
+  return 0;
+}
+
+// Read one line of fd into sb without its newline, and without reading
+// past it: a seekable file is read a block at a time and the rest given
+// back with lseek, anything else a byte at a time. Unless raw, a backslash
+// quotes the next character and joins lines. Returns 1 if the input ended
+// before a newline.
+int read_line(int fd, StrBuf *sb, int raw) {
+  char buf[4096];
+  int seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+  int escaped = 0;
+  while (1) {
+    ssize_t n = read(fd, buf, seekable ? sizeof(buf) : 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      char c = buf[i];
+      if (escaped) {
+        escaped = 0;
+        if (c != '\n') {
+          sb_putc(sb, c);
+        }
+      } else if (c == '\\' && !raw) {
+        escaped = 1;
+      } else if (c == '\n') {
+        if (seekable && i + 1 < n) {
+          lseek(fd, i + 1 - n, SEEK_CUR);
+        }
+        return 0;
+      } else {
+        sb_putc(sb, c);
+      }
+    }
+  }
+}
+
+// read [-r] [NAME...]: read a line of standard input and split it at the
+// characters of $IFS into the names, the last one taking the rest of the
+// line (REPLY without names). Status 1 at end of input.
+int builtin_read(char **args) {
+  int i = 1;
+  int raw = 0;
+  if (args[i] != NULL && strcmp(args[i], "-r") == 0) {
+    raw = 1;
+    i++;
+  }
+  for (int j = i; args[j] != NULL; j++) {
+    for (const char *c = args[j]; *c != '\0'; c++) {
+      if (!is_name_char(*c, c == args[j])) {
+        fprintf(stderr, COLOR_RED "read: `%s': not a valid identifier"
+                COLOR_RESET "\n", args[j]);
+        return 2;
+      }
+    }
+  }
+
+  StrBuf line = {.arena = &cmd_arena};
+  int status = read_line(STDIN_FILENO, &line, raw);
+  char *s = sb_finish(&line);
+  if (args[i] == NULL) {
+    return var_set("REPLY", 5, s, 0) < 0 ? 1 : status;
+  }
+
+  const char *ifs = var_get("IFS");
+  if (ifs == NULL) {
+    ifs = " \t\n";
+  }
+  char *end = s + line.len;
+  for (; args[i] != NULL; i++) {
+    while (s < end && *s != '\0' && strchr(ifs, *s) != NULL &&
+           strchr(" \t\n", *s) != NULL) {
+      s++;
+    }
+    char *field = s;
+    if (args[i + 1] == NULL) {
+      // The last name takes the rest, less trailing IFS blanks
+      while (end > s && strchr(ifs, end[-1]) != NULL &&
+             strchr(" \t\n", end[-1]) != NULL) {
+        end--;
+      }
+      s = end;
+    } else {
+      while (s < end && (*s == '\0' || strchr(ifs, *s) == NULL)) {
+        s++;
+      }
+    }
+    char *field_end = s;
+    if (s < end) {
+      s++; // the separator
+    }
+    *field_end = '\0';
+    if (var_set(args[i], strlen(args[i]), field, 0) < 0) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Operand checks of test (see test_eval)
+int test_unary_op(const char *op) {
+  return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+         strchr("bcdefghLprsStuwxzn", op[1]) != NULL;
+}
+
+int test_binary_op(const char *op) {
+  static const char *const ops[] = {"=",   "==",  "!=",  "<",   ">",
+                                    "-eq", "-ne", "-lt", "-le", "-gt",
+                                    "-ge", "-nt", "-ot", "-ef"};
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(op, ops[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  char **args;
+  int count;
+  int pos;
+  const char *error;
+} TestState;
+
+int test_unary(TestState *t, const char *op, const char *arg) {
+  struct stat st;
+  switch (op[1]) {
+  case 'z':
+    return arg[0] == '\0';
+  case 'n':
+    return arg[0] != '\0';
+  case 't':
+    return isatty(atoi(arg));
+  case 'r':
+    return access(arg, R_OK) == 0;
+  case 'w':
+    return access(arg, W_OK) == 0;
+  case 'x':
+    return access(arg, X_OK) == 0;
+  case 'h':
+  case 'L':
+    return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  }
+  if (stat(arg, &st) != 0) {
+    return 0;
+  }
+  switch (op[1]) {
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'g':
+    return (st.st_mode & S_ISGID) != 0;
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 'u':
+    return (st.st_mode & S_ISUID) != 0;
+  case 'e':
+    return 1;
+  }
+  t->error = "unknown unary operator";
+  return 0;
+}
+
+// An integer operand of -eq and friends
+long test_integer(TestState *t, const char *arg) {
+  char *end;
+  errno = 0;
+  long n = strtol(arg, &end, 10);
+  while (*end == ' ' || *end == '\t') {
+    end++;
+  }
+  if (end == arg || *end != '\0' || errno != 0) {
+    if (t->error == NULL) {
+      t->error = "integer expression expected";
+    }
+    return 0;
+  }
+  return n;
+}
+
+int test_binary(TestState *t, const char *l, const char *op, const char *r) {
+  if (op[0] != '-') {
+    int cmp = strcmp(l, r);
+    switch (op[0]) {
+    case '<':
+      return cmp < 0;
+    case '>':
+      return cmp > 0;
+    case '!':
+      return cmp != 0;
+    default:
+      return cmp == 0;
+    }
+  }
+  if (op[1] == 'n' && op[2] == 't') {
+    struct stat a, b;
+    return stat(l, &a) == 0 &&
+           (stat(r, &b) != 0 ||
+            STAT_MTIME(a).tv_sec > STAT_MTIME(b).tv_sec ||
+            (STAT_MTIME(a).tv_sec == STAT_MTIME(b).tv_sec &&
+             STAT_MTIME(a).tv_nsec > STAT_MTIME(b).tv_nsec));
+  }
+  if (op[1] == 'o' && op[2] == 't') {
+    return test_binary(t, r, "-nt", l);
+  }
+  if (op[1] == 'e' && op[2] == 'f') {
+    struct stat a, b;
+    return stat(l, &a) == 0 && stat(r, &b) == 0 && a.st_dev == b.st_dev &&
+           a.st_ino == b.st_ino;
+  }
+  long a = test_integer(t, l);
+  long b = test_integer(t, r);
+  if (strcmp(op, "-eq") == 0) {
+    return a == b;
+  }
+  if (strcmp(op, "-ne") == 0) {
+    return a != b;
+  }
+  if (strcmp(op, "-lt") == 0) {
+    return a < b;
+  }
+  if (strcmp(op, "-le") == 0) {
+    return a <= b;
+  }
+  if (strcmp(op, "-gt") == 0) {
+    return a > b;
+  }
+  return a >= b;
+}
+
+int test_or(TestState *t);
+
+// primary: '(' expr ')' | unary-op arg | arg binary-op arg | arg
+int test_primary(TestState *t) {
+  char **a = t->args + t->pos;
+  int left = t->count - t->pos;
+  if (left <= 0) {
+    t->error = "argument expected";
+    return 0;
+  }
+  if (left >= 3 && test_binary_op(a[1])) {
+    t->pos += 3;
+    return test_binary(t, a[0], a[1], a[2]);
+  }
+  if (strcmp(a[0], "(") == 0) {
+    t->pos++;
+    int value = test_or(t);
+    if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0) {
+      t->error = "`)' expected";
+      return 0;
+    }
+    t->pos++;
+    return value;
+  }
+  if (left >= 2 && test_unary_op(a[0])) {
+    t->pos += 2;
+    return test_unary(t, a[0], a[1]);
+  }
+  t->pos++;
+  return a[0][0] != '\0';
+}
+
+int test_not(TestState *t) {
+  if (t->pos < t->count - 1 && strcmp(t->args[t->pos], "!") == 0) {
+    t->pos++;
+    return !test_not(t);
+  }
+  return test_primary(t);
+}
+
+int test_and(TestState *t) {
+  int value = test_not(t);
+  while (t->pos < t->count && strcmp(t->args[t->pos], "-a") == 0) {
+    t->pos++;
+    value = test_not(t) && value;
+  }
+  return value;
+}
+
+int test_or(TestState *t) {
+  int value = test_and(t);
+  while (t->pos < t->count && strcmp(t->args[t->pos], "-o") == 0) {
+    t->pos++;
+    value = test_and(t) || value;
+  }
+  return value;
+}
+
+// Evaluate test's arguments. Up to four follow the POSIX rules by count,
+// so [ "$x" = ! ] and [ ! = x ] mean what they say; longer expressions
+// are parsed with ! -a -o and parentheses.
+int test_eval(TestState *t) {
+  char **a = t->args + t->pos;
+  switch (t->count - t->pos) {
+  case 0:
+    return 0;
+  case 1:
+    t->pos++;
+    return a[0][0] != '\0';
+  case 2:
+    if (strcmp(a[0], "!") == 0) {
+      t->pos += 2;
+      return a[1][0] == '\0';
+    }
+    if (test_unary_op(a[0])) {
+      t->pos += 2;
+      return test_unary(t, a[0], a[1]);
+    }
+    break;
+  case 3:
+    if (test_binary_op(a[1])) {
+      t->pos += 3;
+      return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "!") == 0) {
+      t->pos++;
+      return !test_eval(t);
+    }
+    if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0) {
+      t->pos += 3;
+      return a[1][0] != '\0';
+    }
+    break;
+  case 4:
+    if (strcmp(a[0], "!") == 0) {
+      t->pos++;
+      return !test_eval(t);
+    }
+    if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0) {
+      t->pos++;
+      t->count--;
+      int value = test_eval(t);
+      t->count++;
+      t->pos++;
+      return value;
+    }
+    break;
+  }
+  return test_or(t);
+}
+
+// test EXPR and [ EXPR ]: 0 if true, 1 if false, 2 on a malformed
+// expression
+int builtin_test(char **args) {
+  int count = 0;
+  while (args[count + 1] != NULL) {
+    count++;
+  }
+  if (strcmp(args[0], "[") == 0) {
+    if (count == 0 || strcmp(args[count], "]") != 0) {
+      fprintf(stderr, COLOR_RED "[: missing `]'" COLOR_RESET "\n");
+      return 2;
+    }
+    count--;
+  }
+  TestState t = {.args = args + 1, .count = count};
+  int value = test_eval(&t);
+  if (t.error == NULL && t.pos < t.count) {
+    t.error = "too many arguments";
+  }
+  if (t.error != NULL) {
+    fprintf(stderr, COLOR_RED "%s: %s" COLOR_RESET "\n", args[0], t.error);
+    return 2;
+  }
+  return !value;
+}
+
+// The core builtins, sorted by name for builtin_search
+Builtin core_builtins[] = {
+    {.name = ":", .func = builtin_true, .flags = BUILTIN_SUBST},
+    {.name = "[", .func = builtin_test, .flags = BUILTIN_SUBST},
+    {.name = "bg", .func = builtin_bg},
+    {.name = "break", .func = builtin_break},
+    {.name = "cat", .func = builtin_cat, .flags = BUILTIN_STAGE},
+    {.name = "cd", .func = builtin_cd},
+    {.name = "clear", .func = builtin_clear, .flags = BUILTIN_SUBST},
+    {.name = "continue", .func = builtin_break},
+    {.name = "echo", .func = builtin_echo, .flags = BUILTIN_SUBST},
+    {.name = "enable", .func = builtin_enable},
+    {.name = "exit", .func = builtin_exit},
+    {.name = "export", .func = builtin_export},
+    {.name = "false", .func = builtin_false, .flags = BUILTIN_SUBST},
+    {.name = "fg", .func = builtin_fg},
+    {.name = "hash", .func = builtin_hash},
+    {.name = "head", .func = builtin_head, .flags = BUILTIN_STAGE},
+    {.name = "help", .func = builtin_help, .flags = BUILTIN_SUBST},
+    {.name = "history", .func = builtin_history, .flags = BUILTIN_SUBST},
+    {.name = "jobs", .func = builtin_jobs, .flags = BUILTIN_SUBST},
+    {.name = "kill", .func = builtin_kill},
+    {.name = "parallel", .func = builtin_parallel},
+    {.name = "pwd", .func = builtin_pwd, .flags = BUILTIN_SUBST},
+    {.name = "read", .func = builtin_read},
+    {.name = "readonly", .func = builtin_export},
+    {.name = "return", .func = builtin_return},
+    {.name = "set", .func = builtin_set},
+    {.name = "shift", .func = builtin_shift},
+    {.name = "stats", .func = builtin_stats},
+    {.name = "tee", .func = builtin_tee, .flags = BUILTIN_STAGE},
+    {.name = "test", .func = builtin_test, .flags = BUILTIN_SUBST},
+    {.name = "true", .func = builtin_true, .flags = BUILTIN_SUBST},
+    {.name = "unset", .func = builtin_unset},
+    {.name = "wait", .func = builtin_wait},
+};
+
+#define NUM_CORE_BUILTINS ((int)(sizeof(core_builtins) / sizeof(core_builtins[0])))
+
+// Bisect a sorted builtin list. Returns the index of name, or -1 with
+// *pos set to where it would be inserted.
+int builtin_search(Builtin *list, int count, const char *name, int *pos) {
+  int lo = 0;
+  int hi = count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp(name, list[mid].name);
+    if (cmp == 0) {
+      return mid;
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  *pos = lo;
+  return -1;
+}
+
+// The builtin called name, including disabled and pipeline-only ones
+Builtin *builtin_find(const char *name) {
+  int pos;
+  int i = builtin_search(loaded_builtins.list, loaded_builtins.count, name,
+                         &pos);
+  if (i >= 0) {
+    return &loaded_builtins.list[i];
+  }
+  i = builtin_search(core_builtins, NUM_CORE_BUILTINS, name, &pos);
+  return i >= 0 ? &core_builtins[i] : NULL;
+}
+
+// The builtin a simple command runs as, or NULL if it is an external
+// command. Data movers only count as pipeline stages (see is_data_mover).
+Builtin *builtin_lookup(char **args) {
+  Builtin *builtin = builtin_find(args[0]);
+  if (builtin == NULL ||
+      (builtin->flags & (BUILTIN_STAGE | BUILTIN_DISABLED)) != 0) {
+    return NULL;
+  }
+  return builtin;
+}
+
+int builtin_run(Builtin *builtin, char **args) {
+  if (builtin->loaded != NULL) {
+    int argc = 0;
+    while (args[argc] != NULL) {
+      argc++;
+    }
+    return builtin->loaded->run(argc, args);
+  }
+  return builtin->func(args);
+}
+
+// Check if command is a built-in or a function
+int is_builtin(char **args) {
+  return func_find(args[0]) != NULL || builtin_lookup(args) != NULL;
+}
+
+// Execute a function or built-in command, data movers included
+int execute_builtin(char **args) {
+  Function *func = func_find(args[0]);
+  if (func != NULL) {
+    return func_call(func, args);
+  }
+  Builtin *builtin = builtin_find(args[0]);
+  if (builtin == NULL) {
+    return 127;
+  }
+  return builtin_run(builtin, args);
+}
+
+// Drop the loaded builtin at index i
+void builtin_unload(int i) {
+  Builtin *builtin = &loaded_builtins.list[i];
+  dlclose(builtin->handle);
+  free((char *)builtin->name);
+  free(builtin->path);
+  loaded_builtins.count--;
+  memmove(builtin, builtin + 1,
+          (loaded_builtins.count - i) * sizeof(Builtin));
+}
+
+// Load builtin name from the shared object at path, replacing any loaded
+// builtin of the same name. The object must export name_builtin (see
+// myshell_builtin.h).
+int builtin_load(const char *path, const char *name) {
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    fprintf(stderr, COLOR_RED "enable: %s" COLOR_RESET "\n", dlerror());
+    return 1;
+  }
+  char symbol[256];
+  snprintf(symbol, sizeof(symbol), "%s_builtin", name);
+  MyshellBuiltin *loaded = dlsym(handle, symbol);
+  if (loaded == NULL || loaded->abi != MYSHELL_BUILTIN_ABI ||
+      loaded->run == NULL) {
+    if (loaded == NULL) {
+      fprintf(stderr, COLOR_RED "enable: %s: no %s symbol" COLOR_RESET "\n",
+              path, symbol);
+    } else {
+      fprintf(stderr,
+              COLOR_RED "enable: %s: %s has ABI %d, expected %d" COLOR_RESET
+                        "\n",
+              path, symbol, loaded->abi, MYSHELL_BUILTIN_ABI);
+    }
+    dlclose(handle);
+    return 1;
+  }
+
+  int pos;
+  int i = builtin_search(loaded_builtins.list, loaded_builtins.count, name,
+                         &pos);
+  if (i >= 0) {
+    builtin_unload(i);
+    pos = i;
+  }
+  if (loaded_builtins.count == loaded_builtins.cap) {
+    loaded_builtins.cap = loaded_builtins.cap ? loaded_builtins.cap * 2 : 8;
+    loaded_builtins.list = realloc(loaded_builtins.list,
+                                   loaded_builtins.cap * sizeof(Builtin));
+  }
+  Builtin *builtin = &loaded_builtins.list[pos];
+  memmove(builtin + 1, builtin,
+          (loaded_builtins.count - pos) * sizeof(Builtin));
+  loaded_builtins.count++;
+  *builtin = (Builtin){.name = strdup(name), .loaded = loaded,
+                       .path = strdup(path), .handle = handle};
+  return 0;
+}
+
+// Print a builtin as the enable command that recreates it
+void builtin_print(Builtin *builtin) {
+  if (builtin->loaded != NULL) {
+    printf("enable -f %s %s\n", builtin->path, builtin->name);
+  }
+  if (builtin->loaded == NULL || (builtin->flags & BUILTIN_DISABLED) != 0) {
+    printf("enable %s%s\n", (builtin->flags & BUILTIN_DISABLED) ? "-n " : "",
+           builtin->name);
+  }
+}
+
+// enable [-n|-d] [-f lib.so] [name...]
+int builtin_enable(char **args) {
+  int disable = 0;
+  int remove = 0;
+  const char *path = NULL;
+  int i = 1;
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "-n") == 0) {
+      disable = 1;
+    } else if (strcmp(args[i], "-d") == 0) {
+      remove = 1;
+    } else if (strcmp(args[i], "-f") == 0 && args[i + 1] != NULL) {
+      path = args[++i];
+    } else {
+      fprintf(stderr, COLOR_RED "usage: enable [-n|-d] [-f lib.so] [name...]"
+                                COLOR_RESET "\n");
+      return 2;
+    }
+  }
+
+  if (args[i] == NULL) {
+    int pos;
+    for (int j = 0; j < NUM_CORE_BUILTINS; j++) {
+      if (builtin_search(loaded_builtins.list, loaded_builtins.count,
+                         core_builtins[j].name, &pos) < 0) {
+        builtin_print(&core_builtins[j]);
+      }
+    }
+    for (int j = 0; j < loaded_builtins.count; j++) {
+      builtin_print(&loaded_builtins.list[j]);
+    }
+    return 0;
+  }
+
+  int status = 0;
+  for (; args[i] != NULL; i++) {
+    if (path != NULL) {
+      if (builtin_load(path, args[i]) != 0) {
+        status = 1;
+        continue;
+      }
+      if (disable) {
+        builtin_find(args[i])->flags |= BUILTIN_DISABLED;
+      }
+      continue;
+    }
+    int pos;
+    int loaded = builtin_search(loaded_builtins.list, loaded_builtins.count,
+                                args[i], &pos);
+    if (remove) {
+      if (loaded < 0) {
+        fprintf(stderr, COLOR_RED "enable: %s: not a loaded builtin"
+                                  COLOR_RESET "\n",
+                args[i]);
+        status = 1;
+      } else {
+        builtin_unload(loaded);
+      }
+      continue;
+    }
+    Builtin *builtin = builtin_find(args[i]);
+    if (builtin == NULL) {
+      fprintf(stderr, COLOR_RED "enable: %s: not a builtin" COLOR_RESET "\n",
+              args[i]);
+      status = 1;
+    } else if (disable) {
+      builtin->flags |= BUILTIN_DISABLED;
+    } else {
+      builtin->flags &= ~BUILTIN_DISABLED;
+    }
+  }
+  return status;
+}
+
+// Close every descriptor marked close-on-exec, as an exec would
+void close_cloexec_fds(void) {
+#ifdef __linux__
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir != NULL) {
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+      int fd = atoi(ent->d_name);
+      int flags = fd > 2 && fd != dirfd(dir) ? fcntl(fd, F_GETFD) : -1;
+      if (flags >= 0 && (flags & FD_CLOEXEC)) {
+        close(fd);
+      }
+    }
+    closedir(dir);
+    return;
+  }
+#endif
+  for (int fd = 3; fd < 1024; fd++) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags >= 0 && (flags & FD_CLOEXEC)) {
+      close(fd);
+    }
+  }
+}
+
+// Create a pipe whose ends are not inherited by spawned children; each
+// child only receives the ends its LaunchSpec maps onto stdin/stdout
+int make_pipe(int fds[2]) {
+#ifdef __linux__
+  return pipe2(fds, O_CLOEXEC);
+#else
+  if (pipe(fds) < 0) {
+    return -1;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
+// Largest pipe an unprivileged process may ask for
+long pipe_max_size(void) {
+  static long max = -1;
+  if (max < 0) {
+    max = 0;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (f != NULL) {
+      if (fscanf(f, "%ld", &max) != 1) {
+        max = 0;
+      }
+      fclose(f);
+    }
+  }
+  return max;
+}
+
+// Resize a pipe to size bytes (0 keeps the default), clamped to
+// pipe-max-size; the kernel rounds up to a power-of-two number of pages
+void pipe_set_size(int fd, long size) {
+#ifdef F_SETPIPE_SZ
+  long max = pipe_max_size();
+  if (size <= 0) {
+    return;
+  }
+  if (max > 0 && size > max) {
+    size = max;
+  }
+  fcntl(fd, F_SETPIPE_SZ, (int)size);
+#else
+  (void)fd;
+  (void)size;
+#endif
+}
+
+// Queue a dup2(from, to) for the child, or close(to) when from is -1;
+// mappings are applied in order
+int launch_add_fd(LaunchSpec *spec, int from, int to) {
+  if (spec->num_fds >= LAUNCH_MAX_FDS) {
+    return -1;
+  }
+  spec->fds[spec->num_fds].from = from;
+  spec->fds[spec->num_fds].to = to;
+  spec->num_fds++;
+  return 0;
+}
+
+// Close the redirection files the shell opened on behalf of the child
+void launch_release(LaunchSpec *spec) {
+  for (int i = 0; i < spec->num_opened; i++) {
+    close(spec->opened[i]);
+  }
+  spec->num_opened = 0;
+}
+
+// Apply a command's pin, nice, ionice and limit settings to the calling
+// process, a child about to exec. stage picks the CPU for pin -s. Returns
+// -1 after reporting the setting that failed.
+int limits_apply(const ProcLimits *limits, int stage) {
+  const char *failed = NULL;
+#ifdef __linux__
+  if (limits->flags & LIMITS_PIN) {
+    // Only CPUs the shell may use count, so pin -s spreads the stages
+    // over CPUs that exist
+    cpu_set_t allowed, set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+      CPU_ZERO(&allowed);
+    }
+    for (int cpu = 0; cpu < LIMITS_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+      if ((limits->cpus[cpu / 8] & (1 << (cpu % 8))) &&
+          CPU_ISSET(cpu, &allowed)) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    int usable = CPU_COUNT(&set);
+    if ((limits->flags & LIMITS_SPREAD) && usable > 0) {
+      int pick = stage % usable;
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && pick-- != 0) {
+          CPU_CLR(cpu, &set);
+        }
+      }
+    }
+    if (usable == 0) {
+      errno = EINVAL;
+      failed = "pin";
+    } else if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+      failed = "pin";
+    }
+  }
+  // ioprio_set(IOPRIO_WHO_PROCESS, self, class << IOPRIO_CLASS_SHIFT | level)
+  if (failed == NULL && (limits->flags & LIMITS_IONICE) &&
+      syscall(SYS_ioprio_set, 1, 0,
+              limits->io_class << 13 | limits->io_level) < 0) {
+    failed = "ionice";
+  }
+#endif
+  if (failed == NULL && (limits->flags & LIMITS_NICE)) {
+    errno = 0; // nice can return -1 on success
+    if (nice(limits->nice) == -1 && errno != 0) {
+      failed = "nice";
+    }
+  }
+  for (int i = 0; failed == NULL && i < limits->num_rlimits; i++) {
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = limits->rlimits[i].value;
+    if (setrlimit(limits->rlimits[i].resource, &rl) < 0) {
+      failed = "limit";
+    }
+  }
+  if (failed != NULL) {
+    fprintf(stderr, COLOR_RED "%s: %s" COLOR_RESET "\n", failed,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// First steps in a forked child: default signal handling, its process
+// group, the descriptor mappings and the spec's limits. Exits the child if
+// any of them fails.
+void launch_child_setup(LaunchSpec *spec) {
+  sigset_t empty;
+  sigemptyset(&empty);
+  signal(SIGINT, SIG_DFL);
+  sigprocmask(SIG_SETMASK, &empty, NULL);
+  if (spec->pgid != 0) {
+    setpgid(0, spec->pgid < 0 ? 0 : spec->pgid);
+  }
+  if (spec->gate > 0) {
+    // A queued job: hold here until the shell hands over a job slot, and
+    // go away with the shell if it exits first
+    char go = 0;
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != spec->gate_owner) {
+      _exit(1);
+    }
+#endif
+    while (read(spec->gate, &go, 1) < 0 && errno == EINTR) {
+    }
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, 0);
+#endif
+    close(spec->gate);
+  }
+  for (int i = 0; i < spec->num_fds; i++) {
+    if (spec->fds[i].from < 0) {
+      close(spec->fds[i].to);
+    } else if (spec->fds[i].from != spec->fds[i].to &&
+               dup2(spec->fds[i].from, spec->fds[i].to) < 0) {
+      fprintf(stderr, COLOR_RED "myshell: %d: %s" COLOR_RESET "\n",
+              spec->fds[i].from, strerror(errno));
+      _exit(1);
+    }
+  }
+  if (spec->limits != NULL && limits_apply(spec->limits, spec->stage) < 0) {
+    _exit(126);
+  }
+}
+
+// posix_spawn cannot change a child's CPU affinity, priority or resource
+// limits, so a command with such settings is forked, set up and exec'd by
+// hand. An exec failure comes back through a close-on-exec pipe, leaving
+// the caller the same errno posix_spawn would have. A child held at a job
+// gate execs long after the shell moved on, so it reports failure itself.
+pid_t launch_forked_exec(LaunchSpec *spec, char **envp) {
+  int report[2];
+  if (make_pipe(report) < 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(report[0]);
+    launch_child_setup(spec);
+    execve(spec->path, spec->argv, envp);
+    int err = errno;
+    if (spec->gate > 0) {
+      fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n",
+              spec->argv[0], strerror(err));
+      _exit(err == ENOENT ? 127 : 126);
+    }
+    ssize_t ignored = write(report[1], &err, sizeof(err));
+    (void)ignored;
+    _exit(127);
+  }
+  int err = errno;
+  close(report[1]);
+  if (pid > 0 && spec->gate == 0 &&
+      read_full(report[0], &err, sizeof(err)) > 0) {
+    waitpid(pid, NULL, 0);
+    pid = -1;
+  }
+  close(report[0]);
+  errno = err;
+  return pid;
+}
+
+// Builtins have to run in a real copy of the shell, so they keep fork()
+pid_t launch_forked_builtin(LaunchSpec *spec) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  launch_child_setup(spec);
+  // Without an exec nothing honours close-on-exec, so do what exec would:
+  // the child must not hold stray pipe ends or the shell's own files.
+  // The shell's jobs are not this child's either; a builtin that launches
+  // processes of its own (parallel) gets a fresh child event channel.
+  close_cloexec_fds();
+  trace.fd = -1;
+  trace.len = 0;
+  history.fd = -1; // closed above; history_open reopens it on demand
+  memset(&job_table, 0, sizeof(job_table));
+  num_reaped_fg = 0;
+  child_events_init();
+  assign_all(spec->env, spec->num_env, VAR_EXPORT);
+  int status;
+  if (spec->subshell != NULL) {
+    interactive = 0;
+    serving = 0; // exit in a subshell leaves the subshell
+    status = execute_node(spec->subshell);
+  } else {
+    status = execute_builtin(spec->argv);
+  }
+  fflush(stdout);
+  _exit(status);
+}
+
+// Count a launch and trace it. posix_spawn only returns once the child
+// has exec'd (or failed to), so a spawn is followed by its exec event.
+// A forked child's process group is also set from this side, so the next
+// stage can join the group whichever of the two runs first.
+void launch_record(LaunchSpec *spec, pid_t pid, long long start_us) {
+  long long now = monotonic_us();
+  int saved_errno = errno;
+  if (pid > 0 && spec->pgid != 0 &&
+      (spec->builtin || spec->limits != NULL || spec->gate > 0)) {
+    setpgid(pid, spec->pgid < 0 ? pid : spec->pgid);
+  }
+  if (pid < 0) {
+    stats.spawn_failures++;
+    trace_emit(&(TraceEvent){.event = spec->builtin ? "fork" : "spawn",
+                             .start_us = start_us, .dur_us = now - start_us,
+                             .job = trace.job, .name = spec->argv[0],
+                             .key = "errno", .value = saved_errno});
+    errno = saved_errno;
+    return;
+  }
+  stats.spawns++;
+  hist_add(&stats.spawn, now - start_us);
+  trace_emit(&(TraceEvent){.event = spec->builtin ? "fork" : "spawn",
+                           .start_us = start_us, .dur_us = now - start_us,
+                           .pid = pid, .job = trace.job,
+                           .name = spec->argv[0]});
+  if (!spec->builtin) {
+    trace_emit(&(TraceEvent){.event = "exec", .start_us = now, .pid = pid,
+                             .job = trace.job, .name = spec->path});
+  }
+  errno = saved_errno;
+}
+
+// Start a child described by spec and return its pid, or -1 with errno set.
+// External programs go through posix_spawn, which glibc implements with
+// clone(CLONE_VM|CLONE_VFORK), so launch cost does not grow with the size
+// of the shell's address space. Redirections and pipe wiring are expressed
+// as spawn file actions.
+pid_t launch_command(LaunchSpec *spec) {
+  long long start_us = monotonic_us();
+  if (spec->builtin) {
+    pid_t pid = launch_forked_builtin(spec);
+    launch_record(spec, pid, start_us);
+    return pid;
+  }
+  if (spec->limits != NULL || spec->gate > 0) {
+    fflush(stdout);
+    pid_t pid = launch_forked_exec(
+        spec, spec->num_env > 0 ? var_environ_with(spec->env, spec->num_env)
+                                : var_environ());
+    launch_record(spec, pid, start_us);
+    return pid;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (int i = 0; i < spec->num_fds; i++) {
+    if (spec->fds[i].from < 0) {
+      posix_spawn_file_actions_addclose(&actions, spec->fds[i].to);
+    } else if (spec->fds[i].from != spec->fds[i].to) {
+      posix_spawn_file_actions_adddup2(&actions, spec->fds[i].from,
+                                       spec->fds[i].to);
+    }
+  }
+
+  // The shell keeps SIGCHLD blocked for its signalfd; children must start
+  // with an empty mask
+  posix_spawnattr_t attr;
+  sigset_t empty;
+  sigemptyset(&empty);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  if (spec->pgid != 0) {
+    posix_spawnattr_setpgroup(&attr, spec->pgid < 0 ? 0 : spec->pgid);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+  } else {
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  }
+
+  // Builtin output still sitting in stdio must come before the child's
+  fflush(stdout);
+
+  pid_t pid;
+  char **envp = spec->num_env > 0 ? var_environ_with(spec->env, spec->num_env)
+                                  : var_environ();
+  int err = posix_spawn(&pid, spec->path, &actions, &attr, spec->argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (err != 0) {
+    pid = -1;
+  }
+  launch_record(spec, pid, start_us);
+  errno = err;
+  return pid;
+}
+
+// Resolve argv[0] through the PATH cache and launch it. A cached location
+// that has disappeared is forgotten and looked up once more.
+pid_t launch_external(LaunchSpec *spec) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    char *cmd_path = search_in_path(spec->argv[0]);
+    if (cmd_path == NULL) {
+      fprintf(stderr,
+              COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n",
+              spec->argv[0]);
+      last_status = 127;
+      return -1;
+    }
+
+    spec->path = cmd_path;
+    pid_t pid = launch_command(spec);
+    if (pid >= 0) {
+      return pid;
+    }
+    if (errno == ENOENT && attempt == 0 && strchr(spec->argv[0], '/') == NULL) {
+      path_cache_forget(spec->argv[0]);
+      continue;
+    }
+    fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n",
+            spec->argv[0], strerror(errno));
+    last_status = errno == ENOENT ? 127 : 126;
+    return -1;
+  }
+  return -1;
+}
+
+// Keep a foreground child reaped by waitpid(-1) for wait_for_child
+void reaped_fg_add(pid_t pid, int status) {
+  if (num_reaped_fg == reaped_fg_cap) {
+    reaped_fg_cap = reaped_fg_cap ? reaped_fg_cap * 2 : 8;
+    reaped_fg = realloc(reaped_fg, reaped_fg_cap * sizeof(ReapedChild));
+  }
+  reaped_fg[num_reaped_fg].pid = pid;
+  reaped_fg[num_reaped_fg].status = status;
+  num_reaped_fg++;
+}
+
+// Claim a foreground child that jobs_reap already collected
+int reaped_fg_take(pid_t pid, int *status) {
+  for (int i = 0; i < num_reaped_fg; i++) {
+    if (reaped_fg[i].pid == pid) {
+      *status = reaped_fg[i].status;
+      reaped_fg[i] = reaped_fg[--num_reaped_fg];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Wait for a foreground child and record its exit status in last_status.
+// While jobs are queued, keep reaping and dispatching them so
+// the slots do not sit idle behind a long foreground command.
+int wait_for_child(pid_t pid) {
+  int status;
+  long long start_us = monotonic_us();
+  trace_flush(); // the child is running; the shell has nothing else to do
+  int reaped = reaped_fg_take(pid, &status);
+  while (!reaped && job_table.queued > 0) {
+    jobs_reap();
+    reaped = reaped_fg_take(pid, &status);
+    if (!reaped) {
+      wait_child_event();
+    }
+  }
+  if (!reaped) {
+    while (waitpid(pid, &status, 0) < 0) {
+      if (errno != EINTR) {
+        return last_status;
+      }
+    }
+  }
+  if (WIFEXITED(status)) {
+    last_status = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    last_status = 128 + WTERMSIG(status);
+  }
+  long long dur_us = monotonic_us() - start_us;
+  hist_add(&stats.wait, dur_us);
+  trace_emit(&(TraceEvent){.event = "wait", .start_us = start_us,
+                           .dur_us = dur_us, .pid = pid, .key = "status",
+                           .value = last_status});
+  return last_status;
+}
+
+// Tell an interactive user how a failed foreground command ended
+void report_exit_status(void) {
+  if (!interactive || last_status == 0 || subst_depth > 0) {
+    return;
+  }
+  if (last_status > 128) {
+    printf(COLOR_RED "[Process terminated by signal %d]" COLOR_RESET "\n",
+           last_status - 128);
+  } else {
+    printf(COLOR_YELLOW "[Process exited with code %d]" COLOR_RESET "\n",
+           last_status);
+  }
+}
+
+// Milliseconds on the monotonic clock
+long long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Microseconds on the monotonic clock
+long long monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// FNV-1a hash of a NUL-terminated string
+unsigned long hash_string(const char *s) {
+  unsigned long h = 2166136261UL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+// Drop every cached entry whose dir_index is >= min_dir
+void path_cache_drop_from(int min_dir) {
+  for (size_t b = 0; b < path_cache.num_buckets; b++) {
+    PathEntry **link = &path_cache.buckets[b];
+    while (*link != NULL) {
+      PathEntry *e = *link;
+      if (e->dir_index >= min_dir) {
+        *link = e->next;
+        free(e->name);
+        free(e->path);
+        free(e);
+        path_cache.count--;
+      } else {
+        link = &e->next;
+      }
+    }
+  }
+}
+
+// Forget all remembered command locations (hash -r)
+void path_cache_clear(void) { path_cache_drop_from(PATH_PINNED); }
+
+// Split $PATH into the directory list and record each directory's mtime
+void path_cache_load_dirs(const char *path_env) {
+  for (int i = 0; i < path_cache.num_dirs; i++) {
+    free(path_cache.dirs[i]);
+  }
+  free(path_cache.dirs);
+  free(path_cache.dir_mtimes);
+  free(path_cache.path_value);
+
+  path_cache.path_value = strdup(path_env);
+  int n = 1;
+  for (const char *p = path_env; *p; p++) {
+    if (*p == ':') {
+      n++;
+    }
+  }
+  path_cache.dirs = malloc(n * sizeof(char *));
+  path_cache.dir_mtimes = calloc(n, sizeof(struct timespec));
+  path_cache.num_dirs = 0;
+
+  const char *start = path_env;
+  while (1) {
+    const char *end = strchr(start, ':');
+    size_t len = end ? (size_t)(end - start) : strlen(start);
+    // An empty component means the current directory
+    char *dir = len ? strndup(start, len) : strdup(".");
+    struct stat st;
+    int i = path_cache.num_dirs++;
+    path_cache.dirs[i] = dir;
+    if (stat(dir, &st) == 0) {
+      path_cache.dir_mtimes[i] = STAT_MTIME(st);
+    }
+    if (end == NULL) {
+      break;
+    }
+    start = end + 1;
+  }
+  path_cache.last_check_ms = monotonic_ms();
+}
+
+// Make sure cached entries still reflect $PATH and the PATH directories.
+// A changed $PATH flushes the table; a directory whose mtime changed drops
+// the entries from that directory onward, since a new file there may shadow
+// later directories. Directory mtimes are re-checked at most once per
+// PATH_RECHECK_INTERVAL_MS so a cache hit normally costs no syscalls.
+void path_cache_validate(const char *path_env) {
+  if (path_cache.path_value == NULL ||
+      strcmp(path_cache.path_value, path_env) != 0) {
+    path_cache_clear();
+    path_cache_load_dirs(path_env);
+    return;
+  }
+
+  long long now = monotonic_ms();
+  if (now - path_cache.last_check_ms < PATH_RECHECK_INTERVAL_MS) {
+    return;
+  }
+  path_cache.last_check_ms = now;
+
+  int first_changed = -1;
+  for (int i = 0; i < path_cache.num_dirs; i++) {
+    struct stat st;
+    struct timespec mtime = {0, 0};
+    if (stat(path_cache.dirs[i], &st) == 0) {
+      mtime = STAT_MTIME(st);
+    }
+    if (mtime.tv_sec != path_cache.dir_mtimes[i].tv_sec ||
+        mtime.tv_nsec != path_cache.dir_mtimes[i].tv_nsec) {
+      path_cache.dir_mtimes[i] = mtime;
+      if (first_changed < 0) {
+        first_changed = i;
+      }
+    }
+  }
+  if (first_changed >= 0) {
+    path_cache_drop_from(first_changed);
+  }
+}
+
+// Find a cached entry by command name
+PathEntry *path_cache_find(const char *name) {
+  if (path_cache.num_buckets == 0) {
+    return NULL;
+  }
+  PathEntry *e = path_cache.buckets[hash_string(name) % path_cache.num_buckets];
+  while (e != NULL && strcmp(e->name, name) != 0) {
+    e = e->next;
+  }
+  return e;
+}
+
+// Remember where a command lives, growing the table as it fills up
+PathEntry *path_cache_insert(const char *name, const char *path,
+                             int dir_index) {
+  if (path_cache.count + 1 > path_cache.num_buckets * 3 / 4) {
+    size_t new_size = path_cache.num_buckets ? path_cache.num_buckets * 2
+                                             : PATH_CACHE_INITIAL_BUCKETS;
+    PathEntry **buckets = calloc(new_size, sizeof(PathEntry *));
+    for (size_t b = 0; b < path_cache.num_buckets; b++) {
+      PathEntry *e = path_cache.buckets[b];
+      while (e != NULL) {
+        PathEntry *next = e->next;
+        size_t slot = hash_string(e->name) % new_size;
+        e->next = buckets[slot];
+        buckets[slot] = e;
+        e = next;
+      }
+    }
+    free(path_cache.buckets);
+    path_cache.buckets = buckets;
+    path_cache.num_buckets = new_size;
+  }
+
+  PathEntry *e = path_cache_find(name);
+  if (e == NULL) {
+    e = calloc(1, sizeof(PathEntry));
+    e->name = strdup(name);
+    size_t slot = hash_string(name) % path_cache.num_buckets;
+    e->next = path_cache.buckets[slot];
+    path_cache.buckets[slot] = e;
+    path_cache.count++;
+  } else {
+    free(e->path);
+  }
+  e->path = strdup(path);
+  e->dir_index = dir_index;
+  return e;
+}
+
+// Remove a single command from the cache (hash -d, or a stale entry)
+void path_cache_forget(const char *name) {
+  if (path_cache.num_buckets == 0) {
+    return;
+  }
+  PathEntry **link =
+      &path_cache.buckets[hash_string(name) % path_cache.num_buckets];
+  while (*link != NULL) {
+    PathEntry *e = *link;
+    if (strcmp(e->name, name) == 0) {
+      *link = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      path_cache.count--;
+      return;
+    }
+    link = &e->next;
+  }
+}
+
+// Walk the PATH directories looking for an executable
+PathEntry *path_cache_fill(const char *command) {
+  char full_path[PATH_MAX];
+  for (int i = 0; i < path_cache.num_dirs; i++) {
+    snprintf(full_path, sizeof(full_path), "%s/%s", path_cache.dirs[i],
+             command);
+    if (access(full_path, X_OK) == 0) {
+      // Relative PATH entries depend on the cwd, so never remember them
+      if (path_cache.dirs[i][0] != '/') {
+        static PathEntry uncached;
+        static char uncached_path[PATH_MAX];
+        strcpy(uncached_path, full_path);
+        uncached.path = uncached_path;
+        return &uncached;
+      }
+      return path_cache_insert(command, full_path, i);
+    }
+  }
+  return NULL;
+}
+
+// Search for command in PATH, consulting the lookup cache first.
+// The returned string is owned by the shell and stays valid until the
+// next call; copy it if it must outlive another lookup.
+char* search_in_path(const char *command) {
+    // If command contains /, don't search PATH
+    if (strchr(command, '/') != NULL) {
+        return (char *)command;
+    }
+
+    const char *path_env = var_get("PATH");
+    if (path_env == NULL) {
+        return NULL;
+    }
+
+    long long start_us = monotonic_us();
+    path_cache_validate(path_env);
+    PathEntry *e = path_cache_find(command);
+    int hit = e != NULL;
+    if (e == NULL) {
+        e = path_cache_fill(command);
+    }
+    long long dur_us = monotonic_us() - start_us;
+    if (hit) {
+        stats.lookup_hits++;
+    } else {
+        stats.lookup_misses++;
+    }
+    hist_add(&stats.lookup, dur_us);
+    trace_emit(&(TraceEvent){.event = "lookup", .start_us = start_us,
+                             .dur_us = dur_us, .name = command,
+                             .key = "hit", .value = hit});
+    if (e == NULL) {
+        return NULL;  // Command not found
+    }
+    e->hits++;
+    return e->path;
+}
+
+// hash builtin: inspect and reset the PATH lookup cache
+int builtin_hash(char **args) {
+  if (args[1] == NULL || strcmp(args[1], "-l") == 0) {
+    int reusable = args[1] != NULL;
+    if (path_cache.count == 0) {
+      printf("hash: hash table empty\n");
+      return 0;
+    }
+    if (!reusable) {
+      printf("hits\tcommand\n");
+    }
+    for (size_t b = 0; b < path_cache.num_buckets; b++) {
+      for (PathEntry *e = path_cache.buckets[b]; e != NULL; e = e->next) {
+        if (reusable) {
+          printf("hash -p %s %s\n", e->path, e->name);
+        } else {
+          printf("%4u\t%s\n", e->hits, e->path);
+        }
+      }
+    }
+    return 0;
+  }
+
+  if (strcmp(args[1], "-r") == 0) {
+    path_cache_clear();
+    return 0;
+  }
+
+  if (strcmp(args[1], "-d") == 0) {
+    int status = 0;
+    for (int i = 2; args[i] != NULL; i++) {
+      if (path_cache_find(args[i]) == NULL) {
+        fprintf(stderr, COLOR_RED "hash: %s: not found" COLOR_RESET "\n",
+                args[i]);
+        status = 1;
+      }
+      path_cache_forget(args[i]);
+    }
+    return status;
+  }
+
+  if (strcmp(args[1], "-p") == 0) {
+    if (args[2] == NULL || args[3] == NULL) {
+      fprintf(stderr, COLOR_RED "hash: usage: hash -p path name" COLOR_RESET
+                                "\n");
+      return 2;
+    }
+    const char *path_env = var_get("PATH");
+    path_cache_validate(path_env ? path_env : "");
+    // Pinned entries survive directory changes like bash's hash -p
+    path_cache_insert(args[3], args[2], PATH_PINNED);
+    return 0;
+  }
+
+  // hash name... : look the names up now so later runs hit the cache
+  int status = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    const char *path_env = var_get("PATH");
+    if (strchr(args[i], '/') != NULL || path_env == NULL) {
+      continue;
+    }
+    path_cache_validate(path_env);
+    if (path_cache_find(args[i]) == NULL &&
+        path_cache_fill(args[i]) == NULL) {
+      fprintf(stderr, COLOR_RED "hash: %s: not found" COLOR_RESET "\n",
+              args[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Data movers: cat, tee and head -c as pipeline stages. Bytes are moved
+// kernel-side with splice(2)/tee(2) when a pipe is involved, or sendfile(2)
+// from regular files, and copied through a buffer otherwise.
+#define MOVER_CHUNK 65536
+
+// Accept only the forms the builtin versions handle; anything else (cat -n,
+// head -n 5, ...) runs the external program
+int is_data_mover(char **args) {
+  Builtin *builtin = builtin_find(args[0]);
+  if (builtin == NULL || builtin->loaded != NULL ||
+      (builtin->flags & BUILTIN_DISABLED) != 0) {
+    return 0;
+  }
+  if (strcmp(args[0], "echo") == 0) {
+    return 1;
+  }
+  if (strcmp(args[0], "cat") == 0) {
+    for (int i = 1; args[i] != NULL; i++) {
+      if (args[i][0] == '-' && args[i][1] != '\0') {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  if (strcmp(args[0], "tee") == 0) {
+    for (int i = 1; args[i] != NULL; i++) {
+      if (args[i][0] == '-' && strcmp(args[i], "-a") != 0) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  if (strcmp(args[0], "head") == 0) {
+    const char *count = NULL;
+    int file = 2;
+    if (args[1] != NULL && strcmp(args[1], "-c") == 0) {
+      count = args[2];
+      file = 3;
+    } else if (args[1] != NULL && strncmp(args[1], "-c", 2) == 0) {
+      count = args[1] + 2;
+    }
+    if (count == NULL || *count == '\0' ||
+        strspn(count, "0123456789") != strlen(count)) {
+      return 0;
+    }
+    return args[file - 1] != NULL &&
+           (args[file] == NULL || (args[file + 1] == NULL && args[file][0] != '-'));
+  }
+  return 0;
+}
+
+// Whether a data mover stage would read a terminal. Run in the shell, such
+// a read would sit out Ctrl+C (the shell catches it), so the stage is
+// forked like any other instead.
+int mover_reads_terminal(char **args, LaunchSpec *spec) {
+  int reads_stdin = 0;
+  if (strcmp(args[0], "tee") == 0) {
+    reads_stdin = 1;
+  } else if (strcmp(args[0], "cat") == 0) {
+    reads_stdin = args[1] == NULL;
+    for (int i = 1; args[i] != NULL; i++) {
+      reads_stdin |= strcmp(args[i], "-") == 0;
+    }
+  } else if (strcmp(args[0], "head") == 0) {
+    const char *name = strcmp(args[1], "-c") == 0 ? args[3] : args[2];
+    reads_stdin = name == NULL || strcmp(name, "-") == 0;
+  }
+  if (!reads_stdin) {
+    return 0;
+  }
+  int in = STDIN_FILENO;
+  for (int i = 0; i < spec->num_fds; i++) {
+    if (spec->fds[i].to == STDIN_FILENO) {
+      in = spec->fds[i].from; // the last mapping wins, as in the child
+    }
+  }
+  return in >= 0 && isatty(in);
+}
+
+// Write all of buf, retrying short writes
+int write_full(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Copy from in to out until EOF, or at most limit bytes when limit >= 0.
+// Returns 0, or -1 with errno set.
+int copy_fd(int in, int out, long long limit) {
+#ifdef __linux__
+  int use_splice = 1;
+  int use_sendfile = 1;
+#endif
+  char buf[MOVER_CHUNK];
+  while (limit != 0) {
+    size_t want = MOVER_CHUNK;
+    if (limit > 0 && (long long)want > limit) {
+      want = limit;
+    }
+    ssize_t n;
+#ifdef __linux__
+    if (use_splice) {
+      n = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINVAL) {
+        use_splice = 0; // neither end is a pipe
+        continue;
+      }
+    } else if (use_sendfile) {
+      n = sendfile(out, in, NULL, want);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        use_sendfile = 0; // input cannot be mapped
+        continue;
+      }
+    } else
+#endif
+    {
+      n = read(in, buf, want);
+      if (n > 0 && write_full(out, buf, n) < 0) {
+        return -1;
+      }
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (limit > 0) {
+      limit -= n;
+    }
+  }
+  return 0;
+}
+
+// cat [FILE...] with no options; - is standard input
+int builtin_cat(char **args) {
+  char *standard_input[] = {"-", NULL};
+  char **files = args[1] != NULL ? args + 1 : standard_input;
+  int status = 0;
+  for (int i = 0; files[i] != NULL; i++) {
+    int fd = STDIN_FILENO;
+    if (strcmp(files[i], "-") != 0) {
+      fd = open(files[i], O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        fprintf(stderr, COLOR_RED "cat: %s: %s" COLOR_RESET "\n", files[i],
+                strerror(errno));
+        status = 1;
+        continue;
+      }
+    }
+    int err = copy_fd(fd, STDOUT_FILENO, -1) < 0 ? errno : 0;
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    if (err != 0) {
+      if (err != EPIPE) {
+        fprintf(stderr, COLOR_RED "cat: %s: %s" COLOR_RESET "\n", files[i],
+                strerror(err));
+      }
+      return 1;
+    }
+  }
+  return status;
+}
+
+// head -c N [FILE]
+int builtin_head(char **args) {
+  const char *count = strcmp(args[1], "-c") == 0 ? args[2] : args[1] + 2;
+  const char *name = strcmp(args[1], "-c") == 0 ? args[3] : args[2];
+  int fd = STDIN_FILENO;
+  if (name != NULL && strcmp(name, "-") != 0) {
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, COLOR_RED "head: %s: %s" COLOR_RESET "\n", name,
+              strerror(errno));
+      return 1;
+    }
+  }
+  int status = 0;
+  if (copy_fd(fd, STDOUT_FILENO, strtoll(count, NULL, 10)) < 0 &&
+      errno != EPIPE) {
+    fprintf(stderr, COLOR_RED "head: %s" COLOR_RESET "\n", strerror(errno));
+    status = 1;
+  }
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  return status;
+}
+
+#ifdef __linux__
+// Move exactly len bytes out of a pipe into fd, falling back to read and
+// write for targets splice cannot feed (such as terminals)
+int drain_pipe(int pipe_fd, int fd, size_t len, int *no_splice) {
+  char buf[MOVER_CHUNK];
+  while (len > 0) {
+    ssize_t n;
+    if (!*no_splice) {
+      n = splice(pipe_fd, NULL, fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINVAL) {
+        *no_splice = 1;
+        continue;
+      }
+    } else {
+      n = read(pipe_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+      if (n > 0 && write_full(fd, buf, n) < 0) {
+        return -1;
+      }
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      errno = EIO;
+      return -1;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+// Duplicate a pipe on stdin to every output without copying: each round
+// tee(2)s the pending data into one scratch pipe per output but the last,
+// which consumes it from stdin with splice(2). Scratch pipes are at least
+// as large as stdin, so tee always duplicates the whole round. Returns 0
+// at end of input, 1 if an output failed, or -1 when the caller should
+// copy the rest itself (stdin is not a pipe, or scratch pipes could not be
+// sized).
+int tee_splice(int *outs, int num_outs) {
+  int in_size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+  if (in_size < 0) {
+    return -1;
+  }
+  int (*scratch)[2] = arena_alloc(&cmd_arena, num_outs * sizeof(int[2]));
+  int *no_splice = arena_alloc(&cmd_arena, num_outs * sizeof(int));
+  memset(no_splice, 0, num_outs * sizeof(int));
+  int made = 0;
+  int status = 0;
+  while (status == 0 && made < num_outs - 1) {
+    if (make_pipe(scratch[made]) < 0) {
+      status = -1;
+      break;
+    }
+    made++;
+    if (fcntl(scratch[made - 1][1], F_SETPIPE_SZ, in_size) < in_size) {
+      status = -1;
+    }
+  }
+
+  while (status == 0) {
+    ssize_t n;
+    if (num_outs > 1) {
+      n = tee(STDIN_FILENO, scratch[0][1], in_size, 0);
+    } else {
+      n = splice(STDIN_FILENO, NULL, outs[0], NULL, in_size,
+                 SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINVAL) {
+        status = -1; // output cannot take splice; copy the rest
+        break;
+      }
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      status = n < 0 ? 1 : 2;
+      break;
+    }
+    if (num_outs == 1) {
+      continue;
+    }
+    for (int i = 1; i < num_outs - 1 && status == 0; i++) {
+      if (tee(STDIN_FILENO, scratch[i][1], n, 0) != n) {
+        status = 1;
+      }
+    }
+    for (int i = 0; i < num_outs && status == 0; i++) {
+      int from = i < num_outs - 1 ? scratch[i][0] : STDIN_FILENO;
+      if (drain_pipe(from, outs[i], n, &no_splice[i]) < 0) {
+        status = 1;
+      }
+    }
+  }
+  if (status == 1 && errno != EPIPE) {
+    fprintf(stderr, COLOR_RED "tee: %s" COLOR_RESET "\n", strerror(errno));
+  }
+  for (int i = 0; i < made; i++) {
+    close(scratch[i][0]);
+    close(scratch[i][1]);
+  }
+  return status == 2 ? 0 : status;
+}
+#endif
+
+// tee [-a] [FILE...]
+int builtin_tee(char **args) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int num_outs = 1;
+  int status = 0;
+  int count = 0;
+  while (args[count] != NULL) {
+    count++;
+  }
+  int *outs = arena_alloc(&cmd_arena, count * sizeof(int));
+  int *failed = arena_alloc(&cmd_arena, count * sizeof(int));
+  memset(failed, 0, count * sizeof(int));
+  outs[0] = STDOUT_FILENO;
+  for (int i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-a") == 0) {
+      flags = (flags & ~O_TRUNC) | O_APPEND;
+    }
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-a") == 0) {
+      continue;
+    }
+    int fd = open(args[i], flags, 0644);
+    if (fd < 0) {
+      fprintf(stderr, COLOR_RED "tee: %s: %s" COLOR_RESET "\n", args[i],
+              strerror(errno));
+      status = 1;
+      continue;
+    }
+    outs[num_outs++] = fd;
+  }
+
+  int result = -1;
+#ifdef __linux__
+  result = tee_splice(outs, num_outs);
+#endif
+  if (result < 0) {
+    char buf[MOVER_CHUNK];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        result = 1;
+        break;
+      }
+      for (int i = 0; i < num_outs; i++) {
+        if (!failed[i] && write_full(outs[i], buf, n) < 0) {
+          fprintf(stderr, COLOR_RED "tee: %s" COLOR_RESET "\n",
+                  strerror(errno));
+          failed[i] = 1;
+        }
+      }
+    }
+  }
+  for (int i = 0; i < num_outs; i++) {
+    if (failed[i]) {
+      result = 1;
+    }
+    if (i > 0) {
+      close(outs[i]);
+    }
+  }
+  return status || result > 0;
+}
+
+#ifndef __linux__
+int child_event_pipe[2] = {-1, -1};
+
+// Self-pipe fallback: the handler only writes a byte, all reaping happens
+// in the main loop
+void sigchld_handler(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  ssize_t ignored = write(child_event_pipe[1], "", 1);
+  (void)ignored;
+  errno = saved_errno;
+}
+#endif
+
+// Route SIGCHLD into child_event_fd instead of running code in signal
+// context. On Linux SIGCHLD stays blocked and is read from a signalfd.
+// Forked builtins call this again once the inherited channel is closed.
+void child_events_init(void) {
+#ifdef __linux__
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  child_event_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+#else
+  if (make_pipe(child_event_pipe) == 0) {
+    fcntl(child_event_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(child_event_pipe[1], F_SETFL, O_NONBLOCK);
+    child_event_fd = child_event_pipe[0];
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+#endif
+}
+
+// Consume pending child events; returns 1 if there were any
+int child_events_drain(void) {
+  char buf[256];
+  int seen = 0;
+  if (child_event_fd < 0) {
+    return 1;
+  }
+  while (read(child_event_fd, buf, sizeof(buf)) > 0) {
+    seen = 1;
+  }
+  return seen;
+}
+
+// Hand out the smallest free job id
+int job_alloc_id(void) {
+  JobTable *t = &job_table;
+  if (t->num_free == 0) {
+    return ++t->next_id;
+  }
+
+  int id = t->free_ids[0];
+  int last = t->free_ids[--t->num_free];
+  int i = 0;
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= t->num_free) {
+      break;
+    }
+    if (child + 1 < t->num_free && t->free_ids[child + 1] < t->free_ids[child]) {
+      child++;
+    }
+    if (last <= t->free_ids[child]) {
+      break;
+    }
+    t->free_ids[i] = t->free_ids[child];
+    i = child;
+  }
+  t->free_ids[i] = last;
+  return id;
+}
+
+// Return an id to the free heap
+void job_release_id(int id) {
+  JobTable *t = &job_table;
+  if (t->num_free == t->free_cap) {
+    t->free_cap = t->free_cap ? t->free_cap * 2 : 16;
+    t->free_ids = realloc(t->free_ids, t->free_cap * sizeof(int));
+  }
+  int i = t->num_free++;
+  while (i > 0 && t->free_ids[(i - 1) / 2] > id) {
+    t->free_ids[i] = t->free_ids[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  t->free_ids[i] = id;
+}
+
+// Index a child pid for O(1) lookup when it is reaped
+void pid_table_add(pid_t pid, Job *job, int proc) {
+  JobTable *t = &job_table;
+  if (t->num_pids + 1 > t->num_buckets * 3 / 4) {
+    size_t new_size = t->num_buckets ? t->num_buckets * 2 : 64;
+    PidSlot **buckets = calloc(new_size, sizeof(PidSlot *));
+    for (size_t b = 0; b < t->num_buckets; b++) {
+      PidSlot *slot = t->buckets[b];
+      while (slot != NULL) {
+        PidSlot *next = slot->next;
+        size_t i = (size_t)slot->pid & (new_size - 1);
+        slot->next = buckets[i];
+        buckets[i] = slot;
+        slot = next;
+      }
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->num_buckets = new_size;
+  }
+
+  PidSlot *slot = malloc(sizeof(PidSlot));
+  size_t i = (size_t)pid & (t->num_buckets - 1);
+  slot->pid = pid;
+  slot->job = job;
+  slot->proc = proc;
+  slot->next = t->buckets[i];
+  t->buckets[i] = slot;
+  t->num_pids++;
+}
+
+// Remove a pid from the index, returning its job (NULL if not a job)
+Job *pid_table_take(pid_t pid, int *proc) {
+  JobTable *t = &job_table;
+  if (t->num_buckets == 0) {
+    return NULL;
+  }
+  PidSlot **link = &t->buckets[(size_t)pid & (t->num_buckets - 1)];
+  while (*link != NULL) {
+    PidSlot *slot = *link;
+    if (slot->pid == pid) {
+      Job *job = slot->job;
+      *proc = slot->proc;
+      *link = slot->next;
+      free(slot);
+      t->num_pids--;
+      return job;
+    }
+    link = &slot->next;
+  }
+  return NULL;
+}
+
+// The job a pid belongs to, or NULL, leaving the pid indexed
+Job *pid_table_find(pid_t pid) {
+  JobTable *t = &job_table;
+  if (t->num_buckets == 0) {
+    return NULL;
+  }
+  PidSlot *slot = t->buckets[(size_t)pid & (t->num_buckets - 1)];
+  while (slot != NULL && slot->pid != pid) {
+    slot = slot->next;
+  }
+  return slot != NULL ? slot->job : NULL;
+}
+
+// Add an empty job to the table; its processes are attached by job_start
+// or, for a pipeline or list, as they are launched (job_add_proc)
+Job *job_create(const char *command, size_t command_len) {
+  JobTable *t = &job_table;
+  Job *job = calloc(1, sizeof(Job));
+  job->id = job_alloc_id();
+  job->state = JOB_QUEUED;
+  job->command = strndup(command, command_len);
+
+  if (job->id >= t->id_cap) {
+    int cap = t->id_cap ? t->id_cap : 16;
+    while (job->id >= cap) {
+      cap *= 2;
+    }
+    t->by_id = realloc(t->by_id, cap * sizeof(Job *));
+    memset(t->by_id + t->id_cap, 0, (cap - t->id_cap) * sizeof(Job *));
+    t->id_cap = cap;
+  }
+  t->by_id[job->id] = job;
+  return job;
+}
+
+// Drop a finished job and recycle its id
+void job_remove(Job *job) {
+  if (job->stop_notice) {
+    job_table.stop_notices--;
+  }
+  job_table.by_id[job->id] = NULL;
+  job_release_id(job->id);
+  free(job->command);
+  free(job->procs);
+  free(job->limits);
+  free(job);
+}
+
+// Unlink a finished job from the done queue
+void job_unlink_done(Job *job) {
+  JobTable *t = &job_table;
+  if (job->prev_done != NULL) {
+    job->prev_done->next_done = job->next_done;
+  } else {
+    t->done_head = job->next_done;
+  }
+  if (job->next_done != NULL) {
+    job->next_done->prev_done = job->prev_done;
+  } else {
+    t->done_tail = job->prev_done;
+  }
+  job->next_done = job->prev_done = NULL;
+  t->num_done--;
+}
+
+// Take a job off the queue of jobs waiting for a slot, if it is there
+void job_dequeue(Job *job) {
+  JobTable *t = &job_table;
+  Job *prev = NULL;
+  for (Job *q = t->queue_head; q != NULL; prev = q, q = q->next_queued) {
+    if (q == job) {
+      if (prev != NULL) {
+        prev->next_queued = job->next_queued;
+      } else {
+        t->queue_head = job->next_queued;
+      }
+      if (t->queue_tail == job) {
+        t->queue_tail = prev;
+      }
+      t->queued--;
+      return;
+    }
+  }
+}
+
+// Mark a job finished with the given status and queue its notice. A job
+// can finish while still queued: killed, or held at its gate when it died.
+void job_finish(Job *job, int status) {
+  JobTable *t = &job_table;
+  stats.jobs_reaped++;
+  if (job->state == JOB_RUNNING) {
+    t->running--;
+  } else if (job->state == JOB_QUEUED) {
+    job_dequeue(job);
+  }
+  if (job->gate > 0) {
+    close(job->gate);
+    job->gate = 0;
+  }
+  job->status = status;
+  job->state = JOB_DONE;
+  job->prev_done = t->done_tail;
+  if (t->done_tail != NULL) {
+    t->done_tail->next_done = job;
+  } else {
+    t->done_head = job;
+  }
+  t->done_tail = job;
+  t->num_done++;
+}
+
+// Record a reaped child; the job completes when its last process exits.
+// Returns 0 if the pid does not belong to any job.
+int job_proc_exited(pid_t pid, int status) {
+  int proc;
+  Job *job = pid_table_take(pid, &proc);
+  if (job == NULL) {
+    return 0;
+  }
+
+  job->procs[proc].status = status;
+  job->procs[proc].exited = 1;
+  trace_emit(&(TraceEvent){.event = "reap", .start_us = monotonic_us(),
+                           .pid = pid, .job = job->id, .key = "status",
+                           .value = WIFEXITED(status) ? WEXITSTATUS(status)
+                                                      : 128 + WTERMSIG(status)});
+  if (--job->live_procs > 0) {
+    return 1;
+  }
+
+  int last = job->procs[job->num_procs - 1].status;
+  job_finish(job, WIFEXITED(last) ? WEXITSTATUS(last) : 128 + WTERMSIG(last));
+  return 1;
+}
+
+// Attach a launched process to a job. The first one leads the job's
+// process group.
+void job_add_proc(Job *job, pid_t pid) {
+  job->procs = realloc(job->procs, (job->num_procs + 1) * sizeof(JobProc));
+  job->procs[job->num_procs].pid = pid;
+  job->procs[job->num_procs].status = 0;
+  job->procs[job->num_procs].exited = 0;
+  pid_table_add(pid, job, job->num_procs);
+  job->num_procs++;
+  job->live_procs++;
+  if (job->pgid == 0) {
+    job->pgid = pid;
+  }
+}
+
+// Record a pipeline stage that could not be started as if it had exited
+// with status, so a job whose last stage is missing ends with 127 like a
+// foreground pipeline would
+void job_add_failed(Job *job, int status) {
+  job->procs = realloc(job->procs, (job->num_procs + 1) * sizeof(JobProc));
+  job->procs[job->num_procs].pid = 0;
+  job->procs[job->num_procs].status = status << 8; // as a wait status
+  job->procs[job->num_procs].exited = 1;
+  job->num_procs++;
+}
+
+// A job's processes are all launched: it runs and takes a slot, and $!
+// is its last process
+void job_running(Job *job) {
+  job->state = JOB_RUNNING;
+  int last = job->num_procs - 1;
+  if (job->procs[last].pid == 0 && last > 0) {
+    last--; // a last stage that failed to start
+  }
+  last_bg_pid = job->procs[last].pid;
+  job_table.running++;
+  stats.jobs_started++;
+}
+
+// Launch a job's command and attach the child to it. A launch failure
+// finishes the job at once with the status the shell would have set.
+void job_start(Job *job, char **argv, char **env) {
+  LaunchSpec spec = {0};
+  spec.argv = argv;
+  spec.env = env;
+  spec.limits = job->limits;
+  spec.pgid = -1;
+  while (env != NULL && env[spec.num_env] != NULL) {
+    spec.num_env++;
+  }
+  int saved_status = last_status;
+  trace.job = job->id;
+  pid_t pid = launch_external(&spec);
+  trace.job = 0;
+  int status = last_status;
+  last_status = saved_status;
+
+  if (pid < 0) {
+    stats.jobs_started++;
+    job_finish(job, status);
+    return;
+  }
+  job_add_proc(job, pid);
+  job_running(job);
+}
+
+// Heap copy of a NULL-terminated argv
+char **argv_copy(char **argv) {
+  int argc = 0;
+  while (argv[argc] != NULL) {
+    argc++;
+  }
+  char **copy = malloc((argc + 1) * sizeof(char *));
+  for (int i = 0; i < argc; i++) {
+    copy[i] = strdup(argv[i]);
+  }
+  copy[argc] = NULL;
+  return copy;
+}
+
+// Free a copied argv
+void argv_free_copy(char **argv) {
+  for (int i = 0; argv[i] != NULL; i++) {
+    free(argv[i]);
+  }
+  free(argv);
+}
+
+// Add a job to the queue of jobs waiting for a slot
+void job_enqueue(Job *job) {
+  JobTable *t = &job_table;
+  if (t->queue_tail != NULL) {
+    t->queue_tail->next_queued = job;
+  } else {
+    t->queue_head = job;
+  }
+  t->queue_tail = job;
+  t->queued++;
+}
+
+// Start queued jobs, oldest first, while there are free slots
+void jobs_dispatch(void) {
+  JobTable *t = &job_table;
+  while (t->queue_head != NULL && (job_slots <= 0 || t->running < job_slots)) {
+    Job *job = t->queue_head;
+    t->queue_head = job->next_queued;
+    if (t->queue_head == NULL) {
+      t->queue_tail = NULL;
+    }
+    t->queued--;
+    if (job->gate > 0) {
+      // Forked when it was queued: open its gate
+      ssize_t ignored = write(job->gate, "", 1);
+      (void)ignored;
+      close(job->gate);
+      job->gate = 0;
+      job_running(job);
+      continue;
+    }
+    job_start(job, job->argv, job->env);
+    argv_free_copy(job->argv);
+    job->argv = NULL;
+    if (job->env != NULL) {
+      argv_free_copy(job->env);
+      job->env = NULL;
+    }
+  }
+}
+
+// A job's process stopped (Ctrl+Z, kill -STOP, or reading the terminal
+// from the background) or was continued. The job follows its processes;
+// while stopped it gives up its slot.
+void job_proc_stopped(pid_t pid, int stopped) {
+  JobTable *t = &job_table;
+  Job *job = pid_table_find(pid);
+  if (job == NULL) {
+    return; // a foreground child; it is waited for as usual
+  }
+  if (stopped && job->state == JOB_RUNNING) {
+    job->state = JOB_STOPPED;
+    t->running--;
+    if (job != t->foreground && interactive && !job->stop_notice) {
+      job->stop_notice = 1;
+      t->stop_notices++;
+    }
+  } else if (!stopped && job->state == JOB_STOPPED) {
+    job->state = JOB_RUNNING;
+    t->running++;
+  }
+}
+
+// Collect every child that has exited or stopped, without blocking
+void jobs_reap(void) {
+  pid_t pid;
+  int status;
+  if (!child_events_drain()) {
+    return;
+  }
+  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+      job_proc_stopped(pid, WIFSTOPPED(status));
+    } else if (!job_proc_exited(pid, status)) {
+      reaped_fg_add(pid, status); // a foreground child
+    }
+  }
+  jobs_dispatch();
+}
+
+// Block until a child changes state. Returns -1 if a signal such as
+// Ctrl+C interrupted the wait.
+int wait_child_event(void) {
+  if (child_event_fd < 0) {
+    poll(NULL, 0, 10);
+    return 0;
+  }
+  struct pollfd pfd;
+  pfd.fd = child_event_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+    return -1;
+  }
+  return 0;
+}
+
+// Describe how a finished job ended, for notices and the jobs listing
+void job_describe(Job *job, char *buf, size_t size) {
+  if (job->state == JOB_QUEUED) {
+    snprintf(buf, size, "Queued");
+  } else if (job->state == JOB_RUNNING) {
+    snprintf(buf, size, "Running");
+  } else if (job->state == JOB_STOPPED) {
+    snprintf(buf, size, "Stopped");
+  } else if (job->status == 0) {
+    snprintf(buf, size, "Done");
+  } else if (job->status > 128) {
+    snprintf(buf, size, "Killed (signal %d)", job->status - 128);
+  } else {
+    snprintf(buf, size, "Exit %d", job->status);
+  }
+}
+
+// Print notices for jobs that stopped in the background, and completion
+// notices for finished jobs, freeing those. Only called
+// from the main loop, never from a signal handler. Without a terminal
+// there is nobody to notify, so finished jobs stay until a script collects
+// them with wait (at most JOB_REMEMBER_MAX of them). Returns the number of
+// notices printed.
+int job_notify(void) {
+  int printed = 0;
+  for (int id = 1; job_table.stop_notices > 0 && id < job_table.id_cap; id++) {
+    Job *job = job_table.by_id[id];
+    if (job != NULL && job->stop_notice) {
+      job->stop_notice = 0;
+      job_table.stop_notices--;
+      if (job->state == JOB_STOPPED) {
+        printf("[%d]+ %-24s%s\n", job->id, "Stopped", job->command);
+        printed++;
+      }
+    }
+  }
+  while (job_table.done_head != NULL &&
+         (interactive || job_table.num_done > JOB_REMEMBER_MAX)) {
+    Job *job = job_table.done_head;
+    job_unlink_done(job);
+    if (interactive) {
+      char state[64];
+      job_describe(job, state, sizeof(state));
+      printf("[%d]+ %-24s%s\n", job->id, state, job->command);
+      printed++;
+    }
+    job_remove(job);
+  }
+  if (printed) {
+    fflush(stdout);
+  }
+  return printed;
+}
+
+// Block until fd has input, reaping children and announcing finished
+// jobs (then redrawing the prompt) while the shell sits at the prompt
+void wait_for_input(int fd) {
+  while (1) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = child_event_fd;
+    fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+
+    if (poll(fds, child_event_fd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      jobs_reap();
+      if (interactive &&
+          (job_table.done_head != NULL || job_table.stop_notices > 0)) {
+        printf("\n");
+        job_notify();
+        if (editor.active) {
+          edit_redraw();
+        } else {
+          prompt_show(0);
+        }
+      }
+    }
+    if (fds[0].revents != 0) {
+      return;
+    }
+  }
+}
+
+// Start an external command in the background and record it as a job.
+// When every job slot is busy the expanded command is queued instead.
+void execute_external_background(char **args, char **env,
+                                 const ProcLimits *limits,
+                                 const char *command, size_t command_len) {
+  if (search_in_path(args[0]) == NULL) {
+    fprintf(stderr, COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n",
+            args[0]);
+    last_status = 127;
+    return;
+  }
+
+  JobTable *t = &job_table;
+  Job *job = job_create(command, command_len);
+  if (limits != NULL) {
+    job->limits = malloc(sizeof(ProcLimits));
+    *job->limits = *limits;
+  }
+  if (t->queue_head == NULL && (job_slots <= 0 || t->running < job_slots)) {
+    job_start(job, args, env);
+    if (interactive && job->state == JOB_RUNNING) {
+      printf("[%d] %d\n", job->id, job->procs[0].pid);
+    }
+  } else {
+    job->argv = argv_copy(args);
+    job->env = env != NULL ? argv_copy(env) : NULL;
+    job_enqueue(job);
+    if (interactive) {
+      printf("[%d] queued\n", job->id);
+    }
+  }
+  last_status = 0;
+}
+
+// The job fg and bg act on by default: the most recent stopped job, or
+// else the most recent running one
+Job *job_current(void) {
+  Job *running = NULL;
+  for (int id = job_table.id_cap - 1; id > 0; id--) {
+    Job *job = job_table.by_id[id];
+    if (job != NULL && job->state == JOB_STOPPED) {
+      return job;
+    }
+    if (job != NULL && job->state == JOB_RUNNING && running == NULL) {
+      running = job;
+    }
+  }
+  return running;
+}
+
+// Find the job running (or queued) as %N, %% (the current job) or as pid N
+Job *job_lookup(const char *spec) {
+  char *end;
+  if (strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+    return job_current();
+  }
+  if (spec[0] == '%') {
+    long id = strtol(spec + 1, &end, 10);
+    if (*end != '\0' || end == spec + 1 || id <= 0 || id >= job_table.id_cap) {
+      return NULL;
+    }
+    return job_table.by_id[id];
+  }
+
+  long pid = strtol(spec, &end, 10);
+  if (*end != '\0' || end == spec || pid <= 0) {
+    return NULL;
+  }
+  for (int id = 1; id < job_table.id_cap; id++) {
+    Job *job = job_table.by_id[id];
+    if (job == NULL) {
+      continue;
+    }
+    for (int i = 0; i < job->num_procs; i++) {
+      if (job->procs[i].pid == pid) {
+        return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Collect a finished job for wait: its status is returned and, as it has
+// now been reported, no completion notice is printed for it
+int job_collect(Job *job) {
+  int status = job->status;
+  job_unlink_done(job);
+  job_remove(job);
+  return status;
+}
+
+// wait           : wait for every job, running and queued; status 0
+// wait -n        : wait for the next job to finish; its status, or 127 if
+//                  there are no jobs
+// wait %N | PID  : wait for the given jobs; status of the last one
+// Ctrl+C abandons the wait with status 130.
+int builtin_wait(char **args) {
+  JobTable *t = &job_table;
+  interrupted = 0;
+
+  if (args[1] == NULL) {
+    jobs_reap();
+    while (t->running > 0 || t->queued > 0) {
+      if (wait_child_event() < 0 && interrupted) {
+        return 130;
+      }
+      jobs_reap();
+    }
+    while (t->done_head != NULL) {
+      job_collect(t->done_head);
+    }
+    return 0;
+  }
+
+  if (strcmp(args[1], "-n") == 0) {
+    jobs_reap();
+    while (t->done_head == NULL) {
+      if (t->running == 0 && t->queued == 0) {
+        return 127;
+      }
+      if (wait_child_event() < 0 && interrupted) {
+        return 130;
+      }
+      jobs_reap();
+    }
+    return job_collect(t->done_head);
+  }
+
+  int status = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    jobs_reap();
+    Job *job = job_lookup(args[i]);
+    if (job == NULL) {
+      fprintf(stderr, COLOR_RED "wait: %s: no such job" COLOR_RESET "\n",
+              args[i]);
+      status = 127;
+      continue;
+    }
+    while (job->state != JOB_DONE) {
+      if (wait_child_event() < 0 && interrupted) {
+        return 130;
+      }
+      jobs_reap();
+    }
+    status = job_collect(job);
+  }
+  return status;
+}
+
+// Drop a queued command before it started, as if sig had killed it
+void job_cancel(Job *job, int sig) {
+  argv_free_copy(job->argv);
+  job->argv = NULL;
+  if (job->env != NULL) {
+    argv_free_copy(job->env);
+    job->env = NULL;
+  }
+  job_finish(job, 128 + sig);
+}
+
+// Hand the terminal to a process group. SIGTTOU is blocked meanwhile: the
+// shell is itself in the background when it takes the terminal back.
+void terminal_give(pid_t pgid) {
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &block, &old);
+  tcsetpgrp(STDIN_FILENO, pgid);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// Continue a job in the foreground and wait until it ends or stops again.
+// On a terminal the job's group gets the terminal, so Ctrl+C and Ctrl+Z
+// reach the whole job and not the shell; the terminal modes the shell had
+// are restored afterwards. Returns the job's status, or 128 + SIGTSTP if
+// it stopped.
+int job_foreground(Job *job) {
+  JobTable *t = &job_table;
+  int tty = interactive && tcgetpgrp(STDIN_FILENO) == getpgrp();
+  if (tty) {
+    terminal_give(job->pgid);
+  }
+  if (job->state == JOB_STOPPED) {
+    job->state = JOB_RUNNING;
+    t->running++;
+  }
+  kill(-job->pgid, SIGCONT);
+  t->foreground = job;
+  interrupted = 0;
+  int status = 130;
+  while (job->state == JOB_RUNNING) {
+    // Without a terminal Ctrl+C reaches the shell instead: stop waiting
+    if (wait_child_event() < 0 && interrupted && !tty) {
+      break;
+    }
+    jobs_reap();
+  }
+  t->foreground = NULL;
+  if (tty) {
+    terminal_give(getpgrp());
+    if (editor.enabled) {
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.cooked);
+    }
+  }
+  if (job->state == JOB_STOPPED) {
+    printf("\n[%d]+ %-24s%s\n", job->id, "Stopped", job->command);
+    return 128 + SIGTSTP;
+  }
+  if (job->state == JOB_DONE) {
+    status = job_collect(job);
+  }
+  return status;
+}
+
+// The job named by a fg or bg argument, or the current job without one.
+// Reports the problem and returns NULL if there is no such job.
+Job *job_argument(const char *builtin, const char *spec) {
+  jobs_reap();
+  Job *job = spec != NULL ? job_lookup(spec) : job_current();
+  if (job == NULL) {
+    fprintf(stderr, COLOR_RED "%s: %s: no such job" COLOR_RESET "\n",
+            builtin, spec != NULL ? spec : "current");
+    return NULL;
+  }
+  if (job->state == JOB_QUEUED) {
+    fprintf(stderr, COLOR_RED "%s: %%%d: job has not started" COLOR_RESET "\n",
+            builtin, job->id);
+    return NULL;
+  }
+  return job;
+}
+
+// fg [%N] : bring a job (by default the current one) to the foreground,
+//           continuing it if it was stopped; its status
+int builtin_fg(char **args) {
+  Job *job = job_argument("fg", args[1]);
+  if (job == NULL) {
+    return 1;
+  }
+  printf("%s\n", job->command);
+  fflush(stdout);
+  if (job->state == JOB_DONE) {
+    return job_collect(job);
+  }
+  return job_foreground(job);
+}
+
+// bg [%N] : continue a stopped job (by default the current one) in the
+//           background
+int builtin_bg(char **args) {
+  Job *job = job_argument("bg", args[1]);
+  if (job == NULL) {
+    return 1;
+  }
+  if (job->state == JOB_STOPPED) {
+    job->state = JOB_RUNNING;
+    job_table.running++;
+    kill(-job->pgid, SIGCONT);
+  }
+  printf("[%d]+ %s &\n", job->id, job->command);
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  int sig;
+} SignalName;
+
+SignalName signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+    {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+    {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+    {"WINCH", SIGWINCH},
+};
+
+#define NUM_SIGNAL_NAMES (int)(sizeof(signal_names) / sizeof(signal_names[0]))
+
+// Parse a signal given as a number or a name, with or without SIG
+int parse_signal(const char *text) {
+  long sig;
+  if (parse_number(text, 0, NSIG - 1, &sig) == 0) {
+    return (int)sig;
+  }
+  if (strncasecmp(text, "SIG", 3) == 0) {
+    text += 3;
+  }
+  for (int i = 0; i < NUM_SIGNAL_NAMES; i++) {
+    if (strcasecmp(text, signal_names[i].name) == 0) {
+      return signal_names[i].sig;
+    }
+  }
+  return -1;
+}
+
+// kill [-SIG | -s SIG] %N | PID ... : send a signal (TERM by default);
+//                                     a job's whole process group gets it
+// kill -l                           : list the signal names
+int builtin_kill(char **args) {
+  int sig = SIGTERM;
+  int i = 1;
+  if (args[1] != NULL && strcmp(args[1], "-l") == 0) {
+    for (int n = 0; n < NUM_SIGNAL_NAMES; n++) {
+      printf("%2d) SIG%s\n", signal_names[n].sig, signal_names[n].name);
+    }
+    return 0;
+  }
+  if (args[1] != NULL && strcmp(args[1], "-s") == 0 && args[2] != NULL) {
+    sig = parse_signal(args[2]);
+    i = 3;
+  } else if (args[1] != NULL && args[1][0] == '-' && args[1][1] != '\0') {
+    sig = parse_signal(args[1] + 1);
+    i = 2;
+  }
+  if (sig < 0) {
+    fprintf(stderr, COLOR_RED "kill: %s: invalid signal" COLOR_RESET "\n",
+            args[i - 1]);
+    return 1;
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr, COLOR_RED "kill: usage: kill [-SIG | -s SIG] %%N | PID ..."
+                    COLOR_RESET "\n");
+    return 2;
+  }
+
+  int status = 0;
+  jobs_reap();
+  for (; args[i] != NULL; i++) {
+    if (args[i][0] != '%') {
+      long pid;
+      if (parse_number(args[i], 1, INT_MAX, &pid) < 0) {
+        fprintf(stderr, COLOR_RED "kill: %s: not a pid or job" COLOR_RESET "\n",
+                args[i]);
+        status = 1;
+      } else if (kill((pid_t)pid, sig) < 0) {
+        fprintf(stderr, COLOR_RED "kill: %s: %s" COLOR_RESET "\n", args[i],
+                strerror(errno));
+        status = 1;
+      }
+      continue;
+    }
+
+    Job *job = job_lookup(args[i]);
+    if (job == NULL || job->state == JOB_DONE) {
+      fprintf(stderr, COLOR_RED "kill: %s: no such job" COLOR_RESET "\n",
+              args[i]);
+      status = 1;
+    } else if (job->state == JOB_QUEUED && job->num_procs == 0) {
+      // Nothing to signal yet; the command just never starts
+      if (sig != 0) {
+        job_cancel(job, sig);
+      }
+    } else if (kill(-job->pgid, sig) < 0) {
+      fprintf(stderr, COLOR_RED "kill: %s: %s" COLOR_RESET "\n", args[i],
+              strerror(errno));
+      status = 1;
+    } else if (job->state == JOB_STOPPED && sig != SIGKILL && sig != SIGCONT &&
+               sig != 0) {
+      // A stopped job only acts on the signal once it runs again
+      kill(-job->pgid, SIGCONT);
+    }
+  }
+  return status;
+}
+
+// Raising the slot limit can start queued jobs right away
+void job_slots_changed(void) {
+  jobs_dispatch();
+}
+
+ShellOption shell_options[] = {
+    {"jobslots", OPT_NUMBER, &job_slots, NULL, job_slots_changed,
+     "background jobs run at once (0 = no limit)"},
+    {"pipesize", OPT_SIZE, &pipe_size, NULL, NULL,
+     "pipeline pipe capacity (0 = system default)"},
+    {"globcache", OPT_BOOL, &glob_cache, NULL, glob_cache_changed,
+     "reuse directory listings of unchanged directories for 2s in globs"},
+    {"pipestats", OPT_BOOL, &pipe_stats, NULL, NULL,
+     "relay pipelines and report bytes and stalls per pipe"},
+    {"trace", OPT_TEXT, NULL, &trace.path, trace_changed,
+     "append a JSONL execution trace to this file"},
+};
+
+#define NUM_SHELL_OPTIONS (int)(sizeof(shell_options) / sizeof(shell_options[0]))
+
+// Parse a byte count such as 65536, 64K or 1M
+int parse_size(const char *text, long *size) {
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || value < 0) {
+    return -1;
+  }
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    value <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    value <<= 30;
+    end++;
+    break;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  *size = value;
+  return 0;
+}
+
+// Render an option value the way set accepts it
+void format_option(ShellOption *opt, char *buf, size_t size) {
+  if (opt->kind == OPT_TEXT) {
+    snprintf(buf, size, "%s", *opt->text ? *opt->text : "off");
+    return;
+  }
+  long value = *opt->value;
+  if (opt->kind == OPT_BOOL) {
+    snprintf(buf, size, "%s", value ? "on" : "off");
+  } else if (opt->kind == OPT_SIZE && value != 0 && value % (1L << 20) == 0) {
+    snprintf(buf, size, "%ldM", value >> 20);
+  } else if (opt->kind == OPT_SIZE && value != 0 && value % 1024 == 0) {
+    snprintf(buf, size, "%ldK", value >> 10);
+  } else {
+    snprintf(buf, size, "%ld", value);
+  }
+}
+
+// set             : list options with their values
+// set name=value  : change an option
+int builtin_set(char **args) {
+  char shown[PATH_MAX];
+  if (args[1] != NULL && strcmp(args[1], "--") == 0) {
+    pos_set(args + 2);
+    return 0;
+  }
+  if (args[1] == NULL) {
+    for (int i = 0; i < NUM_SHELL_OPTIONS; i++) {
+      format_option(&shell_options[i], shown, sizeof(shown));
+      printf("%-12s %-8s # %s\n", shell_options[i].name, shown,
+             shell_options[i].help);
+    }
+    return 0;
+  }
+
+  int status = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    char *eq = strchr(args[i], '=');
+    size_t name_len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+    ShellOption *opt = NULL;
+    for (int j = 0; j < NUM_SHELL_OPTIONS; j++) {
+      if (strlen(shell_options[j].name) == name_len &&
+          strncmp(shell_options[j].name, args[i], name_len) == 0) {
+        opt = &shell_options[j];
+      }
+    }
+    if (opt == NULL) {
+      fprintf(stderr, COLOR_RED "set: %.*s: unknown option" COLOR_RESET "\n",
+              (int)name_len, args[i]);
+      status = 1;
+      continue;
+    }
+    if (eq == NULL) {
+      format_option(opt, shown, sizeof(shown));
+      printf("%s=%s\n", opt->name, shown);
+      continue;
+    }
+
+    const char *text = eq + 1;
+    long value = -1;
+    char *end;
+    if (opt->kind == OPT_TEXT) {
+      free(*opt->text);
+      *opt->text = *text && strcmp(text, "off") != 0 ? strdup(text) : NULL;
+      if (opt->changed != NULL) {
+        opt->changed();
+      }
+      continue;
+    }
+    if (opt->kind == OPT_BOOL) {
+      if (strcmp(text, "on") == 0 || strcmp(text, "1") == 0) {
+        value = 1;
+      } else if (strcmp(text, "off") == 0 || strcmp(text, "0") == 0) {
+        value = 0;
+      }
+    } else if (opt->kind == OPT_SIZE) {
+      if (parse_size(text, &value) < 0) {
+        value = -1;
+      }
+    } else {
+      value = strtol(text, &end, 10);
+      if (*text == '\0' || *end != '\0') {
+        value = -1;
+      }
+    }
+    if (value < 0) {
+      fprintf(stderr, COLOR_RED "set: %s: invalid value" COLOR_RESET "\n",
+              args[i]);
+      status = 1;
+      continue;
+    }
+    *opt->value = value;
+    if (opt->changed != NULL) {
+      opt->changed();
+    }
+  }
+  return status;
+}
+
+// Build the argv for one item: {} in the template is replaced by the
+// item, which is appended as a last argument when there is no {}
+void parallel_argv(char **template, const char *item, ArgVec *out) {
+  int substituted = 0;
+  for (int i = 0; template[i] != NULL; i++) {
+    StrBuf sb = {0};
+    const char *s = template[i];
+    const char *hole;
+    while ((hole = strstr(s, "{}")) != NULL) {
+      sb_append(&sb, s, hole - s);
+      sb_append(&sb, item, strlen(item));
+      s = hole + 2;
+      substituted = 1;
+    }
+    sb_append(&sb, s, strlen(s));
+    argv_push(out, sb_finish(&sb));
+  }
+  if (!substituted) {
+    argv_push(out, strdup(item));
+  }
+}
+
+int compare_long_long(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Print per-item latency and overall throughput to stderr
+void parallel_report(long long *latencies, size_t n, long long elapsed_us,
+                     int failed) {
+  if (n == 0) {
+    return;
+  }
+  qsort(latencies, n, sizeof(long long), compare_long_long);
+  long long total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += latencies[i];
+  }
+  double secs = elapsed_us / 1e6;
+  fprintf(stderr,
+          "parallel: %zu items in %.3fs (%.1f/s), %d failed; latency ms "
+          "min %.2f avg %.2f p50 %.2f p95 %.2f max %.2f\n",
+          n, secs, secs > 0 ? n / secs : 0.0, failed, latencies[0] / 1e3,
+          total / 1e3 / n, latencies[n / 2] / 1e3,
+          latencies[(n * 95) / 100 < n ? (n * 95) / 100 : n - 1] / 1e3,
+          latencies[n - 1] / 1e3);
+}
+
+// parallel [-j N] [-k] cmd [arg...] [::: item...]
+// Run cmd once per item: the words after :::, or else the lines of stdin.
+// At most N children (default: jobslots, or the CPU count when that is
+// unlimited) run at once, launched directly through launch_external. With
+// -k each item's output goes through a pipe and is written in input order;
+// the oldest unfinished item streams, later ones are buffered. Returns the
+// number of failed items, capped at 101 like GNU parallel.
+int builtin_parallel(char **args) {
+  long slots = job_slots > 0 ? job_slots : sysconf(_SC_NPROCESSORS_ONLN);
+  int keep_order = 0;
+  int i = 1;
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(args[i], "-k") == 0) {
+      keep_order = 1;
+      continue;
+    }
+    if (strncmp(args[i], "-j", 2) == 0) {
+      const char *n = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+      char *end;
+      if (n == NULL || (slots = strtol(n, &end, 10)) < 1 || *end != '\0') {
+        fprintf(stderr, COLOR_RED "parallel: -j: invalid count" COLOR_RESET
+                        "\n");
+        return 2;
+      }
+      continue;
+    }
+    fprintf(stderr, COLOR_RED "parallel: %s: unknown option" COLOR_RESET "\n",
+            args[i]);
+    return 2;
+  }
+
+  char **template = &args[i];
+  char **items = NULL;
+  for (int j = i; args[j] != NULL; j++) {
+    if (strcmp(args[j], ":::") == 0) {
+      args[j] = NULL;
+      items = &args[j + 1];
+      break;
+    }
+  }
+  if (template[0] == NULL) {
+    fprintf(stderr, COLOR_RED "usage: parallel [-j N] [-k] cmd {} [::: item...]"
+                    COLOR_RESET "\n");
+    return 2;
+  }
+  if (strstr(template[0], "{}") == NULL && search_in_path(template[0]) == NULL) {
+    fprintf(stderr, COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n",
+            template[0]);
+    return 127;
+  }
+
+  // Items read from stdin must not also be eaten by the commands
+  InputSource in;
+  int devnull = -1;
+  if (items == NULL) {
+    input_open_fd(&in, STDIN_FILENO);
+    devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  ParallelTask *tasks = NULL;
+  int num_tasks = 0;
+  int tasks_cap = 0;
+  struct pollfd *fds = NULL;
+  long long *latencies = NULL;
+  size_t num_latencies = 0;
+  size_t latencies_cap = 0;
+  size_t next_index = 0;
+  size_t next_emit = 0;
+  int running = 0;
+  int failed = 0;
+  int more = 1;
+  long long started = monotonic_us();
+  char buf[65536];
+
+  interrupted = 0;
+  fflush(stdout);
+  while (1) {
+    // Fill the free slots
+    while (more && running < slots && !interrupted) {
+      char *item = items != NULL ? *items : input_read_line(&in);
+      if (item == NULL) {
+        more = 0;
+        break;
+      }
+      if (items != NULL) {
+        items++;
+      }
+
+      if (num_tasks == tasks_cap) {
+        tasks_cap = tasks_cap ? tasks_cap * 2 : 16;
+        tasks = realloc(tasks, tasks_cap * sizeof(ParallelTask));
+        fds = realloc(fds, (tasks_cap + 1) * sizeof(struct pollfd));
+      }
+      ParallelTask *task = &tasks[num_tasks++];
+      memset(task, 0, sizeof(*task));
+      task->index = next_index++;
+      task->out_fd = -1;
+
+      ArgVec argv = {0};
+      parallel_argv(template, item, &argv);
+      LaunchSpec spec = {0};
+      spec.argv = argv.argv;
+      if (devnull >= 0) {
+        launch_add_fd(&spec, devnull, STDIN_FILENO);
+      }
+      int pipefd[2] = {-1, -1};
+      if (keep_order && make_pipe(pipefd) == 0) {
+        pipe_set_size(pipefd[1], pipe_size);
+        launch_add_fd(&spec, pipefd[1], STDOUT_FILENO);
+      }
+      task->start_us = monotonic_us();
+      pid_t pid = launch_external(&spec);
+      if (pipefd[1] >= 0) {
+        close(pipefd[1]);
+      }
+      argv_free(&argv);
+
+      if (pid < 0) {
+        if (pipefd[0] >= 0) {
+          close(pipefd[0]);
+        }
+        task->status = last_status;
+        failed++;
+      } else {
+        task->pid = pid;
+        task->out_fd = pipefd[0];
+        running++;
+      }
+    }
+
+    // Write finished output in order (-k) and drop finished tasks
+    int t = 0;
+    while (t < num_tasks) {
+      ParallelTask *task = &tasks[t];
+      if (keep_order) {
+        if (task->index != next_emit) {
+          t++;
+          continue;
+        }
+        fwrite(task->out.data, 1, task->out.len, stdout);
+        task->out.len = 0;
+      }
+      if (task->pid != 0 || task->out_fd >= 0) {
+        if (keep_order) {
+          break;
+        }
+        t++;
+        continue;
+      }
+      free(task->out.data);
+      tasks[t] = tasks[--num_tasks];
+      if (keep_order) {
+        next_emit++;
+        t = 0;
+      }
+    }
+    fflush(stdout);
+
+    if (num_tasks == 0 && (!more || interrupted)) {
+      break;
+    }
+
+    // Sleep until a child exits or a -k pipe has output
+    int nfds = 0;
+    if (child_event_fd >= 0) {
+      fds[nfds].fd = child_event_fd;
+      fds[nfds].events = POLLIN;
+      fds[nfds++].revents = 0;
+    }
+    for (t = 0; t < num_tasks; t++) {
+      if (tasks[t].out_fd >= 0) {
+        fds[nfds].fd = tasks[t].out_fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds++].revents = 0;
+      }
+    }
+    if (poll(fds, nfds, child_event_fd >= 0 ? -1 : 10) < 0 && errno != EINTR) {
+      break;
+    }
+
+    // Tasks are visited in the order their pipes were added to fds
+    int f = child_event_fd >= 0 ? 1 : 0;
+    for (t = 0; t < num_tasks; t++) {
+      ParallelTask *task = &tasks[t];
+      if (task->out_fd < 0 || fds[f++].revents == 0) {
+        continue;
+      }
+      ssize_t n = read(task->out_fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        close(task->out_fd);
+        task->out_fd = -1;
+      } else if (task->index == next_emit) {
+        fwrite(buf, 1, n, stdout);
+      } else {
+        sb_append(&task->out, buf, n);
+      }
+    }
+
+    jobs_reap();
+    for (t = 0; t < num_tasks; t++) {
+      ParallelTask *task = &tasks[t];
+      int status;
+      if (task->pid == 0 || !reaped_fg_take(task->pid, &status)) {
+        continue;
+      }
+      task->pid = 0;
+      task->status =
+          WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      if (task->status != 0) {
+        failed++;
+      }
+      running--;
+      if (num_latencies == latencies_cap) {
+        latencies_cap = latencies_cap ? latencies_cap * 2 : 64;
+        latencies = realloc(latencies, latencies_cap * sizeof(long long));
+      }
+      latencies[num_latencies++] = monotonic_us() - task->start_us;
+    }
+  }
+
+  parallel_report(latencies, num_latencies, monotonic_us() - started, failed);
+  if (items == NULL) {
+    free(in.buf);
+    close(devnull);
+  }
+  free(tasks);
+  free(fds);
+  free(latencies);
+  if (interrupted) {
+    return 130;
+  }
+  return failed > 101 ? 101 : failed;
+}
+
+// Write out buffered trace events
+void trace_flush(void) {
+  size_t done = 0;
+  while (trace.fd >= 0 && done < trace.len) {
+    ssize_t n = write(trace.fd, trace.buf + done, trace.len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break; // drop the rest rather than stall the shell
+    }
+    done += n;
+  }
+  trace.len = 0;
+}
+
+// Open (or close) the trace file after set trace= or --trace=
+void trace_changed(void) {
+  trace_flush();
+  if (trace.fd >= 0) {
+    close(trace.fd);
+    trace.fd = -1;
+  }
+  if (trace.path == NULL) {
+    return;
+  }
+  trace.fd = open(trace.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (trace.fd < 0) {
+    fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", trace.path,
+            strerror(errno));
+    free(trace.path);
+    trace.path = NULL;
+  }
+}
+
+// Append one event to the trace buffer as a JSON line
+void trace_emit(const TraceEvent *ev) {
+  if (trace.fd < 0) {
+    return;
+  }
+  if (TRACE_BUFFER - trace.len < 1024) {
+    trace_flush();
+  }
+  char *out = trace.buf + trace.len;
+  size_t room = TRACE_BUFFER - trace.len - 2; // keep space for "}\n"
+  int n = snprintf(out, room, "{\"ts\":%lld,\"ev\":\"%s\",\"dur_us\":%lld",
+                   ev->start_us, ev->event, ev->dur_us);
+  if (ev->pid > 0) {
+    n += snprintf(out + n, room - n, ",\"pid\":%d", (int)ev->pid);
+  }
+  if (ev->job > 0) {
+    n += snprintf(out + n, room - n, ",\"job\":%d", ev->job);
+  }
+  if (ev->key != NULL) {
+    n += snprintf(out + n, room - n, ",\"%s\":%ld", ev->key, ev->value);
+  }
+  if (ev->name != NULL) {
+    // Escaped by hand; long names are cut to fit the buffer
+    n += snprintf(out + n, room - n, ",\"name\":\"");
+    for (const char *c = ev->name; *c != '\0' && (size_t)n + 8 < room; c++) {
+      unsigned char ch = *c;
+      if (ch == '"' || ch == '\\') {
+        out[n++] = '\\';
+        out[n++] = ch;
+      } else if (ch < 0x20) {
+        n += snprintf(out + n, room - n, "\\u%04x", ch);
+      } else {
+        out[n++] = ch;
+      }
+    }
+    out[n++] = '"';
+  }
+  out[n++] = '}';
+  out[n++] = '\n';
+  trace.len += n;
+}
+
+// Record one latency sample
+void hist_add(Histogram *h, long long us) {
+  unsigned long long v = us > 0 ? (unsigned long long)us : 0;
+  int b = 0;
+  while (v >> b != 0 && b < HIST_BUCKETS - 1) {
+    b++;
+  }
+  h->buckets[b]++;
+  h->count++;
+  h->total_us += v;
+  if (v > h->max_us) {
+    h->max_us = v;
+  }
+}
+
+// Upper bound of the bucket holding the given fraction of samples
+unsigned long long hist_percentile(const Histogram *h, double fraction) {
+  unsigned long long want = (unsigned long long)(h->count * fraction + 0.5);
+  unsigned long long seen = 0;
+  if (want == 0) {
+    want = 1;
+  }
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= want) {
+      unsigned long long bound = b == 0 ? 0 : 1ULL << b;
+      return bound < h->max_us ? bound : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+void stats_print_hist(const char *name, const Histogram *h) {
+  printf("%-10s %8lu %10.1f %8llu %8llu %8llu %8llu\n", name, h->count,
+         h->count ? (double)h->total_us / h->count : 0.0,
+         hist_percentile(h, 0.50), hist_percentile(h, 0.90),
+         hist_percentile(h, 0.99), h->max_us);
+}
+
+// stats    : show counters and latency percentiles (microseconds,
+//            rounded up to a power of two)
+// stats -r : reset them
+int builtin_stats(char **args) {
+  if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+    memset(&stats, 0, sizeof(stats));
+    return 0;
+  }
+  if (args[1] != NULL) {
+    fprintf(stderr, COLOR_RED "stats: %s: unknown option" COLOR_RESET "\n",
+            args[1]);
+    return 2;
+  }
+  printf("lines        %lu\n", stats.lines);
+  printf("commands     %lu\n", stats.commands);
+  printf("spawns       %lu (%lu failed, %lu environment rebuilds)\n",
+         stats.spawns, stats.spawn_failures, stats.env_builds);
+  printf("path lookups %lu hits, %lu misses\n", stats.lookup_hits,
+         stats.lookup_misses);
+  printf("jobs         %lu started, %lu finished\n", stats.jobs_started,
+         stats.jobs_reaped);
+  printf("substitutions %lu (%lu forked)\n", stats.substs,
+         stats.subst_forks);
+  printf("arena        %zu chunks, %zu KB, %zu KB peak line, %lu lines\n",
+         cmd_arena.chunks, cmd_arena.capacity / 1024,
+         (cmd_arena.high_water + 1023) / 1024, cmd_arena.resets);
+  // Heap in use should stay flat once the arena and caches are warm
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  printf("heap         %zu bytes in use\n", mallinfo2().uordblks);
+#endif
+  printf("\n%-10s %8s %10s %8s %8s %8s %8s\n", "us", "count", "avg", "p50",
+         "p90", "p99", "max");
+  stats_print_hist("parse", &stats.parse);
+  stats_print_hist("lookup", &stats.lookup);
+  stats_print_hist("spawn", &stats.spawn);
+  stats_print_hist("wait", &stats.wait);
+  return 0;
+}
+
+// Open the history file on first use: $MYSHELL_HISTFILE, or
+// ~/.myshell_history
+int history_open(void) {
+  if (history.fd >= 0) {
+    return 0;
+  }
+  if (history.failed) {
+    return -1;
+  }
+  char path[PATH_MAX];
+  const char *file = var_get("MYSHELL_HISTFILE");
+  if (file == NULL || *file == '\0') {
+    const char *home = var_get("HOME");
+    snprintf(path, sizeof(path), "%s/.myshell_history", home ? home : ".");
+    file = path;
+  }
+  history.fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history.fd < 0) {
+    fprintf(stderr, COLOR_RED "myshell: history: %s: %s" COLOR_RESET "\n",
+            file, strerror(errno));
+    history.failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+// Hash a trigram to a bit of its block's bitmap
+static inline unsigned history_trigram(const char *p) {
+  uint32_t t = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 |
+               (unsigned char)p[2];
+  return (t * 2654435761u) >> 20; // 12 bits
+}
+
+// Set the trigram bits of the text [start, end) of the map in sig
+void history_sig_add(uint64_t *sig, size_t start, size_t end) {
+  for (size_t i = start; i + 3 <= end; i++) {
+    unsigned h = history_trigram(history.map + i);
+    sig[h >> 6] |= 1ULL << (h & 63);
+  }
+}
+
+// Add a new complete entry [start, end) to the index
+void history_index_entry(size_t start, size_t end) {
+  if (history.count == history.cap) {
+    history.cap = history.cap ? history.cap * 2 : 1024;
+    history.offsets = realloc(history.offsets,
+                              history.cap * sizeof(history.offsets[0]));
+  }
+  size_t block = history.count / HISTORY_BLOCK;
+  if (block >= history.sig_blocks) {
+    size_t blocks = history.sig_blocks ? history.sig_blocks * 2 : 16;
+    history.sigs = realloc(history.sigs,
+                           blocks * HISTORY_SIG_WORDS * sizeof(uint64_t));
+    history.sig_ready = realloc(history.sig_ready, blocks);
+    memset(history.sig_ready + history.sig_blocks, 0,
+           blocks - history.sig_blocks);
+    history.sig_blocks = blocks;
+  }
+  if (history.sig_ready[block]) {
+    history_sig_add(history.sigs + block * HISTORY_SIG_WORDS, start, end);
+  }
+  history.offsets[history.count++] = start;
+}
+
+// Bring the mapping and index up to date with the file, which other shells
+// may have appended to. Only the new tail is scanned. Returns -1 if history
+// is unavailable.
+int history_sync(void) {
+  if (history_open() < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(history.fd, &st) < 0) {
+    return -1;
+  }
+  size_t size = st.st_size;
+  if (size < history.end) {
+    // Truncated or replaced: start over
+    history.count = 0;
+    history.end = 0;
+    memset(history.sig_ready, 0, history.sig_blocks);
+  }
+  if (size != history.map_size) {
+    if (history.map != NULL) {
+      munmap(history.map, history.map_size);
+      history.map = NULL;
+      history.map_size = 0;
+    }
+    if (size > 0) {
+      void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+      if (map == MAP_FAILED) {
+        return -1;
+      }
+      history.map = map;
+      history.map_size = size;
+    }
+  }
+  // Index complete lines only; a partial one is still being written
+  while (history.end < history.map_size) {
+    char *nl = memchr(history.map + history.end, '\n',
+                      history.map_size - history.end);
+    if (nl == NULL) {
+      break;
+    }
+    size_t stop = nl - history.map;
+    history_index_entry(history.end, stop);
+    history.end = stop + 1;
+  }
+  return 0;
+}
+
+// Entry i (0-based) and its length, without the newline
+const char *history_entry(size_t i, size_t *len) {
+  size_t start = history.offsets[i];
+  size_t stop = i + 1 < history.count ? history.offsets[i + 1] - 1
+                                      : history.end - 1;
+  *len = stop - start;
+  return history.map + start;
+}
+
+// Append a command line. O_APPEND keeps concurrent writers from overwriting
+// each other; the lock keeps the newline fix-up below atomic with the write.
+void history_add(const char *line) {
+  size_t len = strlen(line);
+  if (len == 0 || strchr(line, '\n') != NULL || history_open() < 0) {
+    return;
+  }
+  char *entry = arena_alloc(&cmd_arena, len + 2);
+  size_t n = 0;
+  flock(history.fd, LOCK_EX);
+  struct stat st;
+  char last = '\n';
+  if (fstat(history.fd, &st) == 0 && st.st_size > 0 &&
+      pread(history.fd, &last, 1, st.st_size - 1) == 1 && last != '\n') {
+    entry[n++] = '\n'; // a shell died mid-write; don't glue onto its entry
+  }
+  memcpy(entry + n, line, len);
+  n += len;
+  entry[n++] = '\n';
+  write_full(history.fd, entry, n);
+  flock(history.fd, LOCK_UN);
+}
+
+// The trigram bitmap of a block, built on first use
+const uint64_t *history_block_sig(size_t block) {
+  uint64_t *sig = history.sigs + block * HISTORY_SIG_WORDS;
+  if (!history.sig_ready[block]) {
+    memset(sig, 0, HISTORY_SIG_WORDS * sizeof(uint64_t));
+    size_t last = (block + 1) * HISTORY_BLOCK;
+    for (size_t i = block * HISTORY_BLOCK; i < last && i < history.count;
+         i++) {
+      size_t len;
+      const char *entry = history_entry(i, &len);
+      history_sig_add(sig, entry - history.map, entry - history.map + len);
+    }
+    history.sig_ready[block] = 1;
+  }
+  return sig;
+}
+
+// Find the most recent entry that starts with (or, if anywhere, contains)
+// text. Returns its index, or -1.
+long history_find(const char *text, int anywhere) {
+  size_t text_len = strlen(text);
+  uint64_t want[HISTORY_SIG_WORDS] = {0};
+  int use_sig = text_len >= 3;
+  for (size_t i = 0; use_sig && i + 3 <= text_len; i++) {
+    unsigned h = history_trigram(text + i);
+    want[h >> 6] |= 1ULL << (h & 63);
+  }
+  size_t i = history.count;
+  while (i > 0) {
+    if (use_sig) {
+      // Skip whole blocks missing any of the text's trigrams
+      size_t block = (i - 1) / HISTORY_BLOCK;
+      const uint64_t *sig = history_block_sig(block);
+      int possible = 1;
+      for (int w = 0; w < HISTORY_SIG_WORDS && possible; w++) {
+        possible = (sig[w] & want[w]) == want[w];
+      }
+      if (!possible) {
+        i = block * HISTORY_BLOCK;
+        continue;
+      }
+    }
+    i--;
+    size_t len;
+    const char *entry = history_entry(i, &len);
+    if (anywhere ? memmem(entry, len, text, text_len) != NULL
+                 : len >= text_len && memcmp(entry, text, text_len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Expand a leading history reference (!!, !N, !-N, !prefix, !?text[?]);
+// the rest of the line is kept. Returns a new string in the command arena,
+// line itself if there is nothing to expand, or NULL (after printing why)
+// if the event is not found.
+char *history_expand(char *line) {
+  if (line[0] != '!' || line[1] == '\0' || line[1] == ' ' ||
+      line[1] == '\t' || line[1] == '=' || line[1] == '(') {
+    return line;
+  }
+  if (history_sync() < 0) {
+    return NULL;
+  }
+  char *p = line + 1;
+  char *rest;
+  long index = -1;
+  if (*p == '!') {
+    index = (long)history.count - 1;
+    rest = p + 1;
+  } else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+    long n = strtol(p, &rest, 10);
+    if (n < 0) {
+      index = (long)history.count + n;
+    } else if (n > 0) {
+      index = n - 1;
+    }
+  } else {
+    int anywhere = *p == '?';
+    p += anywhere;
+    size_t len = anywhere ? strcspn(p, "?") : strcspn(p, " \t|&;<>");
+    char *text = arena_strndup(&cmd_arena, p, len);
+    rest = p + len;
+    if (anywhere && *rest == '?') {
+      rest++;
+    }
+    if (len > 0) {
+      index = history_find(text, anywhere);
+    }
+  }
+  if (index < 0 || (size_t)index >= history.count) {
+    size_t len = strcspn(line, " \t");
+    fprintf(stderr, COLOR_YELLOW "myshell: %.*s: event not found" COLOR_RESET
+            "\n", (int)len, line);
+    return NULL;
+  }
+  size_t len;
+  const char *entry = history_entry(index, &len);
+  size_t rest_len = strlen(rest);
+  char *out = arena_alloc(&cmd_arena, len + rest_len + 1);
+  memcpy(out, entry, len);
+  memcpy(out + len, rest, rest_len + 1);
+  return out;
+}
+
+// history     : list every entry with its number
+// history N   : list the last N
+int builtin_history(char **args) {
+  size_t first = 0;
+  if (history_sync() < 0) {
+    return 1;
+  }
+  if (args[1] != NULL) {
+    char *end;
+    long n = strtol(args[1], &end, 10);
+    if (*end != '\0' || n < 0) {
+      fprintf(stderr, COLOR_RED "history: %s: numeric argument required"
+              COLOR_RESET "\n", args[1]);
+      return 2;
+    }
+    if ((size_t)n < history.count) {
+      first = history.count - n;
+    }
+  }
+  for (size_t i = first; i < history.count; i++) {
+    size_t len;
+    const char *entry = history_entry(i, &len);
+    printf("%5zu  %.*s\n", i + 1, (int)len, entry);
+  }
+  return 0;
+}
+
+// Line editor (see LineEditor). The line is edited in one screen row that
+// scrolls sideways when it is wider than the terminal; the bytes of a
+// multibyte character move together and take one column.
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define KEY_NONE 256 // an escape sequence the editor does not use
+#define KEY_UP 257
+#define KEY_DOWN 258
+#define KEY_LEFT 259
+#define KEY_RIGHT 260
+#define KEY_HOME 261
+#define KEY_END 262
+#define KEY_DELETE 263
+#define KEY_WORD_LEFT 264  // Alt+B, Ctrl+Left
+#define KEY_WORD_RIGHT 265 // Alt+F, Ctrl+Right
+
+// Use the editor for an interactive terminal, unless TERM=dumb
+void edit_init(int fd) {
+  const char *term = var_get("TERM");
+  if ((term != NULL && strcmp(term, "dumb") == 0) ||
+      tcgetattr(fd, &editor.cooked) < 0) {
+    return;
+  }
+  editor.enabled = 1;
+  sb_append(&editor.line, "", 0);
+  sb_append(&editor.saved, "", 0);
+}
+
+// Switch raw mode on for editing, or back to the terminal's own settings.
+// TCSADRAIN keeps input typed ahead while a command ran.
+void edit_raw(int fd, int on) {
+  if (on) {
+    struct termios raw = editor.cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSADRAIN, &raw);
+  } else {
+    tcsetattr(fd, TCSADRAIN, &editor.cooked);
+  }
+  editor.active = on;
+}
+
+// Columns text takes on the terminal: escape sequences take none and a
+// multibyte character one
+int edit_width(const char *s, size_t len) {
+  int width = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '\033' && i + 1 < len && s[i + 1] == '[') {
+      for (i += 2; i < len && !(s[i] >= 0x40 && s[i] <= 0x7e); i++) {
+      }
+    } else if (c >= ' ' && (c & 0xc0) != 0x80) {
+      width++;
+    }
+  }
+  return width;
+}
+
+// Set the prompt the next edited line is shown with
+void edit_set_prompt(const char *text, size_t len) {
+  if (len > PROMPT_MAX) {
+    len = PROMPT_MAX;
+  }
+  memcpy(editor.prompt, text, len);
+  editor.prompt[len] = '\0';
+  editor.prompt_len = len;
+  const char *newline = memrchr(text, '\n', len);
+  editor.prompt_last = newline != NULL ? (size_t)(newline - text) + 1 : 0;
+  editor.prompt_width = edit_width(editor.prompt + editor.prompt_last,
+                                   len - editor.prompt_last);
+}
+
+int edit_columns(void) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+    return ws.ws_col;
+  }
+  return 80;
+}
+
+// Start of the character after (or before) the one at byte i
+size_t edit_next(size_t i) {
+  const char *line = editor.line.data;
+  for (i++; i < editor.line.len && (line[i] & 0xc0) == 0x80; i++) {
+  }
+  return i;
+}
+
+size_t edit_prev(size_t i) {
+  const char *line = editor.line.data;
+  for (i--; i > 0 && (line[i] & 0xc0) == 0x80; i--) {
+  }
+  return i;
+}
+
+// Redraw the last line of the prompt and the part of the line around the
+// cursor, in a single write
+void edit_refresh(void) {
+  const char *line = editor.line.data;
+  int room = edit_columns() - editor.prompt_width - 1;
+  room = room > 0 ? room : 1;
+  if (editor.cursor < editor.scroll) {
+    editor.scroll = editor.cursor;
+  }
+  while (edit_width(line + editor.scroll, editor.cursor - editor.scroll) >
+         room) {
+    editor.scroll = edit_next(editor.scroll);
+  }
+  size_t end = editor.scroll;
+  for (int shown = 0; end < editor.line.len && shown < room; shown++) {
+    end = edit_next(end);
+  }
+
+  StrBuf *out = &editor.out;
+  out->len = 0;
+  sb_putc(out, '\r');
+  sb_append(out, editor.prompt + editor.prompt_last,
+            editor.prompt_len - editor.prompt_last);
+  sb_append(out, line + editor.scroll, end - editor.scroll);
+  sb_append(out, "\033[K\r", 4);
+  int column = editor.prompt_width +
+               edit_width(line + editor.scroll, editor.cursor - editor.scroll);
+  if (column > 0) {
+    char move[24];
+    snprintf(move, sizeof(move), "\033[%dC", column);
+    sb_append(out, move, strlen(move));
+  }
+  write_full(STDOUT_FILENO, out->data, out->len);
+}
+
+// Show the whole prompt again (after job notices or a completion list)
+void edit_redraw(void) {
+  if (editor.prompt_last > 0) {
+    write_full(STDOUT_FILENO, editor.prompt, editor.prompt_last);
+  }
+  edit_refresh();
+}
+
+// Next input byte, or -1 at end of input or, with timeout_ms not
+// negative, when nothing arrives in time. Job events are handled while
+// waiting.
+int edit_getc(int fd, int timeout_ms) {
+  while (editor.keys_pos == editor.keys_len) {
+    if (timeout_ms >= 0) {
+      struct pollfd pfd = {.fd = fd, .events = POLLIN};
+      if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+      }
+    } else {
+      wait_for_input(fd);
+    }
+    ssize_t n = read(fd, editor.keys, EDIT_KEYS);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    editor.keys_len = n;
+    editor.keys_pos = 0;
+  }
+  return (unsigned char)editor.keys[editor.keys_pos++];
+}
+
+// Next key: a byte, a KEY_* code for an escape sequence, or -1 at end of
+// input. A lone Escape is ignored.
+int edit_key(int fd) {
+  int c = edit_getc(fd, -1);
+  if (c != '\033') {
+    return c;
+  }
+  int next = edit_getc(fd, EDIT_ESC_MS);
+  if (next == 'b' || next == 'f') {
+    return next == 'b' ? KEY_WORD_LEFT : KEY_WORD_RIGHT;
+  }
+  if (next != '[' && next != 'O') {
+    return KEY_NONE;
+  }
+  // CSI or SS3: numbers separated by ; then the final byte
+  int first = 0;
+  int modifier = 0;
+  int *param = &first;
+  while ((c = edit_getc(fd, EDIT_ESC_MS)) >= 0 &&
+         (isdigit(c) || c == ';')) {
+    if (c == ';') {
+      param = &modifier;
+    } else {
+      *param = *param * 10 + c - '0';
+    }
+  }
+  int word = modifier == 3 || modifier == 5; // Alt or Ctrl
+  switch (c) {
+  case 'A':
+    return KEY_UP;
+  case 'B':
+    return KEY_DOWN;
+  case 'C':
+    return word ? KEY_WORD_RIGHT : KEY_RIGHT;
+  case 'D':
+    return word ? KEY_WORD_LEFT : KEY_LEFT;
+  case 'H':
+    return KEY_HOME;
+  case 'F':
+    return KEY_END;
+  case '~':
+    return first == 1 || first == 7   ? KEY_HOME
+           : first == 4 || first == 8 ? KEY_END
+           : first == 3               ? KEY_DELETE
+                                      : KEY_NONE;
+  }
+  return KEY_NONE;
+}
+
+// Insert text at the cursor
+void edit_insert(const char *text, size_t n) {
+  StrBuf *line = &editor.line;
+  sb_reserve(line, n);
+  memmove(line->data + editor.cursor + n, line->data + editor.cursor,
+          line->len - editor.cursor + 1);
+  memcpy(line->data + editor.cursor, text, n);
+  line->len += n;
+  editor.cursor += n;
+}
+
+// Delete bytes [from, to) and leave the cursor at from
+void edit_delete(size_t from, size_t to) {
+  StrBuf *line = &editor.line;
+  memmove(line->data + from, line->data + to, line->len - to + 1);
+  line->len -= to - from;
+  editor.cursor = from;
+}
+
+// Start of the word before (or end of the one after) the cursor; words
+// are separated by blanks
+size_t edit_word_left(void) {
+  const char *line = editor.line.data;
+  size_t i = editor.cursor;
+  while (i > 0 && isspace((unsigned char)line[i - 1])) {
+    i--;
+  }
+  while (i > 0 && !isspace((unsigned char)line[i - 1])) {
+    i--;
+  }
+  return i;
+}
+
+size_t edit_word_right(void) {
+  const char *line = editor.line.data;
+  size_t i = editor.cursor;
+  while (i < editor.line.len && isspace((unsigned char)line[i])) {
+    i++;
+  }
+  while (i < editor.line.len && !isspace((unsigned char)line[i])) {
+    i++;
+  }
+  return i;
+}
+
+// Show history entry i, or the line being typed for i == history.count
+void edit_history(size_t i) {
+  if (editor.history_index == history.count) {
+    editor.saved.len = 0;
+    sb_append(&editor.saved, editor.line.data, editor.line.len);
+  }
+  editor.history_index = i;
+  const char *text = editor.saved.data;
+  size_t len = editor.saved.len;
+  if (i < history.count) {
+    text = history_entry(i, &len);
+  }
+  editor.line.len = 0;
+  sb_append(&editor.line, text, len);
+  editor.cursor = len;
+}
+
+// Index of node's child for byte c, created if create is set; 0 if there
+// is none
+int trie_child(CommandTrie *t, int node, unsigned char c, int create) {
+  int prev = 0;
+  int cur = t->nodes[node].child;
+  while (cur != 0 && t->nodes[cur].c < c) {
+    prev = cur;
+    cur = t->nodes[cur].sibling;
+  }
+  if (cur != 0 && t->nodes[cur].c == c) {
+    return cur;
+  }
+  if (!create) {
+    return 0;
+  }
+  if (t->num_nodes == t->cap) {
+    t->cap *= 2;
+    t->nodes = realloc(t->nodes, t->cap * sizeof(TrieNode));
+  }
+  int fresh = t->num_nodes++;
+  t->nodes[fresh] = (TrieNode){.sibling = cur, .c = c};
+  if (prev == 0) {
+    t->nodes[node].child = fresh;
+  } else {
+    t->nodes[prev].sibling = fresh;
+  }
+  return fresh;
+}
+
+// Count a directory's command in (delta 1) or out (-1). Nodes stay when
+// their last command goes; a name seen once tends to come back.
+void trie_add(CommandTrie *t, const char *name, int delta) {
+  int node = 0;
+  for (const char *p = name; *p != '\0' && (p == name || node != 0); p++) {
+    node = trie_child(t, node, (unsigned char)*p, delta > 0);
+  }
+  if (node != 0) {
+    t->nodes[node].refs += delta;
+  }
+}
+
+// Append the commands at and below node, in order; name holds the path
+// to node
+void trie_collect(CommandTrie *t, int node, StrBuf *name, ArgVec *out) {
+  if (t->nodes[node].refs > 0) {
+    argv_push(out, arena_strndup(&cmd_arena, name->data, name->len));
+  }
+  for (int child = t->nodes[node].child; child != 0;
+       child = t->nodes[child].sibling) {
+    sb_putc(name, t->nodes[child].c);
+    trie_collect(t, child, name, out);
+    name->len--;
+  }
+}
+
+// Forget the commands a directory had
+void trie_drop_dir(CommandTrie *t, TrieDir *d) {
+  for (int i = 0; i < d->num_names; i++) {
+    trie_add(t, d->names[i], -1);
+    free(d->names[i]);
+  }
+  free(d->names);
+  d->names = NULL;
+  d->num_names = 0;
+}
+
+// Read a directory's executables into the trie
+void trie_scan_dir(CommandTrie *t, TrieDir *d) {
+  int fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  d->mtime = STAT_MTIME(st);
+  GlobDir *listing = glob_read_dir(d->path, fd);
+  d->names = malloc((listing->count + 1) * sizeof(char *));
+  for (size_t i = 0; i < listing->count; i++) {
+    const char *name = listing->names + listing->offsets[i];
+    unsigned char type = listing->types[i];
+    if (type == DT_DIR ||
+        ((type == DT_LNK || type == DT_UNKNOWN) &&
+         (fstatat(fd, name, &st, 0) < 0 || S_ISDIR(st.st_mode))) ||
+        faccessat(fd, name, X_OK, 0) < 0) {
+      continue;
+    }
+    d->names[d->num_names++] = strdup(name);
+    trie_add(t, name, 1);
+  }
+  glob_dir_free(listing);
+  close(fd);
+}
+
+// Bring the trie up to date with $PATH. The directory list is rebuilt
+// when $PATH changes; otherwise only directories whose mtime changed (and
+// relative ones, which depend on the cwd) are read again, so a completion
+// normally costs one stat per PATH directory.
+void command_trie_refresh(void) {
+  CommandTrie *t = &command_trie;
+  const char *path_env = var_get("PATH");
+  path_env = path_env != NULL ? path_env : "";
+  if (t->path_value != NULL && strcmp(t->path_value, path_env) == 0) {
+    for (int i = 0; i < t->num_dirs; i++) {
+      TrieDir *d = &t->dirs[i];
+      struct stat st;
+      struct timespec mtime = {0, 0};
+      if (stat(d->path, &st) == 0) {
+        mtime = STAT_MTIME(st);
+      }
+      if (d->path[0] != '/' || mtime.tv_sec != d->mtime.tv_sec ||
+          mtime.tv_nsec != d->mtime.tv_nsec) {
+        trie_drop_dir(t, d);
+        trie_scan_dir(t, d);
+      }
+    }
+    return;
+  }
+
+  for (int i = 0; i < t->num_dirs; i++) {
+    trie_drop_dir(t, &t->dirs[i]);
+    free(t->dirs[i].path);
+  }
+  free(t->dirs);
+  free(t->path_value);
+  if (t->nodes == NULL) {
+    t->cap = 1024;
+    t->nodes = malloc(t->cap * sizeof(TrieNode));
+  }
+  t->nodes[0] = (TrieNode){0};
+  t->num_nodes = 1;
+  t->path_value = strdup(path_env);
+  int n = 1;
+  for (const char *p = path_env; *p; p++) {
+    n += *p == ':';
+  }
+  t->dirs = calloc(n, sizeof(TrieDir));
+  t->num_dirs = n;
+  const char *start = path_env;
+  for (int i = 0; i < n; i++) {
+    const char *end = strchrnul(start, ':');
+    // An empty component means the current directory
+    t->dirs[i].path = end > start ? strndup(start, end - start) : strdup(".");
+    trie_scan_dir(t, &t->dirs[i]);
+    start = end + 1;
+  }
+}
+
+// Command names starting with prefix: functions, builtins and every
+// executable on $PATH
+void complete_commands(const char *prefix, ArgVec *out) {
+  size_t len = strlen(prefix);
+  for (int b = 0; b < FUNC_BUCKETS; b++) {
+    for (Function *f = functions[b]; f != NULL; f = f->next) {
+      if (strncmp(f->name, prefix, len) == 0) {
+        argv_push(out, f->name);
+      }
+    }
+  }
+  for (int i = 0; i < NUM_CORE_BUILTINS; i++) {
+    if (!(core_builtins[i].flags & BUILTIN_DISABLED) &&
+        strncmp(core_builtins[i].name, prefix, len) == 0) {
+      argv_push(out, (char *)core_builtins[i].name);
+    }
+  }
+  for (int i = 0; i < loaded_builtins.count; i++) {
+    if (!(loaded_builtins.list[i].flags & BUILTIN_DISABLED) &&
+        strncmp(loaded_builtins.list[i].name, prefix, len) == 0) {
+      argv_push(out, (char *)loaded_builtins.list[i].name);
+    }
+  }
+
+  command_trie_refresh();
+  CommandTrie *t = &command_trie;
+  int node = 0;
+  for (size_t i = 0; i < len && (i == 0 || node != 0); i++) {
+    node = trie_child(t, node, (unsigned char)prefix[i], 0);
+  }
+  if (len == 0 || node != 0) {
+    StrBuf name = {.arena = &cmd_arena};
+    sb_append(&name, prefix, len);
+    trie_collect(t, node, &name, out);
+  }
+}
+
+// Paths starting with word, which may begin with ~/; directories get a
+// trailing /. With executables, only directories and executable files.
+void complete_files(const char *word, int executables, ArgVec *out) {
+  const char *slash = strrchr(word, '/');
+  size_t dir_len = slash != NULL ? (size_t)(slash - word) + 1 : 0;
+  const char *base = word + dir_len;
+  size_t base_len = strlen(base);
+  StrBuf dir = {.arena = &cmd_arena};
+  sb_append(&dir, "", 0);
+  const char *home = var_get("HOME");
+  if (word[0] == '~' && word[1] == '/' && home != NULL) {
+    sb_append(&dir, home, strlen(home));
+    sb_append(&dir, word + 1, dir_len - 1);
+  } else {
+    sb_append(&dir, word, dir_len);
+  }
+
+  GlobDir *d = glob_list(dir.data);
+  if (d == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < d->count; i++) {
+    const char *name = d->names + d->offsets[i];
+    if (strncmp(name, base, base_len) != 0 ||
+        (name[0] == '.' && base[0] != '.')) {
+      continue;
+    }
+    int is_dir = glob_is_dir(d, i, &dir, 1);
+    if (executables && !is_dir) {
+      char *path = arena_alloc(&cmd_arena, dir.len + strlen(name) + 1);
+      sprintf(path, "%s%s", dir.data, name);
+      if (access(path, X_OK) < 0) {
+        continue;
+      }
+    }
+    StrBuf match = {.arena = &cmd_arena};
+    sb_append(&match, word, dir_len);
+    sb_append(&match, name, strlen(name));
+    if (is_dir) {
+      sb_putc(&match, '/');
+    }
+    argv_push(out, sb_finish(&match));
+  }
+  glob_release(d);
+}
+
+// $NAME completions for the name prefix
+void complete_vars(const char *prefix, ArgVec *out) {
+  size_t len = strlen(prefix);
+  for (size_t b = 0; b < vars.num_buckets; b++) {
+    for (Var *v = vars.buckets[b]; v != NULL; v = v->next) {
+      if (strncmp(v->name, prefix, len) == 0) {
+        StrBuf match = {.arena = &cmd_arena};
+        sb_putc(&match, '$');
+        sb_append(&match, v->name, strlen(v->name));
+        argv_push(out, sb_finish(&match));
+      }
+    }
+  }
+}
+
+// Whether the word starting at byte start is in command position: first
+// on the line, after an operator, or after a reserved word or prefix
+// that takes a command
+int edit_command_position(size_t start) {
+  static const char *const before_command[] = {
+      "!", "do", "elif", "else", "if", "then", "time", "until", "while", "{"};
+  const char *line = editor.line.data;
+  size_t end = start;
+  while (end > 0 && isspace((unsigned char)line[end - 1])) {
+    end--;
+  }
+  if (end == 0 || strchr(";&|(`", line[end - 1]) != NULL) {
+    return 1;
+  }
+  size_t word = end;
+  while (word > 0 && !isspace((unsigned char)line[word - 1])) {
+    word--;
+  }
+  for (size_t i = 0; i < sizeof(before_command) / sizeof(before_command[0]);
+       i++) {
+    if (strlen(before_command[i]) == end - word &&
+        memcmp(before_command[i], line + word, end - word) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// List completions below the line in columns, showing them from skip on
+// (the directory part), then show the line again
+void edit_list(ArgVec *matches, size_t skip) {
+  int fd = STDIN_FILENO;
+  write_full(STDOUT_FILENO, "\r\n", 2);
+  if (matches->argc > EDIT_ASK_LIST) {
+    char ask[64];
+    snprintf(ask, sizeof(ask), "Display all %d possibilities? (y or n)",
+             matches->argc);
+    write_full(STDOUT_FILENO, ask, strlen(ask));
+    int answer = edit_getc(fd, -1);
+    write_full(STDOUT_FILENO, "\r\n", 2);
+    if (answer != 'y' && answer != 'Y') {
+      edit_redraw();
+      return;
+    }
+  }
+  size_t width = 0;
+  for (int i = 0; i < matches->argc; i++) {
+    size_t len = strlen(matches->argv[i] + skip);
+    width = len > width ? len : width;
+  }
+  width += 2;
+  int cols = edit_columns() / (int)width;
+  cols = cols > 0 ? cols : 1;
+  int rows = (matches->argc + cols - 1) / cols;
+  StrBuf *out = &editor.out;
+  out->len = 0;
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      int i = c * rows + r;
+      if (i >= matches->argc) {
+        continue;
+      }
+      const char *text = matches->argv[i] + skip;
+      sb_append(out, text, strlen(text));
+      if (c + 1 < cols && i + rows < matches->argc) {
+        for (size_t pad = strlen(text); pad < width; pad++) {
+          sb_putc(out, ' ');
+        }
+      }
+    }
+    sb_append(out, "\r\n", 2);
+  }
+  write_full(STDOUT_FILENO, out->data, out->len);
+  edit_redraw();
+}
+
+// Tab: complete the word before the cursor as a command, a $variable or
+// a path. A unique match is finished with a space (or the / of a
+// directory); several are completed to their longest common prefix and
+// listed on a second Tab.
+void edit_complete(void) {
+  const char *line = editor.line.data;
+  size_t start = editor.cursor;
+  while (start > 0 && !(strchr(" \t;&|<>()", line[start - 1]) != NULL &&
+                        (start < 2 || line[start - 2] != '\\'))) {
+    start--;
+  }
+  // The word as the shell will see it, without backslashes and quotes
+  StrBuf word = {.arena = &cmd_arena};
+  sb_append(&word, "", 0);
+  int quoted = 0;
+  for (size_t i = start; i < editor.cursor; i++) {
+    if (line[i] == '\\' && i + 1 < editor.cursor) {
+      sb_putc(&word, line[++i]);
+    } else if (line[i] == '\'' || line[i] == '"') {
+      quoted = 1;
+    } else {
+      sb_putc(&word, line[i]);
+    }
+  }
+
+  ArgVec matches = {.arena = &cmd_arena};
+  int command = edit_command_position(start);
+  if (word.data[0] == '$') {
+    complete_vars(word.data + 1, &matches);
+  } else if (command && strchr(word.data, '/') == NULL) {
+    complete_commands(word.data, &matches);
+  } else {
+    complete_files(word.data, command, &matches);
+  }
+  if (matches.argc == 0) {
+    write_full(STDOUT_FILENO, "\a", 1);
+    return;
+  }
+  qsort(matches.argv, matches.argc, sizeof(char *), compare_strings);
+  int unique = 1;
+  for (int i = 1; i < matches.argc; i++) {
+    if (strcmp(matches.argv[i], matches.argv[unique - 1]) != 0) {
+      matches.argv[unique++] = matches.argv[i];
+    }
+  }
+  matches.argc = unique;
+
+  size_t common = strlen(matches.argv[0]);
+  for (int i = 1; i < matches.argc; i++) {
+    size_t n = 0;
+    while (n < common && matches.argv[i][n] == matches.argv[0][n]) {
+      n++;
+    }
+    common = n;
+  }
+  for (size_t i = word.len; i < common; i++) {
+    char c = matches.argv[0][i];
+    if (!quoted && strchr(" \t\\'\"`$&|;<>()*?[]#~!{}", c) != NULL) {
+      edit_insert("\\", 1);
+    }
+    edit_insert(&c, 1);
+  }
+  if (matches.argc == 1) {
+    if (matches.argv[0][common - 1] != '/' && !quoted) {
+      edit_insert(" ", 1);
+    }
+  } else if (common == word.len && editor.tabs > 1) {
+    const char *slash = strrchr(word.data, '/');
+    edit_list(&matches, slash != NULL ? (size_t)(slash - word.data) + 1 : 0);
+  } else if (common == word.len) {
+    write_full(STDOUT_FILENO, "\a", 1);
+  }
+}
+
+// Edit a line on the terminal and append it, with its newline, to the
+// input buffer. Returns -1 when Ctrl+C drops the line. Ctrl+D on an empty
+// line (or a hangup) ends the input.
+int edit_line(InputSource *in) {
+  int fd = in->fd;
+  tcgetattr(fd, &editor.cooked);
+  edit_raw(fd, 1);
+  editor.line.len = 0;
+  editor.line.data[0] = '\0';
+  editor.cursor = 0;
+  editor.scroll = 0;
+  editor.tabs = 0;
+  history_sync();
+  editor.history_index = history.count;
+  edit_redraw();
 
-  // Reap all terminated child processes
-  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-    // Find and mark job as completed
-    for (int i = 0; i < job_count; i++) {
-      if (jobs[i].pid == pid && !jobs[i].completed) {
-        jobs[i].completed = 1;
-        printf("\n[%d]+ Done                    %s\n", jobs[i].job_id,
-               jobs[i].command);
-        print_prompt();
-        fflush(stdout);
-        break;
+  int status = 0;
+  while (1) {
+    int key = edit_key(fd);
+    size_t len = editor.line.len;
+    editor.tabs = key == '\t' ? editor.tabs + 1 : 0;
+    if (key == '\r' || key == '\n') {
+      break;
+    }
+    if (key < 0 || (key == CTRL_KEY('d') && len == 0)) {
+      in->eof = 1;
+      edit_raw(fd, 0);
+      return 0;
+    }
+    if (key == CTRL_KEY('c')) {
+      status = -1;
+      break;
+    }
+    switch (key) {
+    case CTRL_KEY('a'):
+    case KEY_HOME:
+      editor.cursor = 0;
+      break;
+    case CTRL_KEY('e'):
+    case KEY_END:
+      editor.cursor = len;
+      break;
+    case CTRL_KEY('b'):
+    case KEY_LEFT:
+      if (editor.cursor > 0) {
+        editor.cursor = edit_prev(editor.cursor);
+      }
+      break;
+    case CTRL_KEY('f'):
+    case KEY_RIGHT:
+      if (editor.cursor < len) {
+        editor.cursor = edit_next(editor.cursor);
+      }
+      break;
+    case KEY_WORD_LEFT:
+      editor.cursor = edit_word_left();
+      break;
+    case KEY_WORD_RIGHT:
+      editor.cursor = edit_word_right();
+      break;
+    case 127:
+    case CTRL_KEY('h'):
+      if (editor.cursor > 0) {
+        edit_delete(edit_prev(editor.cursor), editor.cursor);
+      }
+      break;
+    case CTRL_KEY('d'):
+    case KEY_DELETE:
+      if (editor.cursor < len) {
+        edit_delete(editor.cursor, edit_next(editor.cursor));
       }
+      break;
+    case CTRL_KEY('k'):
+      edit_delete(editor.cursor, len);
+      break;
+    case CTRL_KEY('u'):
+      edit_delete(0, editor.cursor);
+      break;
+    case CTRL_KEY('w'):
+      edit_delete(edit_word_left(), editor.cursor);
+      break;
+    case CTRL_KEY('l'):
+      write_full(STDOUT_FILENO, "\033[H\033[2J", 7);
+      edit_redraw();
+      break;
+    case CTRL_KEY('p'):
+    case KEY_UP:
+      if (editor.history_index > 0) {
+        edit_history(editor.history_index - 1);
+      }
+      break;
+    case CTRL_KEY('n'):
+    case KEY_DOWN:
+      if (editor.history_index < history.count) {
+        edit_history(editor.history_index + 1);
+      }
+      break;
+    case '\t':
+      edit_complete();
+      break;
+    default:
+      if (key >= ' ' && key < KEY_NONE) {
+        char c = key;
+        edit_insert(&c, 1);
+      }
+      break;
+    }
+    // Pasted text is drawn once, not per character
+    if (editor.keys_pos == editor.keys_len) {
+      edit_refresh();
     }
   }
-}
 
-// Check if command should run in background
-int is_background_command(char *input) {
-  int len = strlen(input);
-  if (len > 0 && input[len - 1] == '&') {
-    return 1;
+  // Leave the whole line on the screen
+  editor.cursor = editor.line.len;
+  edit_refresh();
+  write_full(STDOUT_FILENO, status < 0 ? "^C\r\n" : "\r\n", status < 0 ? 4 : 2);
+  edit_raw(fd, 0);
+  if (status < 0) {
+    return -1;
+  }
+  size_t need = in->len + editor.line.len + 1;
+  if (need > in->cap) {
+    while (need > in->cap) {
+      in->cap *= 2;
+    }
+    in->buf = realloc(in->buf, in->cap + 1);
   }
+  memcpy(in->buf + in->len, editor.line.data, editor.line.len);
+  in->len += editor.line.len;
+  in->buf[in->len++] = '\n';
   return 0;
 }
 
-// Remove & from command
-void remove_background_symbol(char *input) {
-  int len = strlen(input);
-  if (len > 0 && input[len - 1] == '&') {
-    input[len - 1] = '\0';
-    // Remove trailing spaces
-    while (len > 0 && (input[len - 1] == ' ' || input[len - 1] == '\t')) {
-      input[len - 1] = '\0';
-      len--;
-    }
-  }
+// Set up a reader over a descriptor (terminal, script file or stdin)
+void input_open_fd(InputSource *in, int fd) {
+  memset(in, 0, sizeof(*in));
+  in->fd = fd;
+  in->cap = INPUT_CHUNK;
+  in->buf = malloc(in->cap + 1);
 }
 
-// Print colorful prompt with current directory
-void print_prompt() {
-  char cwd[MAX_INPUT];
-  char *username = getenv("USER");
-  char hostname[256];
+// Set up a reader over a -c command string
+void input_open_string(InputSource *in, const char *str) {
+  memset(in, 0, sizeof(*in));
+  in->fd = -1;
+  in->len = strlen(str);
+  in->cap = in->len;
+  in->buf = malloc(in->cap + 1);
+  memcpy(in->buf, str, in->len);
+  in->eof = 1;
+}
 
-  // Get current directory
-  if (getcwd(cwd, sizeof(cwd)) == NULL) {
-    strcpy(cwd, "unknown");
-  }
-
-  // Get hostname
-  if (gethostname(hostname, sizeof(hostname)) != 0) {
-    strcpy(hostname, "localhost");
-  }
-
-  // Shorten home directory to ~
-  char *home = getenv("HOME");
-  if (home != NULL && strncmp(cwd, home, strlen(home)) == 0) {
-    printf(COLOR_GREEN "%s@%s" COLOR_RESET ":" COLOR_BLUE "~%s" COLOR_RESET
-                       "> ",
-           username ? username : "user", hostname, cwd + strlen(home));
-  } else {
-    printf(COLOR_GREEN "%s@%s" COLOR_RESET ":" COLOR_BLUE "%s" COLOR_RESET "> ",
-           username ? username : "user", hostname, cwd);
-  }
-}
-
-// Check if command contains pipe
-int has_pipe(char *input) { return (strchr(input, '|') != NULL); }
-
-// Check if command has redirection
-int has_redirection(char *input) {
-    return (strchr(input, '>') != NULL || strchr(input, '<') != NULL);
-}
-// Execute command with I/O redirection
-void execute_with_redirection(char **args, char *input) {
-    char *input_file = NULL;
-    char *output_file = NULL;
-    char input_copy[MAX_INPUT];
-    strcpy(input_copy, input);
-    
-    // Parse for < and >
-    char *in_redir = strchr(input_copy, '<');
-    char *out_redir = strchr(input_copy, '>');
-    
-    // Extract filenames
-    if (in_redir != NULL) {
-        *in_redir = '\0';
-        in_redir++;
-        while (*in_redir == ' ' || *in_redir == '\t') in_redir++;
-        
-        char *end = in_redir;
-        while (*end != '\0' && *end != ' ' && *end != '\t' && *end != '>' && *end != '<') end++;
-        *end = '\0';
-        input_file = in_redir;
-    }
-    
-    if (out_redir != NULL) {
-        *out_redir = '\0';
-        out_redir++;
-        while (*out_redir == ' ' || *out_redir == '\t') out_redir++;
-        
-        char *end = out_redir;
-        while (*end != '\0' && *end != ' ' && *end != '\t' && *end != '>' && *end != '<') end++;
-        *end = '\0';
-        output_file = out_redir;
-    }
-    
-    // Re-parse command without redirection symbols
-    char cmd_only[MAX_INPUT];
-    strcpy(cmd_only, input_copy);
-    char *clean_args[MAX_ARGS];
-    parse_command(cmd_only, clean_args);
-    expand_args(clean_args);
-    
-    if (clean_args[0] == NULL) {
-        return;
-    }
-    
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        perror("fork");
-        return;
-    }
-    
-    if (pid == 0) {
-        // Child process - handle redirections
-        
-        // Input redirection
-        if (input_file != NULL) {
-            int fd_in = open(input_file, O_RDONLY);
-            if (fd_in < 0) {
-                fprintf(stderr, COLOR_RED "myshell: cannot open %s: No such file or directory\n" COLOR_RESET, input_file);
-                exit(1);
-            }
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
-        }
-        
-        // Output redirection
-        if (output_file != NULL) {
-            int fd_out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-            if (fd_out < 0) {
-                perror("open output file");
-                exit(1);
-            }
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
-        }
-        
-        // Execute command
-        char *cmd_path = search_in_path(clean_args[0]);
-        if (cmd_path == NULL) {
-            fprintf(stderr, COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n", clean_args[0]);
-            exit(127);
-        }
-        
-        execv(cmd_path, clean_args);
-        perror("execv");
-        exit(127);
-    } else {
-        // Parent waits
-        int status;
-        waitpid(pid, &status, 0);
+// Return the next line without its newline, or NULL at end of input (or
+// when Ctrl+C drops a line being edited; eof is not set then). Scripts and
+// piped input are pulled in INPUT_CHUNK-sized reads; like dash, commands
+// therefore do not see the unread remainder of a piped script.
+char *input_read_line(InputSource *in) {
+  while (1) {
+    char *start = in->buf + in->pos;
+    char *newline = memchr(start, '\n', in->len - in->pos);
+    if (newline != NULL) {
+      *newline = '\0';
+      in->pos = newline - in->buf + 1;
+      return start;
     }
-}
 
-// Parse input string into array of arguments
-void parse_command(char *input, char **args) {
-  int i = 0;
-  char *token;
+    if (in->eof) {
+      if (in->pos == in->len) {
+        return NULL;
+      }
+      // Last line without a trailing newline
+      in->buf[in->len] = '\0';
+      in->pos = in->len;
+      return start;
+    }
 
-  // Tokenize by spaces and tabs
-  token = strtok(input, " \t");
+    // Keep the partial line and make room for another chunk
+    memmove(in->buf, start, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+    if (in->edit) {
+      if (edit_line(in) < 0) {
+        return NULL;
+      }
+      continue;
+    }
+    if (in->cap - in->len < INPUT_CHUNK / 2) {
+      in->cap *= 2;
+      in->buf = realloc(in->buf, in->cap + 1);
+    }
 
-  while (token != NULL && i < MAX_ARGS - 1) {
-    args[i] = token;
-    i++;
-    token = strtok(NULL, " \t");
-  }
-
-  args[i] = NULL; // NULL-terminate the array
-}
-// Expand environment variables and tildes in arguments
-void expand_args(char **args) {
-    for (int i = 0; args[i] != NULL; i++) {
-        char expanded[MAX_INPUT];
-        char *arg = args[i];
-        
-        // Part 3: Tilde expansion
-        if (arg[0] == '~') {
-            char *home = getenv("HOME");
-            if (home != NULL) {
-                if (arg[1] == '\0') {
-                    // Just "~"
-                    strncpy(expanded, home, MAX_INPUT - 1);
-                    args[i] = strdup(expanded);
-                } else if (arg[1] == '/') {
-                    // "~/something"
-                    snprintf(expanded, MAX_INPUT, "%s%s", home, arg + 1);
-                    args[i] = strdup(expanded);
-                }
-            }
-        }
-        // Part 2: Environment variable expansion
-        else if (arg[0] == '$') {
-            char *var_name = arg + 1;  // Skip the $
-            char *value = getenv(var_name);
-            if (value != NULL) {
-                args[i] = strdup(value);
-            }
-        }
+    if (in->watch_children) {
+      wait_for_input(in->fd);
+    }
+    ssize_t n = read(in->fd, in->buf + in->len, in->cap - in->len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      in->eof = 1;
+    } else {
+      in->len += n;
     }
+  }
 }
 
-// Execute commands connected by pipes
-void execute_piped_commands(char *input) {
-  char *commands[MAX_ARGS];
-  int num_commands = 0;
-  char input_copy[MAX_INPUT];
+// Read, parse and run command lines until the input ends (or exit is
+// used by a --serve request). Returns the number of commands run.
+int run_input(InputSource *in) {
+  int command_count = 0;
+  while (1) {
+    // Safe point: reap finished background jobs and announce them. Every
+    // foreground child has been waited for by now, and nothing from the
+    // last line is still in use.
+    arena_reset(&cmd_arena);
+    num_reaped_fg = 0;
+    if (job_table.running > 0) {
+      jobs_reap();
+    }
+    job_notify();
 
-  // Make a copy since strtok modifies the string
-  strcpy(input_copy, input);
+    if (interactive) {
+      // Idle until the next line: a good time to write out the trace
+      trace_flush();
+      // Print fancy prompt
+      print_prompt();
+    }
 
-  // Split by pipe symbol
-  char *token = strtok(input_copy, "|");
-  while (token != NULL && num_commands < MAX_ARGS - 1) {
-    // Trim leading spaces
-    while (*token == ' ' || *token == '\t')
-      token++;
-    commands[num_commands] = token;
-    num_commands++;
-    token = strtok(NULL, "|");
-  }
+    // Read the next command line
+    char *line = input_read_line(in);
+    if (line == NULL && !in->eof) {
+      last_status = 130; // Ctrl+C at the prompt
+      continue;
+    }
+    if (line == NULL) {
+      if (interactive) {
+        printf("\n");
+      }
+      break; // EOF (Ctrl+D or end of script)
+    }
 
-  if (num_commands == 0) {
-    return;
-  }
+    char *input = line;
 
-  // Execute the pipeline
-  execute_single_pipeline(commands, num_commands);
-}
+    // History: !!, !N, !prefix and !?text repeat earlier commands; every
+    // interactive line is recorded
+    if (interactive) {
+      input = history_expand(line);
+      if (input == NULL) {
+        last_status = 1;
+        continue;
+      }
+      if (input != line) {
+        printf(COLOR_BLUE "Repeating: %s" COLOR_RESET "\n", input);
+      }
+      if (input[strspn(input, " \t")] != '\0') {
+        history_add(input);
+      }
+    }
 
-// Execute a pipeline of commands
-void execute_single_pipeline(char **commands, int num_commands) {
-  int pipes[num_commands - 1][2]; // Array of pipe pairs
-  pid_t pids[num_commands];       // Array of process IDs
+    // Here-document bodies and the rest of an unfinished command are read
+    // after the line and reuse the input buffer, so the line is kept in
+    // the arena
+    size_t input_len = strlen(input);
+    input = arena_strndup(&cmd_arena, input, input_len);
 
-  // Create all pipes
-  for (int i = 0; i < num_commands - 1; i++) {
-    if (pipe(pipes[i]) < 0) {
-      perror("pipe");
-      return;
+    // Parse the whole command into a tree in one pass
+    Parser parser;
+    long long parse_start = monotonic_us();
+    Node *tree = parse_input(&parser, input, input_len, in);
+    if (parser.heredocs != NULL) {
+      heredoc_read(&parser, in);
+    }
+    long long parse_us = monotonic_us() - parse_start;
+    stats.lines++;
+    hist_add(&stats.parse, parse_us);
+    trace_emit(&(TraceEvent){.event = "parse", .start_us = parse_start,
+                             .dur_us = parse_us, .key = "len",
+                             .value = (long)input_len});
+    if (tree == NULL || parser.error != NULL) {
+      last_status = parser.cancelled ? 130 : 2;
+      continue;
+    }
+    if (tree->num_children == 0) {
+      // Empty line or comment
+      continue;
     }
-  }
 
-  // Create a process for each command
-  for (int i = 0; i < num_commands; i++) {
-    pids[i] = fork();
+    command_count++;
 
-    if (pids[i] < 0) {
-      perror("fork");
-      return;
+    execute_node(tree);
+    fflush(stdout);
+    if (pending_exit >= 0) {
+      break;
     }
+  }
+  return command_count;
+}
 
-    if (pids[i] == 0) {
-      // CHILD PROCESS
-
-      // Parse this command's arguments
-      char *args[MAX_ARGS];
-      char cmd_copy[MAX_INPUT];
-      strcpy(cmd_copy, commands[i]);
-      parse_command(cmd_copy, args);
+// Daemon mode (bin/shell --serve SOCK; the wire format is in
+// myshell_serve.h). The master binds the socket and keeps a fixed number
+// of preforked workers alive. A worker takes one connection at a time and
+// runs each request through run_input, so its PATH cache, loaded builtins
+// and allocator stay warm from one request to the next; the directory,
+// variables and stdio a request changes are put back afterwards.
+#define SERVE_MAX_REQUEST (64L * 1024 * 1024)
 
-      if (args[0] == NULL) {
-        exit(1);
-      }
+typedef struct {
+  char **env;               // exported variables when the worker started
+  unsigned long vars_mark;  // vars.changes when they were last reset
+  int dir_fd;               // directory the server was started in
+  int null_fd;              // /dev/null, for stdio a client did not send
+} ServeWorker;
 
-      // Redirect input from previous pipe (if not first command)
-      if (i > 0) {
-        dup2(pipes[i - 1][0], STDIN_FILENO);
-      }
+ServeWorker serve_worker_state = {.dir_fd = -1, .null_fd = -1};
+volatile sig_atomic_t serve_stopping = 0;
 
-      // Redirect output to next pipe (if not last command)
-      if (i < num_commands - 1) {
-        dup2(pipes[i][1], STDOUT_FILENO);
-      }
+void serve_stop_handler(int sig) {
+  (void)sig;
+  serve_stopping = 1;
+}
 
-      // Close all pipe file descriptors in child
-      for (int j = 0; j < num_commands - 1; j++) {
-        close(pipes[j][0]);
-        close(pipes[j][1]);
-      }
+// A client that hangs up early should cost a request, not the worker:
+// with a handler (unlike SIG_IGN) writes fail with EPIPE and exec still
+// gives commands the default action back
+void serve_sigpipe_handler(int sig) { (void)sig; }
 
-      // Execute the command
-      if (execvp(args[0], args) < 0) {
-        fprintf(stderr,
-                COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n",
-                args[0]);
-        exit(127);
-      }
+// Read exactly len bytes. Returns 1, 0 at a clean end of stream, or -1.
+int read_full(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *)buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 && done == 0 ? 0 : -1;
     }
+    done += n;
   }
+  return 1;
+}
 
-  // PARENT PROCESS
+// Fill in a Unix socket address; -1 (after saying so) if path is too long
+int serve_address(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, COLOR_RED "myshell: %s: socket path too long" COLOR_RESET
+            "\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
 
-  // Close all pipes in parent
-  for (int i = 0; i < num_commands - 1; i++) {
-    close(pipes[i][0]);
-    close(pipes[i][1]);
+// Bind and listen on path, readable only by this user. A socket left
+// behind by a server that died is replaced; a live one is an error.
+int serve_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (serve_address(&addr, path) < 0) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, COLOR_RED "myshell: socket: %s" COLOR_RESET "\n",
+            strerror(errno));
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, COLOR_RED "myshell: %s: already being served"
+            COLOR_RESET "\n", path);
+    close(fd);
+    return -1;
   }
+  if (errno == ECONNREFUSED) {
+    unlink(path);
+  }
+  close(fd);
 
-  // Wait for all children to finish
-  for (int i = 0; i < num_commands; i++) {
-    int status;
-    waitpid(pids[i], &status, 0);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t old_mask = umask(077);
+  int err = fd < 0 ? -1 : bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+  if (err < 0 || listen(fd, SOMAXCONN) < 0) {
+    fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", path,
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
   }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
 }
 
-// Check if command is a built-in
-int is_builtin(char **args) {
-  if (strcmp(args[0], "cd") == 0)
-    return 1;
-  if (strcmp(args[0], "pwd") == 0)
-    return 1;
-  if (strcmp(args[0], "exit") == 0)
-    return 1;
-  if (strcmp(args[0], "echo") == 0)
-    return 1;
-  if (strcmp(args[0], "help") == 0)
-    return 1;
-  if (strcmp(args[0], "clear") == 0)
-    return 1;
-  if (strcmp(args[0], "jobs") == 0)
-    return 1;
-
-  return 0;
+long long timeval_us(const struct timeval *tv) {
+  return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
 }
 
-// Execute built-in commands
-void execute_builtin(char **args) {
-  // cd command
-  if (strcmp(args[0], "cd") == 0) {
-    if (args[1] == NULL) {
-      // No argument - go to home directory
-      char *home = getenv("HOME");
-      if (home != NULL) {
-        if (chdir(home) != 0) {
-          perror("cd");
-        }
-      } else {
-        fprintf(stderr, COLOR_RED "cd: HOME not set" COLOR_RESET "\n");
-      }
-    } else if (strcmp(args[1], "-") == 0) {
-      // cd - goes to previous directory
-      char *oldpwd = getenv("OLDPWD");
-      if (oldpwd != NULL) {
-        printf("%s\n", oldpwd);
-        if (chdir(oldpwd) != 0) {
-          perror("cd");
+// Run one request from conn and send its reply. Returns -1 once the
+// client has gone or sent something that is not a request.
+int serve_request(int conn) {
+  ServeWorker *w = &serve_worker_state;
+  MyshellRequest req;
+  int fds[3];
+  int num_fds = 0;
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t n;
+  do {
+    n = recvmsg(conn, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return -1;
+  }
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+       c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      // Keep at most stdin, stdout and stderr; anything past those is
+      // closed rather than written past fds
+      int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (int i = 0; i < count; i++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+        if (num_fds < 3) {
+          fds[num_fds++] = fd;
+        } else {
+          close(fd);
         }
-      } else {
-        fprintf(stderr, COLOR_RED "cd: OLDPWD not set" COLOR_RESET "\n");
-      }
-    } else {
-      // Save current directory as OLDPWD
-      char cwd[MAX_INPUT];
-      if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        setenv("OLDPWD", cwd, 1);
-      }
-
-      // Change to specified directory
-      if (chdir(args[1]) != 0) {
-        perror("cd");
       }
     }
-    return;
+  }
+  for (int i = 0; i < num_fds; i++) {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
   }
 
-  // pwd command
-  if (strcmp(args[0], "pwd") == 0) {
-    char cwd[MAX_INPUT];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-      printf("%s\n", cwd);
-    } else {
-      perror("pwd");
+  // The header may have arrived in pieces; the payload follows it
+  char *data = NULL;
+  size_t total = 0;
+  // Descriptors cut off for lack of control space make it a bad request
+  int ok = (msg.msg_flags & MSG_CTRUNC) == 0 &&
+           ((size_t)n == sizeof(req) ||
+            read_full(conn, (char *)&req + n, sizeof(req) - n) > 0);
+  if (ok) {
+    total = (size_t)req.command_len + req.cwd_len + req.env_len;
+    ok = req.magic == MYSHELL_SERVE_MAGIC && total <= SERVE_MAX_REQUEST;
+  }
+  if (ok) {
+    data = malloc(total + 1);
+    ok = total == 0 || read_full(conn, data, total) > 0;
+  }
+  if (!ok) {
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
     }
-    return;
+    free(data);
+    return -1;
   }
+  data[total] = '\0';
+  char *command = strndup(data, req.command_len);
+  char *cwd = strndup(data + req.command_len, req.cwd_len);
+  char *env = data + req.command_len + req.cwd_len;
+  char *env_end = env + req.env_len;
 
-  // echo command
-  if (strcmp(args[0], "echo") == 0) {
-    for (int i = 1; args[i] != NULL; i++) {
-      printf("%s", args[i]);
-      if (args[i + 1] != NULL) {
-        printf(" ");
-      }
+  // The client's descriptors become this request's stdin, stdout, stderr
+  int next = 0;
+  for (int i = 0; i < 3; i++) {
+    int from = w->null_fd;
+    if ((req.fds & (1u << i)) && next < num_fds) {
+      from = fds[next++];
     }
-    printf("\n");
-    return;
+    dup2(from, i);
   }
-
-  // clear command
-  if (strcmp(args[0], "clear") == 0) {
-    printf("\033[2J\033[H"); // Clear screen and move cursor to top
-    return;
+  for (int i = 0; i < num_fds; i++) {
+    close(fds[i]);
   }
 
-  // help command
-  if (strcmp(args[0], "help") == 0) {
-    printf("\n");
-    printf("═══════════════════════════════════════════════════════════\n");
-    printf("                   " COLOR_GREEN "MyShell Help" COLOR_RESET "\n");
-    printf("═══════════════════════════════════════════════════════════\n");
-    printf("\n");
-    printf(COLOR_BLUE "Built-in Commands:" COLOR_RESET "\n");
-    printf("  cd [dir]       Change directory\n");
-    printf("                 - cd          : Go to home directory\n");
-    printf("                 - cd -        : Go to previous directory\n");
-    printf("                 - cd /path    : Go to specified path\n");
-    printf("\n");
-    printf("  pwd            Print current working directory\n");
-    printf("  echo [text]    Print text to screen\n");
-    printf("  clear          Clear the screen\n");
-    printf("  jobs           List background jobs\n");
-    printf("  help           Show this help message\n");
-    printf("  exit           Exit the shell\n");
-    printf("\n");
-    printf(COLOR_BLUE "Special Features:" COLOR_RESET "\n");
-    printf("  !!             Repeat the last command\n");
-    printf("  Ctrl+C         Cancel current input (doesn't exit shell)\n");
-    printf("  Ctrl+D         Exit the shell\n");
-    printf("\n");
-    printf(COLOR_BLUE "Piping:" COLOR_RESET "\n");
-    printf("  cmd1 | cmd2    Connect output of cmd1 to input of cmd2\n");
-    printf("  Examples:\n");
-    printf("    ls | grep txt       - List files containing 'txt'\n");
-    printf("    cat file | wc -l    - Count lines in file\n");
-    printf("    ps aux | grep user  - Find processes by user\n");
-    printf("\n");
-    printf(COLOR_BLUE "Background Processing:" COLOR_RESET "\n");
-    printf("  command &      Run command in background\n");
-    printf("  Examples:\n");
-    printf("    sleep 10 &         - Sleep for 10 seconds in background\n");
-    printf("    long_task &        - Run long task without blocking shell\n");
-    printf("    jobs               - List running background jobs\n");
-    printf("\n");
-    printf(COLOR_BLUE "External Commands:" COLOR_RESET "\n");
-    printf("  You can run any system command like:\n");
-    printf("  ls, cat, grep, date, whoami, etc.\n");
-    printf("\n");
-    printf("═══════════════════════════════════════════════════════════\n");
-    printf("\n");
-    return;
-  }
-  // jobs command
-  if (strcmp(args[0], "jobs") == 0) {
-    int active_jobs = 0;
-    for (int i = 0; i < job_count; i++) {
-      if (!jobs[i].completed) {
-        printf("[%d]  Running                 %s &\n", jobs[i].job_id,
-               jobs[i].command);
-        active_jobs++;
+  struct rusage self_before, children_before;
+  getrusage(RUSAGE_SELF, &self_before);
+  getrusage(RUSAGE_CHILDREN, &children_before);
+  long long start_us = monotonic_us();
+
+  last_status = 0;
+  if (cwd[0] != '\0' && chdir(cwd) != 0) {
+    fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", cwd,
+            strerror(errno));
+    last_status = 1;
+  } else {
+    while (env < env_end) {
+      size_t len = strlen(env);
+      char *eq = memchr(env, '=', len);
+      if (eq == NULL) {
+        var_unset(env);
+      } else if (eq > env) {
+        var_set(env, eq - env, eq + 1, VAR_EXPORT);
       }
+      env += len + 1;
     }
-    if (active_jobs == 0) {
-      printf("No background jobs.\n");
+    InputSource in;
+    input_open_string(&in, command);
+    run_input(&in);
+    free(in.buf);
+    if (pending_exit >= 0) {
+      last_status = pending_exit;
     }
-    return;
   }
+  fflush(stdout);
+  fflush(stderr);
 
-  // exit command
-  if (strcmp(args[0], "exit") == 0) {
-    if (args[1] != NULL) {
-      // Exit with specific code if provided
-      int code = atoi(args[1]);
-      exit(code);
-    }
-    exit(0);
+  MyshellReply reply = {.magic = MYSHELL_SERVE_MAGIC, .status = last_status};
+  struct rusage self_after, children_after;
+  getrusage(RUSAGE_SELF, &self_after);
+  getrusage(RUSAGE_CHILDREN, &children_after);
+  reply.wall_us = monotonic_us() - start_us;
+  reply.user_us = timeval_us(&self_after.ru_utime) -
+                  timeval_us(&self_before.ru_utime) +
+                  timeval_us(&children_after.ru_utime) -
+                  timeval_us(&children_before.ru_utime);
+  reply.sys_us = timeval_us(&self_after.ru_stime) -
+                 timeval_us(&self_before.ru_stime) +
+                 timeval_us(&children_after.ru_stime) -
+                 timeval_us(&children_before.ru_stime);
+  reply.maxrss_kb = rusage_maxrss_kb(&children_after);
+
+  // Put the worker back the way the next request expects it
+  for (int i = 0; i < 3; i++) {
+    dup2(w->null_fd, i);
+  }
+  clearerr(stdout);
+  clearerr(stderr);
+  if (fchdir(w->dir_fd) != 0) {
+    _exit(1); // the master starts a fresh worker
+  }
+  if (vars.changes != w->vars_mark) {
+    vars_reset(w->env);
+    w->vars_mark = vars.changes;
   }
+  funcs_reset();
+  pending_exit = -1;
+  last_status = 0;
+  free(command);
+  free(cwd);
+  free(data);
+  return write_full(conn, (const char *)&reply, sizeof(reply));
 }
 
-// Execute external commands using fork and exec
-void execute_external(char **args) {
-  pid_t pid = fork();
+// A worker: accept connections one at a time and serve their requests
+void serve_worker(int listen_fd) {
+  ServeWorker *w = &serve_worker_state;
+  serving = 1;
+  shell_pid = getpid();
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGPIPE, serve_sigpipe_handler);
+  child_events_init();
 
-  if (pid < 0) {
-    // Fork failed
-    perror("fork");
-    return;
+  // Snapshot the environment that every request starts from
+  char **env = var_environ();
+  size_t n = 0;
+  while (env[n] != NULL) {
+    n++;
   }
+  w->env = malloc((n + 1) * sizeof(char *));
+  for (size_t i = 0; i < n; i++) {
+    w->env[i] = strdup(env[i]);
+  }
+  w->env[n] = NULL;
+  w->vars_mark = vars.changes;
 
-  if (pid == 0) {
-    // Child process
-    char *cmd_path = search_in_path(args[0]);
-    
-    if (cmd_path == NULL) {
-      fprintf(stderr, COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n", args[0]);
-      exit(127);
-    }
-    
-    if (execv(cmd_path, args) < 0) {
-      perror("execv");
-      exit(127);
-    }
-  } else {
-    // Parent process
-    int status;
-    waitpid(pid, &status, 0); // Wait for child to complete
+  w->dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  w->null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (w->dir_fd < 0 || w->null_fd < 0) {
+    _exit(1);
+  }
+  for (int i = 0; i < 3; i++) {
+    dup2(w->null_fd, i);
+  }
 
-    // Check exit status
-    if (WIFEXITED(status)) {
-      int exit_code = WEXITSTATUS(status);
-      if (exit_code != 0) {
-        printf(COLOR_YELLOW "[Process exited with code %d]" COLOR_RESET "\n",
-               exit_code);
+  while (1) {
+    int conn = accept(listen_fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
       }
-    } else if (WIFSIGNALED(status)) {
-      int signal_num = WTERMSIG(status);
-      printf(COLOR_RED "[Process terminated by signal %d]" COLOR_RESET "\n",
-             signal_num);
+      _exit(1);
+    }
+    fcntl(conn, F_SETFD, FD_CLOEXEC);
+    while (serve_request(conn) == 0) {
     }
+    close(conn);
   }
 }
-// Search for command in PATH
-char* search_in_path(const char *command) {
-    // If command contains /, don't search PATH
-    if (strchr(command, '/') != NULL) {
-        return strdup(command);
+
+// --serve SOCK: keep workers running until SIGTERM or SIGINT, then stop
+// them and remove the socket
+int serve_main(const char *path, long workers) {
+  int listen_fd = serve_listen(path);
+  if (listen_fd < 0) {
+    return 1;
+  }
+  // No SA_RESTART: the signal has to interrupt waitpid below
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_stop_handler;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  pid_t *pids = calloc(workers, sizeof(pid_t));
+  while (!serve_stopping) {
+    for (long i = 0; i < workers; i++) {
+      if (pids[i] > 0) {
+        continue;
+      }
+      pids[i] = fork();
+      if (pids[i] == 0) {
+        serve_worker(listen_fd);
+      } else if (pids[i] < 0) {
+        fprintf(stderr, COLOR_RED "myshell: fork: %s" COLOR_RESET "\n",
+                strerror(errno));
+        sleep(1);
+      }
     }
-    
-    char *path_env = getenv("PATH");
-    if (path_env == NULL) {
-        return NULL;
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0 && errno != EINTR) {
+      break;
     }
-    
-    char path_copy[MAX_INPUT];
-    strncpy(path_copy, path_env, MAX_INPUT - 1);
-    
-    char *dir = strtok(path_copy, ":");
-    static char full_path[MAX_INPUT];
-    
-    while (dir != NULL) {
-        snprintf(full_path, MAX_INPUT, "%s/%s", dir, command);
-        
-        // Check if executable exists
-        if (access(full_path, X_OK) == 0) {
-            return full_path;
-        }
-        
-        dir = strtok(NULL, ":");
+    for (long i = 0; i < workers; i++) {
+      if (pids[i] == pid) {
+        pids[i] = 0; // replaced on the next pass
+      }
+    }
+  }
+
+  for (long i = 0; i < workers; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGTERM);
     }
-    
-    return NULL;  // Command not found
+  }
+  while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+  }
+  unlink(path);
+  close(listen_fd);
+  free(pids);
+  return 0;
 }
 
-// Execute external commands with background support
-void execute_external_background(char **args, int background,
-                                 char *original_cmd) {
-  pid_t pid = fork();
+// --connect SOCK -c command: run command on a --serve daemon with this
+// process's directory, environment and stdio, and exit with its status
+int connect_main(const char *path, int argc, char **argv) {
+  if (argc != 2 || strcmp(argv[0], "-c") != 0) {
+    fprintf(stderr, "usage: myshell --connect SOCK -c command\n");
+    return 2;
+  }
+  struct sockaddr_un addr;
+  if (serve_address(&addr, path) < 0) {
+    return 127;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, COLOR_RED "myshell: %s: %s" COLOR_RESET "\n", path,
+            strerror(errno));
+    return 127;
+  }
 
-  if (pid < 0) {
-    perror("fork");
-    return;
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    cwd[0] = '\0';
+  }
+  StrBuf env = {0};
+  for (char **e = environ; *e != NULL; e++) {
+    sb_append(&env, *e, strlen(*e) + 1);
   }
+  MyshellRequest req = {.magic = MYSHELL_SERVE_MAGIC,
+                        .fds = MYSHELL_SERVE_STDIN | MYSHELL_SERVE_STDOUT |
+                               MYSHELL_SERVE_STDERR,
+                        .command_len = strlen(argv[1]),
+                        .cwd_len = strlen(cwd),
+                        .env_len = env.len};
 
-  if (pid == 0) {
-    // Child process
-    if (execvp(args[0], args) < 0) {
-      fprintf(stderr,
-              COLOR_RED "myshell: command not found: %s" COLOR_RESET "\n",
-              args[0]);
-      exit(127);
-    }
-  } else {
-    // Parent process
-    if (background) {
-      // Background process - don't wait
-      if (job_count < MAX_JOBS) {
-        jobs[job_count].pid = pid;
-        jobs[job_count].job_id = job_count + 1;
-        strncpy(jobs[job_count].command, original_cmd, MAX_INPUT - 1);
-        jobs[job_count].completed = 0;
+  // The header carries stdin, stdout and stderr; the payload follows
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
 
-        printf("[%d] %d\n", jobs[job_count].job_id, pid);
-        job_count++;
-      }
-    } else {
-      // Foreground process - wait for completion
-      int status;
-      waitpid(pid, &status, 0);
-
-      // Check exit status
-      if (WIFEXITED(status)) {
-        int exit_code = WEXITSTATUS(status);
-        if (exit_code != 0) {
-          printf(COLOR_YELLOW "[Process exited with code %d]" COLOR_RESET "\n",
-                 exit_code);
-        }
-      } else if (WIFSIGNALED(status)) {
-        int signal_num = WTERMSIG(status);
-        printf(COLOR_RED "[Process terminated by signal %d]" COLOR_RESET "\n",
-               signal_num);
-      }
-    }
+  signal(SIGPIPE, SIG_IGN);
+  MyshellReply reply;
+  ssize_t sent;
+  do {
+    sent = sendmsg(fd, &msg, 0);
+  } while (sent < 0 && errno == EINTR);
+  int ok = sent == (ssize_t)sizeof(req) &&
+           write_full(fd, argv[1], req.command_len) == 0 &&
+           write_full(fd, cwd, req.cwd_len) == 0 &&
+           write_full(fd, env.data, env.len) == 0 &&
+           read_full(fd, &reply, sizeof(reply)) > 0 &&
+           reply.magic == MYSHELL_SERVE_MAGIC;
+  free(env.data);
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, COLOR_RED "myshell: %s: no reply from server" COLOR_RESET
+            "\n", path);
+    return 127;
   }
+  return reply.status;
 }
 
-int main() {
-  char input[MAX_INPUT];
-  char *args[MAX_ARGS];
-  char last_command[MAX_INPUT] = "";
-  int command_count = 0;
+int main(int argc, char *argv[]) {
+  InputSource in;
 
-  // Install signal handler for Ctrl+C
-  signal(SIGINT, sigint_handler);
-  signal(SIGCHLD, sigchld_handler);
+  vars_init();
 
-  // Welcome message
-  printf("\n");
-  printf("╔════════════════════════════════════════════╗\n");
-  printf("║    Welcome to MyShell Enhanced + Pipes!    ║\n");
-  printf("║                                            ║\n");
-  printf("║  Type 'help' for available commands        ║\n");
-  printf("║  Piping & Background jobs supported!       ║\n");
-  printf("║  Example: ls | grep txt                    ║\n");
-  printf("╚════════════════════════════════════════════╝\n");
-  printf("\n");
+  // --trace=FILE logs execution events (see trace_emit)
+  int arg = 1;
+  if (arg < argc && strncmp(argv[arg], "--trace=", 8) == 0) {
+    trace.path = strdup(argv[arg] + 8);
+    trace_changed();
+    arg++;
+  }
+  atexit(trace_flush);
 
-  // Main shell loop
-  while (1) {
-    // Print fancy prompt
-    print_prompt();
-    fflush(stdout);
+  // --serve SOCK [--workers=N] runs as a daemon; --connect SOCK -c command
+  // is its client (see myshell_serve.h)
+  if (arg + 1 < argc && strcmp(argv[arg], "--serve") == 0) {
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (arg + 2 < argc && strncmp(argv[arg + 2], "--workers=", 10) == 0) {
+      workers = atol(argv[arg + 2] + 10);
+    }
+    return serve_main(argv[arg + 1], workers < 1 ? 1 : workers);
+  }
+  if (arg + 1 < argc && strcmp(argv[arg], "--connect") == 0) {
+    return connect_main(argv[arg + 1], argc - arg - 2, argv + arg + 2);
+  }
 
-    // Read user input
-    if (fgets(input, MAX_INPUT, stdin) == NULL) {
-      printf("\n");
-      break; // EOF (Ctrl+D)
+  // bin/shell -c 'commands', bin/shell script.sh, or commands on stdin
+  if (arg < argc && strcmp(argv[arg], "-c") == 0) {
+    if (arg + 1 >= argc) {
+      fprintf(stderr, "myshell: -c: option requires an argument\n");
+      return 2;
+    }
+    input_open_string(&in, argv[arg + 1]);
+    // -c 'commands' NAME ARGS... sets $0 and the positional parameters
+    if (arg + 2 < argc) {
+      shell_name = argv[arg + 2];
+      pos_set(argv + arg + 3);
     }
+  } else if (arg < argc) {
+    int fd = open(argv[arg], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "myshell: %s: %s\n", argv[arg], strerror(errno));
+      return 127;
+    }
+    input_open_fd(&in, fd);
+    shell_name = argv[arg];
+    pos_set(argv + arg + 1);
+  } else {
+    input_open_fd(&in, STDIN_FILENO);
+    interactive = isatty(STDIN_FILENO);
+  }
 
-    // Remove trailing newline
-    input[strcspn(input, "\n")] = '\0';
+  // Child exits are picked up from child_event_fd in the main loop
+  child_events_init();
+  job_slots = sysconf(_SC_NPROCESSORS_ONLN);
+  if (job_slots < 1) {
+    job_slots = 1;
+  }
+  in.watch_children = interactive;
 
-    // Handle !! (repeat last command)
-    if (strcmp(input, "!!") == 0) {
-      if (strlen(last_command) == 0) {
-        printf(COLOR_YELLOW "myshell: no previous command" COLOR_RESET "\n");
-        continue;
-      }
-      strcpy(input, last_command);
-      printf(COLOR_BLUE "Repeating: %s" COLOR_RESET "\n", input);
-    } else if (strlen(input) > 0) {
-      // Save non-empty command as last command
-      strcpy(last_command, input);
-    }
+  if (interactive) {
+    prompt_init();
+    edit_init(STDIN_FILENO);
+    in.edit = editor.enabled;
 
-    // Skip empty commands
-    if (strlen(input) == 0) {
-      continue;
-    }
+    // Install signal handler for Ctrl+C
+    signal(SIGINT, sigint_handler);
 
-    // Increment command counter
-    command_count++;
-    // Check for background command
-    int background = is_background_command(input);
-    char original_cmd[MAX_INPUT];
-    strcpy(original_cmd, input);
-
-    if (background) {
-      remove_background_symbol(input);
-    }
-
-    // Check if command has pipes
-    if (has_pipe(input)) {
-      // Handle piped commands
-      if (background) {
-        printf(COLOR_YELLOW
-               "Warning: Background piping not supported\n" COLOR_RESET);
-      }
-      execute_piped_commands(input);
-	} else if (has_redirection(input)) {
-            // Handle I/O redirection
-            if (background) {
-                printf(COLOR_YELLOW "Warning: Background redirection not fully supported\n" COLOR_RESET);
-            }
-            execute_with_redirection(NULL, input);
-    } else {
-      // Handle regular commands
-      parse_command(input, args);
-      
-      // Expand environment variables and tildes
-      expand_args(args);
-    
-      if (args[0] == NULL) {
-        continue;
-      }
-    
-      if (is_builtin(args)) {
-        if (background) {
-          printf(COLOR_YELLOW "Warning: Cannot run built-in commands in "
-                              "background\n" COLOR_RESET);
-        }
-        execute_builtin(args);
-      } else {
-        // Use new function with background support
-        execute_external_background(args, background, original_cmd);
-      }
-    }
+    // Welcome message
+    printf("\n");
+    printf("╔════════════════════════════════════════════╗\n");
+    printf("║    Welcome to MyShell Enhanced + Pipes!    ║\n");
+    printf("║                                            ║\n");
+    printf("║  Type 'help' for available commands        ║\n");
+    printf("║  Piping & Background jobs supported!       ║\n");
+    printf("║  Example: ls | grep txt                    ║\n");
+    printf("╚════════════════════════════════════════════╝\n");
+    printf("\n");
   }
-      
-  printf("\n");
-  printf(COLOR_GREEN "Thanks for using MyShell!" COLOR_RESET "\n");
+
+  // Main shell loop
+  int command_count = run_input(&in);
+
+  if (interactive) {
+    printf("\n");
+    printf(COLOR_GREEN "Thanks for using MyShell!" COLOR_RESET "\n");
     printf("You executed %d command(s) in this session.\n", command_count);
-  printf("Goodbye! 👋\n\n");
-  
-  return 0;
+    printf("Goodbye! 👋\n\n");
+  }
+
+  fflush(stdout);
+  return last_status;
 }
 
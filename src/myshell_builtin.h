@@ -0,0 +1,39 @@
+// Interface for builtins loaded at run time with enable -f.
+//
+// A shared object provides the builtin NAME by exporting a MyshellBuiltin
+// called NAME_builtin:
+//
+//   #include "myshell_builtin.h"
+//
+//   static int hello_run(int argc, char **argv) {
+//     printf("hello, %s\n", argc > 1 ? argv[1] : "world");
+//     return 0;
+//   }
+//
+//   MyshellBuiltin hello_builtin = {MYSHELL_BUILTIN_ABI, "hello", hello_run,
+//                                   "Say hello"};
+//
+// Build it with cc -shared -fPIC -Isrc -o hello.so hello.c and load it with
+// enable -f ./hello.so hello.
+//
+// run gets the expanded words of the command (argv[argc] is NULL) and
+// returns its exit status. A simple command runs in the shell process with
+// its redirections already applied to descriptors 0-2, so run must not
+// call exit() and must free what it allocates; a pipeline stage runs in a
+// forked child. Write with stdio or write(2); stdout is flushed after run
+// returns.
+
+#ifndef MYSHELL_BUILTIN_H
+#define MYSHELL_BUILTIN_H
+
+// Bumped whenever MyshellBuiltin changes; enable -f refuses a mismatch
+#define MYSHELL_BUILTIN_ABI 1
+
+typedef struct {
+  int abi;                             // MYSHELL_BUILTIN_ABI
+  const char *name;                    // for messages; NAME_builtin decides
+  int (*run)(int argc, char **argv);   // the builtin itself
+  const char *help;                    // one line for help, or NULL
+} MyshellBuiltin;
+
+#endif
@@ -0,0 +1,52 @@
+// Wire format of bin/shell --serve SOCK.
+//
+// A client connects to the Unix stream socket and sends any number of
+// requests, one at a time; each gets one reply. A request is a
+// MyshellRequest followed by command_len bytes of command text, cwd_len
+// bytes of directory and env_len bytes of environment changes. The
+// command is run as if by bin/shell -c. An empty cwd means the
+// directory the server started in. The environment changes are
+// NUL-terminated entries: NAME=value sets and exports NAME, and a bare
+// NAME unsets it.
+//
+// The client's stdin, stdout and stderr can ride along with the header as
+// SCM_RIGHTS descriptors on the same sendmsg. The fds bits say which were
+// sent, in stdin, stdout, stderr order. Descriptors that are not sent
+// become /dev/null.
+//
+// The reply is a MyshellReply: the exit status, and the wall-clock and CPU
+// time the request took, both in the shell and in its children. Integers
+// are in host byte order; the socket never leaves the machine.
+//
+// bin/shell --connect SOCK -c 'command' is a client that sends its own cwd,
+// environment and stdio and exits with the status from the reply.
+
+#ifndef MYSHELL_SERVE_H
+#define MYSHELL_SERVE_H
+
+#include <stdint.h>
+
+#define MYSHELL_SERVE_MAGIC 0x4d795368 // "MySh"
+
+#define MYSHELL_SERVE_STDIN 1
+#define MYSHELL_SERVE_STDOUT 2
+#define MYSHELL_SERVE_STDERR 4
+
+typedef struct {
+  uint32_t magic; // MYSHELL_SERVE_MAGIC
+  uint32_t fds;   // MYSHELL_SERVE_* bits
+  uint32_t command_len;
+  uint32_t cwd_len;
+  uint32_t env_len;
+} MyshellRequest;
+
+typedef struct {
+  uint32_t magic;     // MYSHELL_SERVE_MAGIC
+  int32_t status;     // as $? would show it; 128+N for signal N
+  int64_t wall_us;
+  int64_t user_us;    // shell and children
+  int64_t sys_us;
+  int64_t maxrss_kb;  // largest child
+} MyshellReply;
+
+#endif